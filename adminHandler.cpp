@@ -0,0 +1,314 @@
+#include <arpa/inet.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cctype>
+#include <atomic>
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+#include "adminHandler.hpp"
+#include "threadPoolServer.hpp"
+#include "latencyHistogram.hpp"
+
+#define METRICS_PREFIX     "kvstore_" // Prefix of the names of all metrics.
+#define SCAN_DEFAULT_LIMIT 100        // Max number of pairs returned by a scan without a limit parameter.
+#define SCAN_MAX_LIMIT     10000      // Max limit of a scan.
+
+namespace multicore {
+
+extern std::atomic_ulong stat_num_lookup;
+extern std::atomic_ulong stat_num_insert;
+extern std::atomic_ulong stat_num_delete;
+extern LatencyRecorder latencies;
+extern ThreadPoolServer *server;
+
+// Append the HELP and TYPE lines of a metric.
+static void describe(std::string &out, const char *name, const char *type, const char *help) {
+    out += "# HELP " METRICS_PREFIX;
+    out += name;
+    out += ' ';
+    out += help;
+    out += "\n# TYPE " METRICS_PREFIX;
+    out += name;
+    out += ' ';
+    out += type;
+    out += '\n';
+}
+
+// Append one sample of a metric. labels is either empty or of the form {name="value",...}.
+static void sample(std::string &out, const char *name, const char *labels, double value) {
+    char line[256];
+    // Counts are printed exactly, other values with about the precision the latencies are recorded with.
+    snprintf(line, sizeof(line), value == (double) (unsigned long) value ? METRICS_PREFIX "%s%s %.0f\n" : METRICS_PREFIX "%s%s %.9g\n",
+             name, labels, value);
+    out += line;
+}
+
+// Append a single-sample metric.
+static void metric(std::string &out, const char *name, const char *type, const char *help, double value) {
+    describe(out, name, type, help);
+    sample(out, name, "", value);
+}
+
+void renderMetrics(ThreadSafeKVStore *store, std::string &out) {
+    char labels[128];
+    describe(out, "requests_total", "counter", "Number of requests served, by operation.");
+    sample(out, "requests_total", "{op=\"lookup\"}", stat_num_lookup.load());
+    sample(out, "requests_total", "{op=\"insert\"}", stat_num_insert.load());
+    sample(out, "requests_total", "{op=\"delete\"}", stat_num_delete.load());
+
+    describe(out, "request_latency_seconds", "summary",
+             "Latency of requests from their connection becoming ready to their response being sent.");
+    static const char *opLabels[NUM_LATENCY_OPS] = {"get_hit", "get_miss", "post", "delete", "batch"};
+    static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    uint64_t maxLatency[NUM_LATENCY_OPS];
+    for (int op = 0; op < NUM_LATENCY_OPS; ++op) {
+        LatencyHistogram h;
+        latencies.collect((LatencyOp) op, h);
+        for (double q : quantiles) {
+            snprintf(labels, sizeof(labels), "{op=\"%s\",quantile=\"%g\"}", opLabels[op], q);
+            sample(out, "request_latency_seconds", labels, h.percentile(q * 100) / 1e9);
+        }
+        snprintf(labels, sizeof(labels), "{op=\"%s\"}", opLabels[op]);
+        sample(out, "request_latency_seconds_sum", labels, h.mean() * h.count() / 1e9);
+        sample(out, "request_latency_seconds_count", labels, h.count());
+        maxLatency[op] = h.max();
+    }
+    describe(out, "request_latency_max_seconds", "gauge", "Max latency of requests since the statistics were reset.");
+    for (int op = 0; op < NUM_LATENCY_OPS; ++op) {
+        snprintf(labels, sizeof(labels), "{op=\"%s\"}", opLabels[op]);
+        sample(out, "request_latency_max_seconds", labels, maxLatency[op] / 1e9);
+    }
+
+    if (server != nullptr) {
+        ServerStats serverStats;
+        server->getStats(serverStats);
+        metric(out, "connections_accepted_total", "counter", "Number of connections accepted.", serverStats.acceptedConnections);
+        metric(out, "connections_active", "gauge", "Number of open connections.", serverStats.activeConnections);
+        metric(out, "task_queue_depth", "gauge", "Number of ready connections waiting in the run queues.", serverStats.queuedTasks);
+        metric(out, "pool_threads", "gauge", "Number of threads in the thread pool.", serverStats.poolThreads);
+        metric(out, "async_disk_reads_total", "counter", "Number of values read from disk through io_uring.", serverStats.asyncReads);
+        metric(out, "io_uring_submits_total", "counter", "Number of system calls submitting batches of reads to io_uring.",
+               serverStats.ioSubmits);
+        metric(out, "requests_shed_total", "counter", "Number of requests answered with 503 for waiting too long in a run queue.",
+               serverStats.shedRequests);
+        metric(out, "connections_refused_total", "counter", "Number of connections refused because too many tasks were queued.",
+               serverStats.refusedConnections);
+    }
+
+    KVStoreStats storeStats;
+    store->getStats(storeStats);
+    metric(out, "cache_hits_total", "counter", "Number of lookups answered from memory.", storeStats.cacheHits);
+    metric(out, "cache_misses_total", "counter", "Number of lookups that went to disk.", storeStats.cacheMisses);
+    metric(out, "cache_evictions_total", "counter", "Number of key-value pairs evicted from the cache.", storeStats.evictions);
+    metric(out, "cache_entries", "gauge", "Number of key-value pairs in the cache.", storeStats.cacheEntries);
+    metric(out, "cache_resident_bytes", "gauge", "Bytes charged to the cache.", storeStats.residentBytes);
+    metric(out, "index_bytes", "gauge", "Bytes of the ordered index of all the keys, charged to the cache.", storeStats.indexBytes);
+    metric(out, "cache_budget_bytes", "gauge", "Byte budget of the cache.", storeStats.cacheBytes);
+    metric(out, "expired_keys_total", "counter", "Number of keys removed because their TTL ran out.", storeStats.expirations);
+    metric(out, "pending_writes", "gauge", "Number of writes waiting to be written to disk.", storeStats.pendingWrites);
+    describe(out, "disk_operations_total", "counter", "Number of operations on the disk tier, by type.");
+    sample(out, "disk_operations_total", "{op=\"read\"}", storeStats.diskReads);
+    sample(out, "disk_operations_total", "{op=\"write\"}", storeStats.diskWrites);
+    sample(out, "disk_operations_total", "{op=\"delete\"}", storeStats.diskDeletes);
+    metric(out, "filter_bytes", "gauge", "Size of the Bloom filters of the keys on disk.", storeStats.filterBytes);
+    metric(out, "filter_negatives_total", "counter", "Number of reads from disk answered by the Bloom filters.",
+           storeStats.filterNegatives);
+    metric(out, "filter_false_positives_total", "counter", "Number of reads of keys not on disk which the Bloom filters did not rule out.",
+           storeStats.filterFalsePositives);
+    metric(out, "filter_rebuilds_total", "counter", "Number of times a Bloom filter was rebuilt.", storeStats.filterRebuilds);
+    metric(out, "wal_records_total", "counter", "Number of records appended to the write-ahead logs.", storeStats.logRecords);
+    metric(out, "wal_writes_total", "counter", "Number of writes to the write-ahead logs, each committing a group of records.",
+           storeStats.logWrites);
+    metric(out, "wal_syncs_total", "counter", "Number of syncs of the write-ahead logs.", storeStats.logSyncs);
+    metric(out, "wal_bytes", "gauge", "Size of the current files of the write-ahead logs.", storeStats.logBytes);
+    metric(out, "checkpoints_total", "counter", "Number of checkpoints of the shards.", storeStats.checkpoints);
+    metric(out, "warmup_keys_total", "counter", "Number of keys read into the cache from the hot set on start.",
+           storeStats.warmedKeys);
+    metric(out, "ready", "gauge", "Whether the cache is warm, 1 or 0.", store->ready() ? 1 : 0);
+    // Only the slab classes in use, labeled by their chunk size.
+    describe(out, "slab_pages", "gauge", "Number of slab pages of the cache, by slab class.");
+    for (const SlabClassStats &slabClass : storeStats.slabClasses) {
+        if (slabClass.pages) {
+            snprintf(labels, sizeof(labels), "{chunk_size=\"%zu\"}", slabClass.chunkSize);
+            sample(out, "slab_pages", labels, slabClass.pages);
+        }
+    }
+    describe(out, "slab_chunks", "gauge", "Number of chunks in the slab pages of the cache, by slab class.");
+    for (const SlabClassStats &slabClass : storeStats.slabClasses) {
+        if (slabClass.pages) {
+            snprintf(labels, sizeof(labels), "{chunk_size=\"%zu\"}", slabClass.chunkSize);
+            sample(out, "slab_chunks", labels, slabClass.chunks);
+        }
+    }
+    describe(out, "slab_chunks_used", "gauge", "Number of slab chunks holding key-value pairs, by slab class.");
+    for (const SlabClassStats &slabClass : storeStats.slabClasses) {
+        if (slabClass.pages) {
+            snprintf(labels, sizeof(labels), "{chunk_size=\"%zu\"}", slabClass.chunkSize);
+            sample(out, "slab_chunks_used", labels, slabClass.usedChunks);
+        }
+    }
+}
+
+static inline int hexValue(char c) {
+    return c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+}
+
+// Find a parameter in a query string of the form name=value&name=value and percent-decode its value.
+// Returns false if the parameter is absent or malformed.
+static bool queryParam(const std::string &query, const char *name, std::string &value) {
+    size_t nameLength = strlen(name);
+    for (size_t pos = 0; pos < query.size();) {
+        size_t amp = query.find('&', pos);
+        if (amp == std::string::npos) {
+            amp = query.size();
+        }
+        if (amp - pos > nameLength && !query.compare(pos, nameLength, name) && query[pos + nameLength] == '=') {
+            value.clear();
+            for (size_t i = pos + nameLength + 1; i < amp; ++i) {
+                if (query[i] == '%') {
+                    if (i + 2 >= amp) {
+                        return false;
+                    }
+                    int hi = hexValue(query[i + 1]);
+                    int lo = hexValue(query[i + 2]);
+                    if (hi < 0 || lo < 0) {
+                        return false;
+                    }
+                    value += (char) (hi << 4 | lo);
+                    i += 2;
+                } else {
+                    value += query[i] == '+' ? ' ' : query[i];
+                }
+            }
+            return true;
+        }
+        pos = amp + 1;
+    }
+    return false;
+}
+
+// Percent-encode a string for use in a header or a query string.
+static std::string percentEncode(const std::string &str) {
+    static const char *digits = "0123456789ABCDEF";
+    std::string encoded;
+    for (unsigned char c : str) {
+        if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~' || c == ':' || c == '/') {
+            encoded += c;
+        } else {
+            encoded += '%';
+            encoded += digits[c >> 4];
+            encoded += digits[c & 15];
+        }
+    }
+    return encoded;
+}
+
+// Append a length-prefixed string, the same as in the body of a batch response.
+static void appendLengthPrefixed(std::string &out, const char *data, size_t length) {
+    uint32_t n = htonl(length);
+    out.append((const char *) &n, sizeof(n));
+    out.append(data, length);
+}
+
+// Answer a scan. Its parameters are in the query string: prefix, start, end, limit and token.
+static void handleScan(ThreadSafeKVStore *store, const std::string &query, HTTP_Response &response) {
+    std::string prefix, start, end, limitParam, token;
+    size_t limit = SCAN_DEFAULT_LIMIT;
+    bool valid = true;
+    queryParam(query, "prefix", prefix);
+    queryParam(query, "start", start);
+    queryParam(query, "end", end);
+    if (queryParam(query, "limit", limitParam)) {
+        char *rest;
+        limit = strtoul(limitParam.c_str(), &rest, 10);
+        valid = *rest == '\0' && limit > 0 && limit <= SCAN_MAX_LIMIT;
+    }
+    if (queryParam(query, "token", token)) { // The start of the rest of the range, from the previous scan.
+        start = std::max(start, token);
+    }
+    if (!valid) {
+        response.head = "HTTP/1.1 400 Bad request\r\nContent-length: 0\r\n\r\n";
+        response.body = ValueBuffer();
+        return;
+    }
+    // The keys with a prefix are the range from the prefix to the prefix with its last byte incremented.
+    if (!prefix.empty()) {
+        start = std::max(start, prefix);
+        std::string prefixEnd = prefix;
+        while (!prefixEnd.empty() && (unsigned char) prefixEnd.back() == 0xff) {
+            prefixEnd.pop_back();
+        }
+        if (!prefixEnd.empty()) {
+            ++prefixEnd.back();
+            if (end.empty() || prefixEnd < end) {
+                end = prefixEnd;
+            }
+        }
+    }
+    std::vector<std::pair<std::string, ValueBuffer>> results;
+    std::string next;
+    if (end.empty() || start < end) {
+        store->scan(start, end, limit, results, next);
+    }
+    // Sent with chunked encoding, one chunk per pair, each of which is the key and the value, both
+    // length-prefixed. The values are sent by reference, not copied.
+    response.head = "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\nTransfer-Encoding: chunked\r\n";
+    if (!next.empty()) {
+        response.head += "X-Continuation-Token: " + percentEncode(next) + "\r\n";
+    }
+    response.head += "\r\n";
+    response.body = ValueBuffer();
+    char chunkSize[32];
+    for (const auto &pair : results) {
+        ResponsePiece piece;
+        if (!response.pieces.empty()) {
+            piece.bytes = "\r\n"; // End of the previous chunk.
+        }
+        snprintf(chunkSize, sizeof(chunkSize), "%zx\r\n", 2 * sizeof(uint32_t) + pair.first.size() + pair.second.size());
+        piece.bytes += chunkSize;
+        appendLengthPrefixed(piece.bytes, pair.first.data(), pair.first.size());
+        uint32_t n = htonl(pair.second.size());
+        piece.bytes.append((const char *) &n, sizeof(n));
+        piece.value = pair.second;
+        response.pieces.push_back(std::move(piece));
+    }
+    ResponsePiece last;
+    last.bytes = response.pieces.empty() ? "0\r\n\r\n" : "\r\n0\r\n\r\n";
+    response.pieces.push_back(std::move(last));
+}
+
+void handleAdminRequest(ThreadSafeKVStore *store, const HTTP_Request &request, HTTP_Response &response) {
+    std::string path(request.key.data + ADMIN_PREFIX_LENGTH, request.key.length - ADMIN_PREFIX_LENGTH);
+    std::string query;
+    size_t question = path.find('?');
+    if (question != std::string::npos) {
+        query = path.substr(question + 1);
+        path.resize(question);
+    }
+    if (request.type == GET && path == "scan") {
+        handleScan(store, query, response);
+    } else if (request.type == GET && path == "ready") { // for load balancers, to hold traffic back until the cache is warm
+        if (store->ready()) {
+            response.head = "HTTP/1.1 200 OK\r\nContent-length: 6\r\n\r\n";
+            response.body = ValueBuffer("ready\n", 6);
+        } else {
+            response.head = "HTTP/1.1 503 Service unavailable\r\nContent-length: 11\r\n\r\n";
+            response.body = ValueBuffer("warming up\n", 11);
+        }
+    } else if (request.type == GET && path == "metrics") {
+        std::string body;
+        renderMetrics(store, body);
+        response.head = "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-length: ";
+        response.head += std::to_string(body.size());
+        response.head += "\r\n\r\n";
+        response.body = ValueBuffer(std::move(body));
+    } else {
+        response.head = "HTTP/1.1 404 Not found\r\nContent-length: 0\r\n\r\n";
+        response.body = ValueBuffer();
+    }
+}
+
+} // namespace multicore
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <string>
+#include <cstring>
+
+#include "threadSafeKVStore.hpp"
+#include "httpProcessingFunc.hpp"
+#include "requestHandler.hpp"
+
+#define ADMIN_PREFIX        "_/" // Keys starting with this prefix, i.e. paths starting with "/_/", are reserved for the server.
+#define ADMIN_PREFIX_LENGTH 2
+
+namespace multicore {
+
+/**
+ * Whether a request is for the reserved path prefix "/_/". Such requests are answered by the server
+ * itself and never reach the storage, so keys starting with the prefix cannot be stored.
+ *
+ * @param request the parsed request information.
+ * @return true if the request is for the reserved prefix.
+ */
+inline bool isAdminRequest(const HTTP_Request &request) {
+    return request.key.length >= ADMIN_PREFIX_LENGTH && !memcmp(request.key.data, ADMIN_PREFIX, ADMIN_PREFIX_LENGTH);
+}
+
+/**
+ * Whether a request is for one of the probes under the reserved prefix, GET /_/metrics and GET /_/ready.
+ * They only read counters, so they stay cheap even when the server is overloaded.
+ *
+ * @param request the parsed request information.
+ * @return true if the request is for a probe.
+ */
+inline bool isProbeRequest(const HTTP_Request &request) {
+    size_t length = request.key.length;
+    const char *question = (const char *) memchr(request.key.data, '?', length);
+    if (question != nullptr) {
+        length = question - request.key.data;
+    }
+    return request.type == GET && ((length == 9 && !memcmp(request.key.data, "_/metrics", 9)) ||
+                                   (length == 7 && !memcmp(request.key.data, "_/ready", 7)));
+}
+
+/**
+ * Handle a request for the reserved path prefix and build a response.
+ *
+ * GET /_/metrics returns the statistics of the server and of the storage in the Prometheus text format.
+ * GET /_/scan returns the key-value pairs in a range of keys, in key order. The range is given by the
+ * query parameters prefix, start (inclusive) and end (exclusive), all optional and percent-encoded, and
+ * at most limit pairs are returned. If the limit was reached, the X-Continuation-Token header holds the
+ * token to pass as the token parameter of the next scan of the same range to get the next pairs. The
+ * body is sent with chunked encoding, one chunk per pair, which is the key and the value, each preceded
+ * by its length as a 4 byte unsigned integer in network byte order.
+ * Everything else under the prefix is answered with 404.
+ *
+ * @param store the back-end storage.
+ * @param request the parsed request information.
+ * @param response the argument to return the response.
+ */
+void handleAdminRequest(ThreadSafeKVStore *store, const HTTP_Request &request, HTTP_Response &response);
+
+/**
+ * Write the statistics of the server and of the storage in the Prometheus text format. Only reads
+ * counters, so it takes no lock of the storage and does not stall the threads serving requests.
+ *
+ * @param store the back-end storage.
+ * @param out the string to append the metrics to.
+ */
+void renderMetrics(ThreadSafeKVStore *store, std::string &out);
+
+} // namespace multicore
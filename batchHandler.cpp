@@ -0,0 +1,114 @@
+#include <arpa/inet.h>
+#include <cstdint>
+#include <vector>
+#include <atomic>
+
+#include "batchHandler.hpp"
+#include "adminHandler.hpp"
+
+namespace multicore {
+
+extern std::atomic_ulong stat_num_lookup;
+extern std::atomic_ulong stat_num_insert;
+extern std::atomic_ulong stat_num_delete;
+
+// Read a length-prefixed string at pos of a body, and move pos past it. Returns false if the body is too short.
+static bool readString(const StringView &body, size_t &pos, const char *&data, size_t &length) {
+    uint32_t n;
+    if (body.length - pos < sizeof(n)) {
+        return false;
+    }
+    memcpy(&n, body.data + pos, sizeof(n));
+    pos += sizeof(n);
+    length = ntohl(n);
+    if (body.length - pos < length) {
+        return false;
+    }
+    data = body.data + pos;
+    pos += length;
+    return true;
+}
+
+// Parse the operations of a batch request. Returns false if the body is malformed, or if a key is reserved for
+// the server, since those are never stored.
+static bool parseBatch(const StringView &body, std::vector<BatchOp> &ops) {
+    size_t pos = 0;
+    while (pos < body.length) {
+        BatchOp op;
+        const char *data;
+        size_t length;
+        switch (body.data[pos++]) {
+          case BATCH_OP_LOOKUP:
+            op.type = BATCH_LOOKUP;
+            break;
+          case BATCH_OP_INSERT:
+            op.type = BATCH_INSERT;
+            break;
+          case BATCH_OP_REMOVE:
+            op.type = BATCH_REMOVE;
+            break;
+          default:
+            return false;
+        }
+        if (!readString(body, pos, data, length) ||
+            (length >= ADMIN_PREFIX_LENGTH && !memcmp(data, ADMIN_PREFIX, ADMIN_PREFIX_LENGTH))) {
+            return false;
+        }
+        op.key.assign(data, length);
+        if (op.type == BATCH_INSERT) {
+            if (!readString(body, pos, data, length)) {
+                return false;
+            }
+            op.value = ValueBuffer(data, length);
+        }
+        ops.push_back(std::move(op));
+    }
+    return true;
+}
+
+void handleBatchRequest(ThreadSafeKVStore *store, const HTTP_Request &request, HTTP_Response &response) {
+    std::vector<BatchOp> ops;
+    response.cached = false;
+    if (!parseBatch(request.value, ops)) {
+        response.head = "HTTP/1.1 400 Bad request\r\nContent-length: 0\r\n\r\n";
+        response.body = ValueBuffer();
+        return;
+    }
+    store->batch(ops);
+    // The body is in pieces: the status bytes and length prefixes since the previous value, followed by a
+    // value found, which is sent by reference, not copied.
+    size_t size = 0;
+    ResponsePiece piece;
+    for (const BatchOp &op : ops) {
+        piece.bytes += (char) (op.result ? BATCH_STATUS_ERROR : BATCH_STATUS_OK);
+        ++size;
+        switch (op.type) {
+          case BATCH_LOOKUP:
+            ++stat_num_lookup;
+            if (!op.result) {
+                uint32_t n = htonl(op.value.size());
+                piece.bytes.append((const char *) &n, sizeof(n));
+                piece.value = op.value;
+                size += sizeof(n) + op.value.size();
+                response.pieces.push_back(std::move(piece));
+                piece = ResponsePiece();
+            }
+            break;
+          case BATCH_INSERT:
+            ++stat_num_insert;
+            break;
+          case BATCH_REMOVE:
+            ++stat_num_delete;
+            break;
+        }
+    }
+    if (!piece.bytes.empty()) {
+        response.pieces.push_back(std::move(piece));
+    }
+    response.head = "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\nContent-length: ";
+    response.head += std::to_string(size);
+    response.head += "\r\n\r\n";
+    response.body = ValueBuffer();
+}
+
+} // namespace multicore
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <string>
+#include <cstring>
+
+#include "threadSafeKVStore.hpp"
+#include "httpProcessingFunc.hpp"
+#include "requestHandler.hpp"
+
+#define BATCH_KEY        "_/batch" // Key of the path of batch requests, "/_/batch".
+#define BATCH_KEY_LENGTH 7
+
+#define BATCH_OP_LOOKUP    'G' // Operation codes of a batch request.
+#define BATCH_OP_INSERT    'P'
+#define BATCH_OP_REMOVE    'D'
+#define BATCH_STATUS_OK    0   // Status codes of a batch response.
+#define BATCH_STATUS_ERROR 1
+
+namespace multicore {
+
+/**
+ * Whether a request is a batch request, i.e. a POST to "/_/batch".
+ *
+ * @param request the parsed request information.
+ * @return true if the request is a batch request.
+ */
+inline bool isBatchRequest(const HTTP_Request &request) {
+    return request.type == POST && request.key.length == BATCH_KEY_LENGTH &&
+           !memcmp(request.key.data, BATCH_KEY, BATCH_KEY_LENGTH);
+}
+
+/**
+ * Handle a batch request and build a response. The operations of the batch are done with
+ * ThreadSafeKVStore::batch, so every lock of the storage is taken once per batch.
+ *
+ * The body of the request is a sequence of operations, each of which is a one byte operation code,
+ * 'G' (lookup), 'P' (insert) or 'D' (remove), followed by the length of the key as a 32 bit unsigned
+ * integer in network byte order and the key, and for an insert by the length of the value in the same
+ * format and the value.
+ *
+ * The body of the response has one result per operation, in the same order, each of which is a one byte
+ * status, 0 on success or 1 if the key was not found (or on error), followed for a successful lookup by
+ * the length of the value in the same format as above and the value. A malformed body is answered with
+ * 400 and no operation is done.
+ *
+ * @param store the back-end storage.
+ * @param request the parsed request information.
+ * @param response the argument to return the response.
+ */
+void handleBatchRequest(ThreadSafeKVStore *store, const HTTP_Request &request, HTTP_Response &response);
+
+} // namespace multicore
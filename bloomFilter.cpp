@@ -0,0 +1,69 @@
+#include <cmath>
+#include <functional>
+
+#include "bloomFilter.hpp"
+
+#define BLOOM_MAX_HASHES 16 // Max number of bits per string, however low the false positive rate.
+
+namespace multicore {
+
+// The finalizer of splitmix64, so the bits of the filter do not depend on the bits std::hash shares
+// with the shard selection, which also uses it.
+static inline uint64_t mix(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9UL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebUL;
+    x ^= x >> 31;
+    return x;
+}
+
+BloomFilter::BloomFilter(size_t capacity, double fpr, size_t maxBytes): numStrings(capacity ? capacity : 1) {
+    // The optimal number of bits is -n ln(p) / ln(2)^2, with ln(2) m / n bits set per string.
+    double bits = -(double) numStrings * std::log(fpr) / (M_LN2 * M_LN2);
+    numWords = (size_t) std::ceil(bits / 64);
+    if (maxBytes && numWords > maxBytes / sizeof(uint64_t)) {
+        numWords = maxBytes / sizeof(uint64_t);
+    }
+    if (numWords < 1) {
+        numWords = 1;
+    }
+    numBits = numWords * 64;
+    numHashes = (unsigned int) std::lround(M_LN2 * numBits / numStrings);
+    numHashes = numHashes < 1 ? 1 : numHashes > BLOOM_MAX_HASHES ? BLOOM_MAX_HASHES : numHashes;
+    words.reset(new std::atomic<uint64_t>[numWords]);
+    for (size_t i = 0; i < numWords; ++i) {
+        words[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+void BloomFilter::hashes(const std::string &str, uint64_t &h1, uint64_t &h2) const {
+    h1 = mix(std::hash<std::string>()(str));
+    h2 = mix(h1) | 1;
+}
+
+void BloomFilter::add(const std::string &str) {
+    uint64_t h1, h2;
+    hashes(str, h1, h2);
+    for (unsigned int i = 0; i < numHashes; ++i) {
+        uint64_t bit = (h1 + i * h2) % numBits;
+        uint64_t mask = (uint64_t) 1 << (bit % 64);
+        if (!(words[bit / 64].load(std::memory_order_relaxed) & mask)) { // Saves the write if the bit is set.
+            words[bit / 64].fetch_or(mask, std::memory_order_relaxed);
+        }
+    }
+}
+
+bool BloomFilter::mayContain(const std::string &str) const {
+    uint64_t h1, h2;
+    hashes(str, h1, h2);
+    for (unsigned int i = 0; i < numHashes; ++i) {
+        uint64_t bit = (h1 + i * h2) % numBits;
+        if (!(words[bit / 64].load(std::memory_order_relaxed) & ((uint64_t) 1 << (bit % 64)))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace multicore
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <string>
+#include <atomic>
+#include <memory>
+#include <cstddef>
+#include <cstdint>
+
+namespace multicore {
+
+/**
+ * @section DESCRIPTION
+ *
+ * A Bloom filter of strings: a set that may answer that a string is in it when it is not (a false
+ * positive), but never the other way around. It is sized for a number of strings and a false positive
+ * rate, optionally capped to a number of bytes, in which case the false positive rate is higher.
+ * Strings cannot be removed, so a filter of a changing set has to be rebuilt from time to time.
+ *
+ * Thread-safe: adding and testing only do relaxed atomic operations on the bits.
+ */
+class BloomFilter {
+  public:
+    /**
+     * Constructor. Makes an empty filter.
+     *
+     * @param capacity the number of strings the filter is sized for.
+     * @param fpr the false positive rate when the filter holds capacity strings, between 0 and 1.
+     * @param maxBytes the max size of the bits of the filter, or 0 for no max.
+     */
+    BloomFilter(size_t capacity, double fpr, size_t maxBytes = 0);
+
+    /**
+     * Add a string.
+     *
+     * @param str the string.
+     */
+    void add(const std::string &str);
+
+    /**
+     * Whether a string may have been added.
+     *
+     * @param str the string.
+     * @return false if the string has definitely not been added.
+     */
+    bool mayContain(const std::string &str) const;
+
+    /**
+     * @return the number of strings the filter is sized for.
+     */
+    inline size_t capacity() const {
+        return numStrings;
+    }
+
+    /**
+     * @return the size of the bits of the filter in bytes.
+     */
+    inline size_t bytes() const {
+        return numWords * sizeof(uint64_t);
+    }
+
+  private:
+    // The two hashes combined to get the position of every bit of a string.
+    void hashes(const std::string &str, uint64_t &h1, uint64_t &h2) const;
+
+    std::unique_ptr<std::atomic<uint64_t>[]> words;
+    size_t numWords;
+    uint64_t numBits;
+    unsigned int numHashes;
+    size_t numStrings;
+};
+
+} // namespace multicore
@@ -1,3 +1,8 @@
 #!/bin/sh
 
-g++ -std=c++0x -pthread threadSafeKVStore.hpp threadSafeKVStore.cpp threadPoolServer.hpp threadPoolServer.cpp threadSafeQueue.hpp httpProcessingFunc.hpp httpProcessingFunc.cpp requestHandler.hpp requestHandler.cpp fileSystemIO.hpp fileSystemIO.cpp main.cpp -o runme
+g++ -std=c++17 -pthread threadSafeKVStore.hpp threadSafeKVStore.cpp timerWheel.hpp timerWheel.cpp threadPoolServer.hpp threadPoolServer.cpp threadSafeQueue.hpp httpProcessingFunc.hpp httpProcessingFunc.cpp requestHandler.hpp requestHandler.cpp adminHandler.hpp adminHandler.cpp batchHandler.hpp batchHandler.cpp latencyHistogram.hpp latencyHistogram.cpp valueBuffer.hpp valueBuffer.cpp slabAllocator.hpp slabAllocator.cpp outputQueue.hpp outputQueue.cpp fileSystemIO.hpp fileSystemIO.cpp diskStore.hpp diskStore.cpp bloomFilter.hpp bloomFilter.cpp logStructuredStore.hpp logStructuredStore.cpp writeAheadLog.hpp writeAheadLog.cpp ioRing.hpp ioRing.cpp main.cpp -o runme
+g++ -std=c++17 -pthread connBench.cpp -o connbench
+g++ -std=c++17 -pthread queueBench.cpp -o queuebench
+g++ -std=c++17 -pthread latencyHistogram.cpp loadGen.cpp -o loadgen
+g++ -std=c++17 -pthread threadSafeKVStore.cpp timerWheel.cpp fileSystemIO.cpp diskStore.cpp bloomFilter.cpp logStructuredStore.cpp writeAheadLog.cpp valueBuffer.cpp slabAllocator.cpp httpProcessingFunc.cpp microBench.cpp -o microbench
+g++ -std=c++17 -pthread httpProcessingFunc.cpp httpParserTest.cpp -o parsertest
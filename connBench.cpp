@@ -0,0 +1,150 @@
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <string>
+
+#define DEFAULT_HOST         "127.0.0.1" // Address of the server.
+#define DEFAULT_PORT_NO      10801       // Port of the server.
+#define DEFAULT_NUM_CLIENTS  4           // Number of client threads opening connections concurrently.
+#define DEFAULT_DURATION     5           // Length of the benchmark in seconds.
+#define BUFFER_LENGTH        4096        // Size of each read from a socket
+
+/**
+ * Connection-churn benchmark for the thread pool server.
+ *
+ * Every client thread repeatedly opens a new connection, sends a single GET request, reads
+ * the response and closes the connection, which is the traffic pattern of short-lived clients
+ * and health checks. Reports the number of connections completed per second.
+ */
+
+namespace multicore {
+
+struct BenchOptions {
+    std::string host;
+    unsigned short portno;
+    int nClients;
+    int duration;
+};
+
+std::atomic_bool isRunning;
+std::atomic_ulong numConnections;
+std::atomic_ulong numFailures;
+
+// Opens one connection, does a single request on it and closes it. Returns 0 on success.
+int oneConnection(const struct sockaddr_in &serv_addr) {
+    static const char request[] = "GET /connbench HTTP/1.1\r\nHost: connbench\r\n\r\n";
+    char buffer[BUFFER_LENGTH];
+    int one = 1;
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0) {
+        return -1;
+    }
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    int ret = -1;
+    if (!connect(sockfd, (const struct sockaddr *) &serv_addr, sizeof(serv_addr)) &&
+        write(sockfd, request, sizeof(request) - 1) == (ssize_t) sizeof(request) - 1) {
+        // The server answers every request with a single small response.
+        ssize_t n = read(sockfd, buffer, BUFFER_LENGTH);
+        if (n > 0 && !strncmp(buffer, "HTTP/1.1", 8)) {
+            ret = 0;
+        }
+    }
+    close(sockfd);
+    return ret;
+}
+
+void *clientRoutine(void *opts) {
+    BenchOptions *options = (BenchOptions *) opts;
+    struct sockaddr_in serv_addr;
+    memset((char *) &serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_port = htons(options->portno);
+    inet_pton(AF_INET, options->host.c_str(), &serv_addr.sin_addr);
+    while (isRunning.load()) {
+        if (oneConnection(serv_addr)) {
+            ++numFailures;
+        } else {
+            ++numConnections;
+        }
+    }
+    return nullptr;
+}
+
+// Parses the arguments for the program.
+int argParser(int argc, char **argv, BenchOptions &options) {
+    int c;
+    options.host = DEFAULT_HOST;
+    options.portno = DEFAULT_PORT_NO;
+    options.nClients = DEFAULT_NUM_CLIENTS;
+    options.duration = DEFAULT_DURATION;
+    opterr = 0;
+    while ((c = getopt (argc, argv, "h:p:c:d:")) != -1)
+        switch (c) {
+          case 'h':
+            options.host = optarg;
+            break;
+          case 'p':
+            options.portno = atoi(optarg);
+            break;
+          case 'c':
+            options.nClients = atoi(optarg);
+            break;
+          case 'd':
+            options.duration = atoi(optarg);
+            break;
+          case '?':
+            if (isprint (optopt))
+                fprintf(stderr, "Unknown option or missing argument `-%c'.\n", optopt);
+            else
+                fprintf(stderr, "Unknown option character `\\x%x'.\n", optopt);
+            return 1;
+          default:
+            abort();
+        }
+    return 0;
+}
+
+} // namespace multicore
+
+// Program entry.
+int main(int argc, char **argv) {
+    multicore::BenchOptions options;
+    if (multicore::argParser(argc, argv, options)) {
+        fprintf(stderr, "Usage: %s [-h host] [-p port] [-c clients] [-d seconds]\n", argv[0]);
+        exit(-1);
+    }
+    multicore::isRunning = true;
+    multicore::numConnections = 0;
+    multicore::numFailures = 0;
+    std::vector<pthread_t> clients(options.nClients, 0);
+    std::chrono::time_point<std::chrono::high_resolution_clock> startTime = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < options.nClients; ++i) {
+        if (pthread_create(&clients[i], nullptr, multicore::clientRoutine, (void *) &options)) {
+            fprintf(stderr, "pthread_create failed. Terminating.\n");
+            exit(-1);
+        }
+    }
+    sleep(options.duration);
+    multicore::isRunning = false;
+    void *status;
+    for (pthread_t tid : clients) {
+        pthread_join(tid, &status);
+    }
+    std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - startTime;
+    printf("clients = %d, duration = %.2f s\n", options.nClients, elapsed.count());
+    printf("connections = %lu, failures = %lu, connections/s = %.1f\n",
+           multicore::numConnections.load(), multicore::numFailures.load(),
+           multicore::numConnections.load() / elapsed.count());
+    return 0;
+}
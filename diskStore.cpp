@@ -0,0 +1,188 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "diskStore.hpp"
+#include "fileSystemIO.hpp"
+#include "logStructuredStore.hpp"
+
+namespace multicore {
+
+FileDiskStore::FileDiskStore(const std::string &_dirPath, double _filterFpr, size_t _filterMaxBytes)
+    : dirPath(_dirPath), tmpPath(_dirPath + ".tmp"), nextTmp(0), filterFpr(_filterFpr), filterMaxBytes(_filterMaxBytes),
+      keysAtBuild(0), keysAdded(0), keysDeleted(0), negatives(0), falsePositives(0), rebuilds(0) {
+    // Temporary files left by a crash are never renamed, so they are of no use.
+    std::vector<std::string> names;
+    if (makeDir(tmpPath) || listFiles(tmpPath, names)) {
+        fprintf(stderr, "Error on making directory %s. Terminating.\n", tmpPath.c_str());
+        exit(-1);
+    }
+    for (const std::string &name : names) {
+        deleteFile(tmpPath + "/" + name);
+    }
+    pthread_mutex_init(&filter_lock, nullptr);
+    if (filterFpr > 0) {
+        rebuildFilter();
+    }
+}
+
+FileDiskStore::~FileDiskStore() {
+    pthread_mutex_destroy(&filter_lock);
+}
+
+int FileDiskStore::read(const std::string &key, std::string &value) {
+    if (filterFpr > 0 && !std::atomic_load(&filter)->mayContain(key)) {
+        negatives.fetch_add(1, std::memory_order_relaxed);
+        return -1;
+    }
+    int ret = readFile(dirPath + "/" + key, value);
+    if (ret && filterFpr > 0) {
+        falsePositives.fetch_add(1, std::memory_order_relaxed);
+    }
+    return ret;
+}
+
+// Write a value to a temporary file, and rename it over the file of its key.
+int FileDiskStore::replaceFile(const std::string &key, const char *value, size_t length) {
+    std::string tmp = tmpPath + "/" + std::to_string(nextTmp.fetch_add(1, std::memory_order_relaxed));
+    if (writeFile(tmp, value, length) || rename(tmp.c_str(), (dirPath + "/" + key).c_str())) {
+        deleteFile(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+int FileDiskStore::locate(const std::string &key, DiskLocation &location) {
+    if (filterFpr > 0 && !std::atomic_load(&filter)->mayContain(key)) {
+        negatives.fetch_add(1, std::memory_order_relaxed);
+        return -1;
+    }
+    int fd = open((dirPath + "/" + key).c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st)) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (filterFpr > 0) {
+            falsePositives.fetch_add(1, std::memory_order_relaxed);
+        }
+        return -1;
+    }
+    location.fd = fd;
+    location.offset = 0;
+    location.length = st.st_size;
+    location.pin = std::shared_ptr<void>(nullptr, [fd](void *) { close(fd); });
+    return 0;
+}
+
+int FileDiskStore::write(const std::string &key, const char *value, size_t length) {
+    if (filterFpr <= 0) {
+        return replaceFile(key, value, length);
+    }
+    // The lock is held until the file is written, so a rebuild either lists the file or gets the key.
+    pthread_mutex_lock(&filter_lock);
+    if (!filter->mayContain(key)) {
+        ++keysAdded;
+    }
+    filter->add(key);
+    if (nextFilter) {
+        nextFilter->add(key);
+    }
+    int ret = replaceFile(key, value, length);
+    pthread_mutex_unlock(&filter_lock);
+    return ret;
+}
+
+int FileDiskStore::remove(const std::string &key) {
+    deleteFile(dirPath + "/" + key); // Fails if the key does not exist, which is fine.
+    if (filterFpr > 0) {
+        pthread_mutex_lock(&filter_lock);
+        ++keysDeleted;
+        pthread_mutex_unlock(&filter_lock);
+    }
+    return 0;
+}
+
+int FileDiskStore::compact() {
+    if (filterFpr <= 0) {
+        return 0;
+    }
+    // Rebuild once more keys were added than the filter is sized for, or once enough keys were deleted
+    // that their stale bits noticeably raise the false positive rate.
+    pthread_mutex_lock(&filter_lock);
+    bool due = keysAtBuild + keysAdded > filter->capacity() || keysDeleted > filter->capacity() / 2;
+    pthread_mutex_unlock(&filter_lock);
+    if (due) {
+        rebuildFilter();
+    }
+    return 0;
+}
+
+int FileDiskStore::sync() {
+    int fd = open(dirPath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    int ret = syncfs(fd);
+    close(fd);
+    return ret ? -1 : 0;
+}
+
+void FileDiskStore::rebuildFilter() {
+    // Sized for twice the keys on disk, so it is not due again right away.
+    pthread_mutex_lock(&filter_lock);
+    size_t keys = keysAtBuild + keysAdded > keysDeleted ? keysAtBuild + keysAdded - keysDeleted : 0;
+    std::shared_ptr<BloomFilter> building =
+        std::make_shared<BloomFilter>(std::max((size_t) DEFAULT_FILTER_MIN_KEYS, 2 * keys), filterFpr, filterMaxBytes);
+    nextFilter = building;
+    keysAdded = keysDeleted = 0;
+    pthread_mutex_unlock(&filter_lock);
+    // Writes meanwhile add their keys to the new filter too, so listing the files needs no lock.
+    std::vector<std::string> names;
+    listFiles(dirPath, names);
+    for (const std::string &name : names) {
+        building->add(name);
+    }
+    pthread_mutex_lock(&filter_lock);
+    std::atomic_store(&filter, building);
+    nextFilter.reset();
+    keysAtBuild = names.size();
+    pthread_mutex_unlock(&filter_lock);
+    rebuilds.fetch_add(1, std::memory_order_relaxed);
+}
+
+int FileDiskStore::forEachKey(const std::function<void(const std::string &)> &callback) {
+    std::vector<std::string> names;
+    if (listFiles(dirPath, names)) {
+        return -1;
+    }
+    for (const std::string &name : names) {
+        callback(name);
+    }
+    return 0;
+}
+
+void FileDiskStore::getStats(DiskStoreStats &stats) const {
+    std::shared_ptr<BloomFilter> current = std::atomic_load(&filter);
+    stats.filterBytes = current ? current->bytes() : 0;
+    stats.filterNegatives = negatives.load(std::memory_order_relaxed);
+    stats.filterFalsePositives = falsePositives.load(std::memory_order_relaxed);
+    stats.filterRebuilds = rebuilds.load(std::memory_order_relaxed);
+}
+
+DiskStore *makeDiskStore(DiskEngine engine, const std::string &dirPath, double filterFpr, size_t filterMaxBytes) {
+    switch (engine) {
+      case LOG_STRUCTURED:
+        return new LogStructuredStore(dirPath); // Its index already answers for absent keys without touching the disk.
+      case FILE_PER_KEY:
+      default:
+        return new FileDiskStore(dirPath, filterFpr, filterMaxBytes);
+    }
+}
+
+} // namespace multicore
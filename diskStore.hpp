@@ -0,0 +1,218 @@
+#pragma once
+
+#include <pthread.h>
+#include <string>
+#include <memory>
+#include <functional>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "bloomFilter.hpp"
+
+#define DEFAULT_FILTER_FPR      0.01 // False positive rate of the Bloom filter of the keys on disk.
+#define DEFAULT_FILTER_MIN_KEYS 1024 // The Bloom filter is sized for at least this many keys.
+
+namespace multicore {
+
+/**
+ * Type of disk storage engine.
+ */
+enum DiskEngine {
+    FILE_PER_KEY,   // One file per key, named after the key.
+    LOG_STRUCTURED  // Append-only segment files with an in memory index.
+};
+
+/**
+ * Statistics of a disk storage engine.
+ */
+struct DiskStoreStats {
+    unsigned long filterBytes; // Size of the Bloom filter of the keys on disk, 0 if the engine has none.
+    unsigned long filterNegatives; // Reads answered by the filter without touching the disk.
+    unsigned long filterFalsePositives; // Reads of keys not on disk which the filter did not rule out.
+    unsigned long filterRebuilds; // Number of times the filter was rebuilt from the keys on disk.
+};
+
+/**
+ * Where the value of a key is on disk, for reading it without the engine, e.g. asynchronously.
+ */
+struct DiskLocation {
+    int fd; // The file holding the value, open for reading.
+    uint64_t offset; // Offset of the value in the file.
+    size_t length; // Length of the value.
+    std::shared_ptr<void> pin; // Keeps the file open, and its bytes at the location unchanged, while it is held.
+};
+
+/**
+ * @section DESCRIPTION
+ *
+ * Interface of the disk tier of the key-value storage, i.e. where key-value pairs evicted from
+ * the in memory cache are kept. Implementations must be thread-safe.
+ */
+class DiskStore {
+  public:
+    virtual ~DiskStore() {}
+
+    /**
+     * Read the value of a key from disk.
+     *
+     * @param key the key.
+     * @param value the argument to return the value.
+     * @return 0 if the key exists;
+     *         -1 if the key does not exist.
+     */
+    virtual int read(const std::string &key, std::string &value) = 0;
+
+    /**
+     * Find where the value of a key is on disk, without reading it, so the caller can read it itself.
+     * Only engines that never overwrite a value in place can do so, since the value must stay readable at
+     * its location even if the key is written or deleted meanwhile. The others answer 1, and the caller
+     * has to use read.
+     *
+     * @param key the key.
+     * @param location the argument to return the location.
+     * @return 0 if the key exists;
+     *         -1 if the key does not exist;
+     *         1 if the engine cannot locate values.
+     */
+    virtual int locate(const std::string &/*key*/, DiskLocation &/*location*/) { return 1; }
+
+    /**
+     * Write a key-value pair to disk, replacing the old value if any.
+     *
+     * @param key the key.
+     * @param value the value.
+     * @param length length of the value.
+     * @return 0 if writing succeed;
+     *         -1 if writing failed.
+     */
+    virtual int write(const std::string &key, const char *value, size_t length) = 0;
+
+    /**
+     * Delete a key from disk. If the key does not exist, nothing is done.
+     *
+     * @param key the key.
+     * @return 0 if deleting succeed or the key does not exist;
+     *         -1 if deleting failed.
+     */
+    virtual int remove(const std::string &key) = 0;
+
+    /**
+     * Do one step of background maintenance (e.g. reclaiming dead space). Called periodically
+     * from a background thread.
+     *
+     * @return 0 on success;
+     *         -1 on error.
+     */
+    virtual int compact() { return 0; }
+
+    /**
+     * Make every write and delete done so far durable, so it survives a crash of the system.
+     *
+     * @return 0 on success;
+     *         -1 on error.
+     */
+    virtual int sync() = 0;
+
+    /**
+     * Call a function on every key on disk. Keys written or deleted meanwhile may or may not be seen.
+     *
+     * @param callback the function.
+     * @return 0 on success;
+     *         -1 on error.
+     */
+    virtual int forEachKey(const std::function<void(const std::string &)> &callback) = 0;
+
+    /**
+     * Get statistics of the engine.
+     *
+     * @param stats the argument to return the statistics.
+     */
+    virtual void getStats(DiskStoreStats &stats) const {
+        stats = DiskStoreStats();
+    }
+};
+
+/**
+ * Disk storage engine storing every key as its own file in a directory,
+ * using the functions in fileSystemIO.hpp.
+ *
+ * A value is written to a temporary file in a directory next to the directory of the files, and then
+ * renamed over the file of its key, so a read of the key sees either the old value or the new one in full,
+ * and needs no lock against the writes.
+ *
+ * Optionally keeps a Bloom filter of the keys on disk, so a read of a key that was never written
+ * returns without opening any file. The filter is built from the files in the directory when the
+ * engine is made, and every write adds its key. Deleted keys stay in the filter, so compact() rebuilds
+ * it once the keys written or deleted since it was built would raise its false positive rate.
+ */
+class FileDiskStore : public DiskStore {
+  public:
+    /**
+     * Constructor.
+     *
+     * @param _dirPath path to the directory of the files. Must already exist. The temporary files are in
+     *                 the directory of the same path with ".tmp" appended, which is made if needed.
+     * @param _filterFpr the false positive rate of the Bloom filter, or 0 for no filter.
+     * @param _filterMaxBytes the max size of the Bloom filter, or 0 for no max.
+     */
+    FileDiskStore(const std::string &_dirPath, double _filterFpr = 0, size_t _filterMaxBytes = 0);
+
+    ~FileDiskStore();
+
+    int read(const std::string &key, std::string &value);
+    int write(const std::string &key, const char *value, size_t length);
+    int remove(const std::string &key);
+
+    /**
+     * Open the file of a key. The location is the whole file, which is closed once the location and its
+     * copies are gone. A write of the key meanwhile renames a new file over it, so it keeps the old value.
+     */
+    int locate(const std::string &key, DiskLocation &location);
+
+    /**
+     * Rebuild the Bloom filter if it is due.
+     */
+    int compact();
+
+    /**
+     * Sync the file system of the directory, since the writes may be to any of its files.
+     */
+    int sync();
+
+    int forEachKey(const std::function<void(const std::string &)> &callback);
+    void getStats(DiskStoreStats &stats) const;
+
+  private:
+    void rebuildFilter();
+    int replaceFile(const std::string &key, const char *value, size_t length);
+
+    const std::string dirPath;
+    const std::string tmpPath; // Directory of the temporary files.
+    std::atomic<unsigned long> nextTmp; // Number of the next temporary file.
+    const double filterFpr;
+    const size_t filterMaxBytes;
+    std::shared_ptr<BloomFilter> filter; // Read with atomic_load, since a rebuild replaces it.
+    std::shared_ptr<BloomFilter> nextFilter; // The filter being rebuilt, if any. Gets the keys written meanwhile.
+    size_t keysAtBuild; // Number of keys on disk when the filter was built.
+    size_t keysAdded; // Number of writes of keys the filter did not have yet since it was built.
+    size_t keysDeleted; // Number of deletes since the filter was built.
+    pthread_mutex_t filter_lock; // Protects the members above. Held by writes until the file is written.
+    std::atomic<unsigned long> negatives;
+    std::atomic<unsigned long> falsePositives;
+    std::atomic<unsigned long> rebuilds;
+};
+
+/**
+ * Make a disk storage engine of the given type.
+ *
+ * @param engine the type of the engine.
+ * @param dirPath path to the directory used by the engine. Must already exist. What the engine stored in it before is kept.
+ * @param filterFpr the false positive rate of the Bloom filter of the keys on disk, or 0 for no filter.
+ *                  Only used by engines that have to touch the disk to find out that a key is absent.
+ * @param filterMaxBytes the max size of the Bloom filter, or 0 for no max.
+ * @return the new engine.
+ */
+DiskStore *makeDiskStore(DiskEngine engine, const std::string &dirPath, double filterFpr = 0, size_t filterMaxBytes = 0);
+
+} // namespace multicore
@@ -3,9 +3,13 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <dirent.h>
 #include <ftw.h>
 #include <cstdio>
+#include <cstdint>
+#include <cstring>
 #include <string>
+#include <vector>
 #include <fstream>
 #include <sstream>
 using std::string;
@@ -25,6 +29,14 @@ int initDir(const string &fpath) {
     return nftw(fpath.c_str(), unlink_cb, 64, FTW_DEPTH | FTW_PHYS);
 }
 
+int makeDir(const string &fpath) {
+    struct stat st;
+    if (!stat(fpath.c_str(), &st)) {
+        return S_ISDIR(st.st_mode) ? 0 : -1;
+    }
+    return mkdir(fpath.c_str(), S_IRWXU);
+}
+
 int readFile(const string &fpath, string &value) {
     fstream file;
     file.open(fpath.c_str(), fstream::in);
@@ -45,10 +57,80 @@ int writeFile(const string &fpath, const string &value) {
     return file.good() ? 0 : -1;
 }
 
+int writeFile(const string &fpath, const char *value, size_t length) {
+    fstream file;
+    file.open(fpath.c_str(), fstream::out | fstream::trunc);
+    if (file.good()) {
+        file.write(value, length);
+    }
+    return file.good() ? 0 : -1;
+}
+
 int deleteFile(const string &fpath) {
     return std::remove(fpath.c_str());
 }
 
+int listFiles(const string &dirPath, std::vector<string> &names) {
+    DIR *dir = opendir(dirPath.c_str());
+    if (dir == nullptr) {
+        return -1;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        if (entry->d_type == DT_REG) {
+            names.push_back(entry->d_name);
+        } else if (entry->d_type == DT_UNKNOWN) { // the file system does not report types
+            struct stat st;
+            if (!stat((dirPath + "/" + entry->d_name).c_str(), &st) && S_ISREG(st.st_mode)) {
+                names.push_back(entry->d_name);
+            }
+        }
+    }
+    closedir(dir);
+    return 0;
+}
+
+// Lookup tables of the CRC-32 (IEEE 802.3) polynomial. entries[k][i] is the CRC of byte i followed by k zero
+// bytes, so eight bytes can be looked up at once (slicing-by-8), which is several times faster than one
+// byte at a time and matters for replaying logs and loading segments at start.
+struct Crc32Table {
+    uint32_t entries[8][256];
+    Crc32Table() {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) {
+                c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+            }
+            entries[0][i] = c;
+        }
+        for (uint32_t i = 0; i < 256; ++i) {
+            for (int k = 1; k < 8; ++k) {
+                entries[k][i] = (entries[k - 1][i] >> 8) ^ entries[0][entries[k - 1][i] & 0xFF];
+            }
+        }
+    }
+};
+
+uint32_t crc32(const char *data, size_t length, uint32_t crc) {
+    static const Crc32Table table;
+    const uint32_t (*t)[256] = table.entries;
+    crc = ~crc;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for (; length >= 8; data += 8, length -= 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, data, sizeof(lo));
+        memcpy(&hi, data + 4, sizeof(hi));
+        lo ^= crc;
+        crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24] ^
+              t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^ t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+    }
+#endif
+    for (size_t i = 0; i < length; ++i) {
+        crc = t[0][(crc ^ (unsigned char) data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
 static int unlink_cb(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf)
 {
     int rv;
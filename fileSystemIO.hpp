@@ -1,4 +1,7 @@
 #include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
 
 namespace multicore {
 
@@ -14,6 +17,15 @@ namespace multicore {
  */
 int initDir(const std::string &fpath);
 
+/**
+ * Make a directory if it does not exist yet. Unlike initDir, an existing directory is kept as it is.
+ *
+ * @param fpath the path to the directory.
+ * @return 0 on success;
+ *         -1 on error.
+ */
+int makeDir(const std::string &fpath);
+
 /**
  * Read a key-value file from disk.
  *
@@ -38,6 +50,19 @@ int readFile(const std::string &fpath, std::string &value);
  */
 int writeFile(const std::string &fpath, const std::string &value);
 
+/**
+ * Write a key-value file to disk.
+ *
+ * A key-value file is a file of which the name is the key, and content is the value.
+ *
+ * @param fpath path (and name) of the file.
+ * @param value the value to be written to the file.
+ * @param length length of the value.
+ * @return 0 if writing succeed;
+ *         -1 if writing failed.
+ */
+int writeFile(const std::string &fpath, const char *value, size_t length);
+
 /**
  * Delete a key-value file from disk.
  *
@@ -49,4 +74,24 @@ int writeFile(const std::string &fpath, const std::string &value);
  */
 int deleteFile(const std::string &fpath);
 
+/**
+ * List the names of the regular files in a directory, i.e. the keys of the key-value files in it.
+ *
+ * @param dirPath path to the directory.
+ * @param names the vector to append the names to.
+ * @return 0 on success;
+ *         -1 on error.
+ */
+int listFiles(const std::string &dirPath, std::vector<std::string> &names);
+
+/**
+ * Compute the CRC-32 checksum of a block of data, used for detecting corrupted records on disk.
+ *
+ * @param data the data.
+ * @param length length of the data in bytes.
+ * @param crc the checksum of preceding data if the checksum is computed in several steps, 0 otherwise.
+ * @return the checksum.
+ */
+uint32_t crc32(const char *data, size_t length, uint32_t crc = 0);
+
 } // namespace multicore
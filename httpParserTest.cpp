@@ -0,0 +1,73 @@
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <algorithm>
+
+#include "httpProcessingFunc.hpp"
+
+using namespace multicore;
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            ++failures; \
+        } \
+    } while (0)
+
+// Feed a request to the parser the way a connection receives it, a few bytes at a time, and return what the
+// parser returned last: the length of the request, 0 if it wants more bytes, or the error.
+static long parseInPieces(const std::string &bytes, size_t pieceLength) {
+    HTTP_Parser parser;
+    HTTP_Request request;
+    long ret = 0;
+    for (size_t length = pieceLength; ; length += pieceLength) {
+        length = std::min(length, bytes.size());
+        ret = parseHTTP(bytes.data(), length, parser, request);
+        if (ret || length == bytes.size()) {
+            return ret;
+        }
+    }
+}
+
+// A head of many short lines, none of them long on its own, must still be cut off at the max head length,
+// whether it is still coming or already complete in the buffer.
+static void testManyShortHeaderLines() {
+    std::string head = "GET /key HTTP/1.1\r\n";
+    while (head.size() < 256 * 1024) {
+        head += "X-A: b\r\n";
+    }
+    CHECK(parseInPieces(head, 4096) == HTTP_HEAD_TOO_LONG);
+    CHECK(parseInPieces(head + "\r\n", 4096) == HTTP_HEAD_TOO_LONG);
+    CHECK(parseInPieces(head + "\r\n", head.size() + 2) == HTTP_HEAD_TOO_LONG);
+    CHECK(!strncmp(parseErrorResponse(HTTP_HEAD_TOO_LONG), "HTTP/1.1 431 ", 13));
+}
+
+static void testLongBody() {
+    CHECK(parseInPieces("POST /key HTTP/1.1\r\nContent-Length: 1000000000\r\n\r\n", 16) == HTTP_BODY_TOO_LONG);
+    CHECK(!strncmp(parseErrorResponse(HTTP_BODY_TOO_LONG), "HTTP/1.1 413 ", 13));
+    long ret = parseInPieces("POST /key HTTP/1.1\r\nContent-Length: 99999999999999999999999\r\n\r\n", 16);
+    CHECK(ret < 0 && ret != HTTP_BODY_TOO_LONG);
+    CHECK(!strncmp(parseErrorResponse(ret), "HTTP/1.1 400 ", 13));
+}
+
+static void testValidRequests() {
+    std::string get = "GET /key HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    CHECK(parseInPieces(get, 3) == (long) get.size());
+    std::string post = "POST /key HTTP/1.1\r\nContent-Length: 5\r\n\r\nvalue";
+    CHECK(parseInPieces(post, 7) == (long) post.size());
+}
+
+// Program entry. Returns non-zero if any check failed.
+int main() {
+    testManyShortHeaderLines();
+    testLongBody();
+    testValidRequests();
+    if (failures) {
+        fprintf(stderr, "%d parser checks failed.\n", failures);
+        return 1;
+    }
+    printf("All parser checks passed.\n");
+    return 0;
+}
@@ -1,58 +1,154 @@
-#define _GLIBCXX_USE_C99 1
-
-#include <sstream>
-#include <string>
-#include <algorithm>
+#include <cstring>
 #include <cctype>
+#include <cstdint>
 
 #include "httpProcessingFunc.hpp"
 
+#define MAX_HEAD_LENGTH 65536 // Max length of the request line and headers of a request.
+#define MAX_BODY_LENGTH (64UL << 20) // Max length of the body of a request.
+
 namespace multicore {
 
-std::string &strToLower(std::string &str) {
-    std::transform(str.begin(), str.end(), str.begin(), static_cast<int(*)(int)>(std::tolower));
-    return str;
+// Whether a header name is equal to the given lower case name, ignoring case.
+static bool headerIs(const char *name, size_t nameLength, const char *lowerName) {
+    size_t i = 0;
+    for (; i < nameLength && lowerName[i]; ++i) {
+        if (std::tolower((unsigned char) name[i]) != lowerName[i]) {
+            return false;
+        }
+    }
+    return i == nameLength && !lowerName[i];
 }
 
-int parseHTTP(char *buffer, HTTP_Request &request) {
-    std::istringstream strm(buffer);
-    std::string token;
-    strm >> token;
-    if (token == "GET") {
-        request.type = GET;
-    } else if (token == "POST") {
-        request.type = POST;
-    } else if (token == "DELETE") {
-        request.type = DELETE;
+// Parse the request line. Returns 0 if success, negative values if failed.
+static int parseRequestLine(const char *line, size_t length, HTTP_Parser &parser) {
+    const char *end = line + length;
+    const char *sp = (const char *) memchr(line, ' ', length);
+    if (sp == nullptr) {
+        return -1;
+    }
+    size_t methodLength = sp - line;
+    if (methodLength == 3 && !memcmp(line, "GET", 3)) {
+        parser.type = GET;
+    } else if (methodLength == 4 && !memcmp(line, "POST", 4)) {
+        parser.type = POST;
+    } else if (methodLength == 6 && !memcmp(line, "DELETE", 6)) {
+        parser.type = DELETE;
     } else {
         return -1;
     }
-    strm >> token;
-    if (token.empty() || token[0] != '/') {
+    const char *target = sp + 1;
+    sp = (const char *) memchr(target, ' ', end - target);
+    if (sp == nullptr || sp == target || target[0] != '/') {
         return -2;
     }
-    request.key = token.substr(1);
-    strm >> token;
-    if (token != "HTTP/1.1") {
+    parser.keyStart = target + 1 - line; // The request line is at the start of the request.
+    parser.keyLength = sp - target - 1;
+    const char *version = sp + 1;
+    if (end - version != 8 || memcmp(version, "HTTP/1.1", 8)) {
         return -3;
     }
-    if (request.type == POST) {
-        size_t length = 0;
-        do {
-            strm >> token;
-            if (strToLower(token) == "content-length:") {
-                std::getline(strm, token);
-                length = std::stoi(token);
-                break;
-            }
-        } while (!strm.eof());
-        do {
-            getline(strm, token);
-        } while (!token.empty() && token != "\r" && !strm.eof());
-        request.value = std::string(length, '\0'); // Note there is actually  (length + 1) '\0's. One will be automatically added.
-        strm.read(&request.value[0], length);
+    return 0;
+}
+
+// Parse a header value made of a decimal number, with optional whitespace around it. Returns false if it is not,
+// or if the number does not fit.
+static bool parseNumber(const char *p, const char *end, size_t &value) {
+    while (p < end && (*p == ' ' || *p == '\t')) {
+        ++p;
+    }
+    if (p == end) {
+        return false;
+    }
+    value = 0;
+    for (; p < end && std::isdigit((unsigned char) *p); ++p) {
+        if (value > (SIZE_MAX - (*p - '0')) / 10) {
+            return false;
+        }
+        value = value * 10 + (*p - '0');
+    }
+    while (p < end && (*p == ' ' || *p == '\t')) {
+        ++p;
+    }
+    return p == end;
+}
+
+// Parse a header line. Returns 0 if success, negative values if failed.
+static int parseHeader(const char *line, size_t length, HTTP_Parser &parser) {
+    const char *colon = (const char *) memchr(line, ':', length);
+    if (colon == nullptr) {
+        return -4;
+    }
+    size_t nameLength = colon - line;
+    if (nameLength == 14 && headerIs(line, nameLength, "content-length")) {
+        if (!parseNumber(colon + 1, line + length, parser.contentLength)) {
+            return -4;
+        }
+        if (parser.contentLength > MAX_BODY_LENGTH) { // Rejected before the body is buffered.
+            return HTTP_BODY_TOO_LONG;
+        }
+    } else if (nameLength == 5 && headerIs(line, nameLength, "x-ttl")) {
+        size_t ttl;
+        if (!parseNumber(colon + 1, line + length, ttl)) {
+            return -4;
+        }
+        parser.ttl = ttl;
     }
     return 0;
 }
 
+long parseHTTP(const char *buffer, size_t length, HTTP_Parser &parser, HTTP_Request &request) {
+    // Parse the head line by line, remembering where to resume.
+    while (!parser.bodyStart) {
+        const char *line = buffer + parser.lineStart;
+        const char *newline = (const char *) memchr(line, '\n', length - parser.lineStart);
+        if (newline == nullptr) {
+            return length > MAX_HEAD_LENGTH ? HTTP_HEAD_TOO_LONG : 0;
+        }
+        if ((size_t) (newline + 1 - buffer) > MAX_HEAD_LENGTH) { // however short its lines are
+            parser.reset();
+            return HTTP_HEAD_TOO_LONG;
+        }
+        size_t lineLength = newline - line;
+        if (lineLength && line[lineLength - 1] == '\r') {
+            --lineLength;
+        }
+        int ret = 0;
+        if (parser.lineStart == 0) {
+            ret = parseRequestLine(line, lineLength, parser);
+        } else if (lineLength == 0) { // end of the head
+            parser.bodyStart = newline + 1 - buffer;
+        } else {
+            ret = parseHeader(line, lineLength, parser);
+        }
+        if (ret) {
+            parser.reset();
+            return ret;
+        }
+        parser.lineStart = newline + 1 - buffer;
+    }
+    // Wait for the whole body.
+    if (length - parser.bodyStart < parser.contentLength) {
+        return 0;
+    }
+    request.type = parser.type;
+    request.key = StringView(buffer + parser.keyStart, parser.keyLength);
+    request.value = StringView(buffer + parser.bodyStart, parser.type == POST ? parser.contentLength : 0);
+    request.ttl = parser.type == POST ? parser.ttl : 0;
+    long requestLength = parser.bodyStart + parser.contentLength;
+    parser.reset();
+    return requestLength;
+}
+
+const char *parseErrorResponse(long error) {
+    switch (error) {
+      case HTTP_HEAD_TOO_LONG:
+        return "HTTP/1.1 431 Request header fields too large\r\nConnection: close\r\nContent-length: 0\r\n\r\n";
+      case HTTP_BODY_TOO_LONG:
+        return "HTTP/1.1 413 Payload too large\r\nConnection: close\r\nContent-length: 0\r\n\r\n";
+      default:
+        return "HTTP/1.1 400 Bad request\r\nConnection: close\r\nContent-length: 0\r\n\r\n";
+    }
+}
+
 } // namespace multicore
@@ -1,6 +1,10 @@
 #pragma once
 
 #include <string>
+#include <cstddef>
+
+#define HTTP_HEAD_TOO_LONG (-5) // Returned by parseHTTP for a request whose head is over the max length.
+#define HTTP_BODY_TOO_LONG (-6) // Returned by parseHTTP for a request whose body is over the max length.
 
 namespace multicore {
 
@@ -13,25 +17,86 @@ enum RequestType {
     DELETE
 };
 
+/**
+ * A view of a part of a buffer. Does not own the bytes, so it is only valid as long as the buffer is unchanged.
+ */
+struct StringView {
+    const char *data;
+    size_t length;
+
+    StringView(): data(nullptr), length(0) {}
+    StringView(const char *_data, size_t _length): data(_data), length(_length) {}
+
+    inline std::string str() const {
+        return std::string(data, length);
+    }
+};
+
 /**
  * Parsed information from an HTTP request.
  *
  * Not all fields are always used. For example if type of request is DELETE, then value is not used.
+ * key and value are views into the buffer the request was parsed from.
  */
 struct HTTP_Request {
     RequestType type;
-    std::string key;
-    std::string value;
+    StringView key;
+    StringView value;
+    unsigned long ttl; // Seconds until the key expires, from the X-TTL header, or 0 if there is none.
+};
+
+/**
+ * State of parsing one HTTP request, so parsing can resume when more bytes of the request arrive.
+ *
+ * All offsets are relative to the start of the request in the buffer.
+ */
+struct HTTP_Parser {
+    size_t lineStart; // Start of the first line not parsed yet.
+    size_t bodyStart; // Start of the body, or 0 if the end of the head has not been seen yet.
+    size_t contentLength;
+    RequestType type;
+    size_t keyStart;
+    size_t keyLength;
+    unsigned long ttl;
+
+    HTTP_Parser() {
+        reset();
+    }
+
+    // Prepare for parsing the next request.
+    inline void reset() {
+        lineStart = 0;
+        bodyStart = 0;
+        contentLength = 0;
+        ttl = 0;
+    }
 };
 
 /**
- * Parse a (subset of) HTTP1.1 requests.
+ * Parse a (subset of) HTTP1.1 requests, incrementally.
  *
- * @param buffer the HTTP request.
- * @param request parsed information.
- * @return 0 if success;
+ * The buffer may hold an incomplete request, in which case 0 is returned, and parsing resumes from where
+ * it stopped when the function is called again with the same parser, the same start of the request and
+ * more bytes. The buffer may also hold more than one request, in which case only the first is parsed.
+ * Does not allocate memory. A request whose head or body is too long fails as soon as that is known, so
+ * its bytes need not be buffered.
+ *
+ * @param buffer the buffer, starting at the start of the request.
+ * @param length the number of bytes available in the buffer.
+ * @param parser the parsing state. Reset automatically once a request is complete.
+ * @param request parsed information, set once the request is complete.
+ * @return the length of the request in bytes if a complete request is parsed;
+ *         0 if more bytes are needed;
  *         negative values if failed.
  */
-int parseHTTP(char *buffer, HTTP_Request &request);
+long parseHTTP(const char *buffer, size_t length, HTTP_Parser &parser, HTTP_Request &request);
+
+/**
+ * The response to send before closing a connection whose request could not be parsed.
+ *
+ * @param error the negative value returned by parseHTTP.
+ * @return the response: 431 for a head that is too long, 413 for a body that is too long, 400 otherwise.
+ */
+const char *parseErrorResponse(long error);
 
 } // namespace multicore
@@ -0,0 +1,166 @@
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+#include "ioRing.hpp"
+
+namespace multicore {
+
+IoRing::IoRing(unsigned int _entries)
+    : submits(0), reads(0), entries(_entries ? _entries : 1), ringFd(-1), evFd(-1), sqHead(nullptr), sqTail(nullptr),
+      sqMask(0), sqArray(nullptr), sqes(nullptr), cqHead(nullptr), cqTail(nullptr), cqMask(0), cqes(nullptr),
+      sqMap(MAP_FAILED), sqMapSize(0), cqMap(MAP_FAILED), cqMapSize(0), sqesSize(0), toSubmit(0), inFlight(0) {
+#ifdef __NR_io_uring_setup
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0) { // ENOSYS on old kernels, EPERM if disabled
+        return;
+    }
+    // The queues are shared with the kernel through three mappings of the ring, or two if the kernel maps
+    // both queues at once.
+    sqMapSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    cqMapSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool singleMap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (singleMap) {
+        sqMapSize = cqMapSize = std::max(sqMapSize, cqMapSize);
+    }
+    sqMap = mmap(nullptr, sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    cqMap = singleMap ? sqMap : mmap(nullptr, cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqesMap = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    evFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (sqMap == MAP_FAILED || cqMap == MAP_FAILED || sqesMap == MAP_FAILED || evFd < 0 ||
+        syscall(__NR_io_uring_register, fd, IORING_REGISTER_EVENTFD, &evFd, 1)) {
+        if (sqesMap != MAP_FAILED) {
+            munmap(sqesMap, sqesSize);
+        }
+        if (cqMap != MAP_FAILED && cqMap != sqMap) {
+            munmap(cqMap, cqMapSize);
+        }
+        if (sqMap != MAP_FAILED) {
+            munmap(sqMap, sqMapSize);
+        }
+        if (evFd >= 0) {
+            close(evFd);
+        }
+        sqMap = cqMap = MAP_FAILED;
+        evFd = -1;
+        close(fd);
+        return;
+    }
+    char *sq = (char *) sqMap;
+    sqHead = (unsigned int *) (sq + params.sq_off.head);
+    sqTail = (unsigned int *) (sq + params.sq_off.tail);
+    sqMask = *(unsigned int *) (sq + params.sq_off.ring_mask);
+    sqArray = (unsigned int *) (sq + params.sq_off.array);
+    sqes = (struct io_uring_sqe *) sqesMap;
+    char *cq = (char *) cqMap;
+    cqHead = (unsigned int *) (cq + params.cq_off.head);
+    cqTail = (unsigned int *) (cq + params.cq_off.tail);
+    cqMask = *(unsigned int *) (cq + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    ringFd = fd;
+#endif
+}
+
+IoRing::~IoRing() {
+    if (ringFd < 0) {
+        return;
+    }
+    munmap(sqes, sqesSize);
+    if (cqMap != sqMap) {
+        munmap(cqMap, cqMapSize);
+    }
+    munmap(sqMap, sqMapSize);
+    close(evFd);
+    close(ringFd);
+}
+
+bool IoRing::prepareRead(int fd, char *buf, size_t length, uint64_t offset, void *data) {
+#ifdef __NR_io_uring_setup
+    if (ringFd < 0 || inFlight.load(std::memory_order_relaxed) >= entries) {
+        return false;
+    }
+    // The kernel never has more entries to consume than are in flight, so the slot at the tail is free.
+    unsigned int tail = *sqTail;
+    unsigned int index = tail & sqMask;
+    struct io_uring_sqe *sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) (uintptr_t) buf;
+    sqe->len = length;
+    sqe->off = offset;
+    sqe->user_data = (uint64_t) (uintptr_t) data;
+    sqArray[index] = index;
+    __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+    ++toSubmit;
+    inFlight.fetch_add(1, std::memory_order_relaxed);
+    return true;
+#else
+    return false;
+#endif
+}
+
+int IoRing::submit() {
+#ifdef __NR_io_uring_setup
+    while (toSubmit) {
+        int n = syscall(__NR_io_uring_enter, ringFd, toSubmit, 0, 0, nullptr, 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EBUSY) { // short of resources for now
+                sched_yield();
+                continue;
+            }
+            fprintf(stderr, "io_uring_enter failed. ERROR CODE: %d\n", errno);
+            return -1;
+        }
+        submits.fetch_add(1, std::memory_order_relaxed);
+        toSubmit -= n;
+    }
+#endif
+    return 0;
+}
+
+long IoRing::readCached(int fd, char *buf, size_t length, uint64_t offset) {
+#ifdef RWF_NOWAIT
+    struct iovec iov;
+    iov.iov_base = buf;
+    iov.iov_len = length;
+    ssize_t n;
+    while ((n = preadv2(fd, &iov, 1, offset, RWF_NOWAIT)) < 0 && errno == EINTR) {}
+    return n;
+#else
+    return -1;
+#endif
+}
+
+size_t IoRing::reap(const std::function<void(void *data, int result)> &callback) {
+    if (ringFd < 0) {
+        return 0;
+    }
+    unsigned int head = *cqHead;
+    unsigned int tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+    size_t n = 0;
+    for (; head != tail; ++head, ++n) {
+        struct io_uring_cqe *cqe = &cqes[head & cqMask];
+        callback((void *) (uintptr_t) cqe->user_data, cqe->res);
+    }
+    __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+    inFlight.fetch_sub(n, std::memory_order_relaxed);
+    reads.fetch_add(n, std::memory_order_relaxed);
+    return n;
+}
+
+} // namespace multicore
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <functional>
+
+#define DEFAULT_IO_RING_ENTRIES 256 // Max number of reads in flight on a ring.
+
+// Defined in <linux/io_uring.h>, which only ioRing.cpp includes.
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+namespace multicore {
+
+/**
+ * @section DESCRIPTION
+ *
+ * An io_uring instance for reading files asynchronously, set up with the raw system calls.
+ *
+ * Reads are prepared in the submission queue and handed to the kernel in batches by submit(), so many
+ * reads cost a single system call. Completions are announced on an eventfd, which can be watched with
+ * epoll, and are taken from the completion queue by reap().
+ *
+ * The submission side (prepareRead and submit) must be used by one thread at a time, and so must the
+ * completion side (reap), but the two sides can be used by different threads at once. There are never
+ * more reads in flight than the ring has entries, so the completion queue cannot overflow.
+ *
+ * If the kernel does not support io_uring, or it is disabled, the ring is not available and every
+ * prepareRead fails, so callers fall back on reading synchronously.
+ */
+class IoRing {
+  public:
+    /**
+     * Constructor. Sets up the ring and its eventfd.
+     *
+     * @param _entries the max number of reads in flight.
+     */
+    explicit IoRing(unsigned int _entries = DEFAULT_IO_RING_ENTRIES);
+
+    /**
+     * Destructor. Reads still in flight must have been reaped.
+     */
+    ~IoRing();
+
+    /**
+     * @return whether the ring could be set up.
+     */
+    inline bool available() const {
+        return ringFd >= 0;
+    }
+
+    /**
+     * @return the eventfd which becomes readable when reads complete, or -1 if the ring is not available.
+     */
+    inline int eventFd() const {
+        return evFd;
+    }
+
+    /**
+     * @return the number of reads prepared but not submitted yet.
+     */
+    inline unsigned int unsubmitted() const {
+        return toSubmit;
+    }
+
+    /**
+     * Prepare a read of a file. The kernel only sees it after the next submit.
+     *
+     * @param fd the file.
+     * @param buf the buffer to read into. Must stay valid until the read is reaped.
+     * @param length the number of bytes to read.
+     * @param offset the offset in the file.
+     * @param data passed back by reap along with the result.
+     * @return true if the read is prepared;
+     *         false if the ring is not available, or has as many reads in flight as it has entries.
+     */
+    bool prepareRead(int fd, char *buf, size_t length, uint64_t offset, void *data);
+
+    /**
+     * Hand the prepared reads to the kernel.
+     *
+     * @return 0 on success;
+     *         -1 if the kernel did not take them all, in which case the rest is submitted next time.
+     */
+    int submit();
+
+    /**
+     * Take the completed reads from the completion queue, and call a function on each. The eventfd should
+     * be read before, so completions arriving during the call are announced again.
+     *
+     * @param callback the function, called with the data of the read and its result: the number of bytes
+     *                 read, which may be short, or a negative error number.
+     * @return the number of reads reaped.
+     */
+    size_t reap(const std::function<void(void *data, int result)> &callback);
+
+    /**
+     * Read a file only as far as it is in the page cache, so the read never waits for the disk. Reads that
+     * this answers in full are not worth the round trip through the ring.
+     *
+     * @param fd the file.
+     * @param buf the buffer to read into.
+     * @param length the number of bytes to read.
+     * @param offset the offset in the file.
+     * @return the number of bytes read, which may be short, or -1 if none could be read without waiting.
+     */
+    static long readCached(int fd, char *buf, size_t length, uint64_t offset);
+
+    std::atomic<unsigned long> submits; // Number of system calls submitting reads.
+    std::atomic<unsigned long> reads; // Number of reads completed.
+
+  private:
+    const unsigned int entries;
+    int ringFd;
+    int evFd;
+    // The submission queue, as mapped from the kernel. The tail is written by us, the head by the kernel.
+    unsigned int *sqHead;
+    unsigned int *sqTail;
+    unsigned int sqMask;
+    unsigned int *sqArray;
+    io_uring_sqe *sqes;
+    // The completion queue, as mapped from the kernel. The tail is written by the kernel, the head by us.
+    unsigned int *cqHead;
+    unsigned int *cqTail;
+    unsigned int cqMask;
+    io_uring_cqe *cqes;
+    void *sqMap;
+    size_t sqMapSize;
+    void *cqMap; // Same as sqMap if the kernel maps both queues at once.
+    size_t cqMapSize;
+    size_t sqesSize;
+    unsigned int toSubmit; // Reads prepared but not submitted yet.
+    std::atomic<unsigned int> inFlight; // Reads prepared but not reaped yet.
+};
+
+} // namespace multicore
@@ -0,0 +1,132 @@
+#include "latencyHistogram.hpp"
+
+namespace multicore {
+
+LatencyHistogram::LatencyHistogram() {
+    reset();
+}
+
+void LatencyHistogram::merge(const LatencyHistogram &other) {
+    for (unsigned int i = 0; i < HISTOGRAM_NUM_BUCKETS; ++i) {
+        uint64_t n = other.counts[i].load(std::memory_order_relaxed);
+        if (n) {
+            counts[i].fetch_add(n, std::memory_order_relaxed);
+        }
+    }
+    total.fetch_add(other.total.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    sum.fetch_add(other.sum.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    if (other.max() > max()) {
+        maxValue.store(other.max(), std::memory_order_relaxed);
+    }
+}
+
+void LatencyHistogram::reset() {
+    for (unsigned int i = 0; i < HISTOGRAM_NUM_BUCKETS; ++i) {
+        counts[i].store(0, std::memory_order_relaxed);
+    }
+    total.store(0, std::memory_order_relaxed);
+    sum.store(0, std::memory_order_relaxed);
+    maxValue.store(0, std::memory_order_relaxed);
+}
+
+double LatencyHistogram::mean() const {
+    uint64_t n = count();
+    return n ? (double) sum.load(std::memory_order_relaxed) / n : 0;
+}
+
+uint64_t LatencyHistogram::percentile(double percentile) const {
+    // The total is read separately from the buckets, which may be updated in the meantime,
+    // so the walk stops at the last non-empty bucket if the target is never reached.
+    uint64_t n = count();
+    if (!n) {
+        return 0;
+    }
+    uint64_t target = (uint64_t) (percentile / 100 * n + 0.5);
+    if (target < 1) {
+        target = 1;
+    }
+    uint64_t seen = 0;
+    uint64_t value = 0;
+    for (unsigned int i = 0; i < HISTOGRAM_NUM_BUCKETS; ++i) {
+        uint64_t c = counts[i].load(std::memory_order_relaxed);
+        if (c) {
+            seen += c;
+            value = highestValueOf(i);
+            if (seen >= target) {
+                break;
+            }
+        }
+    }
+    return value < max() ? value : max(); // The max is exact, unlike the buckets.
+}
+
+uint64_t LatencyHistogram::highestValueOf(unsigned int bucket) {
+    if (bucket < HISTOGRAM_SUB_BUCKETS) {
+        return bucket;
+    }
+    unsigned int shift = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+    uint64_t base = (uint64_t) (bucket % HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS) << shift;
+    return base + ((uint64_t) 1 << shift) - 1;
+}
+
+const char *latencyOpName(LatencyOp op) {
+    switch (op) {
+      case OP_GET_HIT:
+        return "GET hit";
+      case OP_GET_MISS:
+        return "GET miss";
+      case OP_POST:
+        return "POST";
+      case OP_DELETE:
+        return "DELETE";
+      case OP_BATCH:
+        return "batch";
+      default:
+        return "unknown";
+    }
+}
+
+LatencyRecorder::LatencyRecorder() {
+    pthread_mutex_init(&threads_lock, nullptr);
+}
+
+LatencyRecorder::~LatencyRecorder() {
+    for (PerThread *t : threads) {
+        delete t;
+    }
+    pthread_mutex_destroy(&threads_lock);
+}
+
+LatencyRecorder::PerThread *LatencyRecorder::registerThread() {
+    PerThread *t = new PerThread;
+    pthread_mutex_lock(&threads_lock);
+    threads.push_back(t);
+    pthread_mutex_unlock(&threads_lock);
+    return t;
+}
+
+void LatencyRecorder::collect(LatencyOp op, LatencyHistogram &merged) {
+    pthread_mutex_lock(&threads_lock);
+    for (PerThread *t : threads) {
+        merged.merge(t->ops[op]);
+    }
+    pthread_mutex_unlock(&threads_lock);
+}
+
+void LatencyRecorder::collectAll(LatencyHistogram &merged) {
+    for (int op = 0; op < NUM_LATENCY_OPS; ++op) {
+        collect((LatencyOp) op, merged);
+    }
+}
+
+void LatencyRecorder::reset() {
+    pthread_mutex_lock(&threads_lock);
+    for (PerThread *t : threads) {
+        for (int op = 0; op < NUM_LATENCY_OPS; ++op) {
+            t->ops[op].reset();
+        }
+    }
+    pthread_mutex_unlock(&threads_lock);
+}
+
+} // namespace multicore
@@ -0,0 +1,188 @@
+#pragma once
+
+#include <pthread.h>
+#include <atomic>
+#include <vector>
+#include <cstdint>
+
+#define HISTOGRAM_SUB_BUCKET_BITS 5 // Each power of 2 is split into 2^5 buckets, so values are kept within about 3%.
+#define HISTOGRAM_SUB_BUCKETS     (1 << HISTOGRAM_SUB_BUCKET_BITS)
+#define HISTOGRAM_NUM_BUCKETS     ((64 - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+namespace multicore {
+
+/**
+ * @section DESCRIPTION
+ *
+ * A histogram of latencies in nanoseconds with logarithmic buckets, in the style of HdrHistogram.
+ *
+ * Values below 2^5 have a bucket each, and every power of 2 above is split into 2^5 buckets of equal
+ * width, so any value from a nanosecond to hours is counted in constant memory, and percentiles are
+ * accurate to about 3%.
+ *
+ * A histogram is meant to be recorded by a single thread. Recording is wait-free: it only does relaxed
+ * atomic operations on cache lines no other thread writes to. Other threads may read the histogram at
+ * any time, e.g. to merge it into another one for reporting.
+ */
+class LatencyHistogram {
+  public:
+    /**
+     * Constructor. Makes an empty histogram.
+     */
+    LatencyHistogram();
+
+    /**
+     * Count a value. Must only be called by the thread owning the histogram.
+     *
+     * @param nanos the value in nanoseconds.
+     */
+    inline void record(uint64_t nanos) {
+        counts[bucketOf(nanos)].fetch_add(1, std::memory_order_relaxed);
+        total.fetch_add(1, std::memory_order_relaxed);
+        sum.fetch_add(nanos, std::memory_order_relaxed);
+        if (nanos > maxValue.load(std::memory_order_relaxed)) {
+            maxValue.store(nanos, std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * Add the counts of another histogram to this one.
+     *
+     * @param other the histogram to be added.
+     */
+    void merge(const LatencyHistogram &other);
+
+    /**
+     * Clear all counts.
+     */
+    void reset();
+
+    /**
+     * @return the number of values counted.
+     */
+    inline uint64_t count() const {
+        return total.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @return the mean of the values in nanoseconds, or 0 if there is none.
+     */
+    double mean() const;
+
+    /**
+     * @return the max value in nanoseconds, or 0 if there is none.
+     */
+    inline uint64_t max() const {
+        return maxValue.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Find the value at a percentile, i.e. the least value such that the given percentage of the values
+     * are not greater than it, up to the precision of the buckets.
+     *
+     * @param percentile the percentile, from 0 to 100.
+     * @return the value in nanoseconds, or 0 if there is none.
+     */
+    uint64_t percentile(double percentile) const;
+
+  private:
+    std::atomic<uint64_t> counts[HISTOGRAM_NUM_BUCKETS];
+    std::atomic<uint64_t> total;
+    std::atomic<uint64_t> sum;
+    std::atomic<uint64_t> maxValue;
+
+    static inline unsigned int bucketOf(uint64_t value) {
+        if (value < HISTOGRAM_SUB_BUCKETS) {
+            return value;
+        }
+        unsigned int exponent = 63 - __builtin_clzll(value); // At least HISTOGRAM_SUB_BUCKET_BITS.
+        unsigned int shift = exponent - HISTOGRAM_SUB_BUCKET_BITS;
+        return (shift + 1) * HISTOGRAM_SUB_BUCKETS + (unsigned int) (value >> shift) - HISTOGRAM_SUB_BUCKETS;
+    }
+
+    static uint64_t highestValueOf(unsigned int bucket);
+};
+
+/**
+ * The kinds of requests whose latencies are recorded separately.
+ */
+enum LatencyOp {
+    OP_GET_HIT,  // GET served from memory.
+    OP_GET_MISS, // GET that went to disk, whether the key was found or not.
+    OP_POST,
+    OP_DELETE,
+    OP_BATCH,    // POST to /_/batch, whatever its operations.
+    NUM_LATENCY_OPS
+};
+
+/**
+ * Name of a kind of request, for reporting.
+ *
+ * @param op the kind of request.
+ * @return the name.
+ */
+const char *latencyOpName(LatencyOp op);
+
+/**
+ * @section DESCRIPTION
+ *
+ * Latencies of the requests served by a number of threads, recorded per thread and per kind of request.
+ *
+ * Every thread registers itself once, and then records into its own histograms without any
+ * synchronization with other threads. The histograms of all threads are merged when a report is made.
+ */
+class LatencyRecorder {
+  public:
+    /**
+     * The histograms of one thread, one per kind of request.
+     */
+    struct alignas(64) PerThread {
+        LatencyHistogram ops[NUM_LATENCY_OPS];
+
+        /**
+         * Count the latency of a request.
+         *
+         * @param op the kind of request.
+         * @param nanos the latency in nanoseconds.
+         */
+        inline void record(LatencyOp op, uint64_t nanos) {
+            ops[op].record(nanos);
+        }
+    };
+
+    LatencyRecorder();
+    ~LatencyRecorder();
+
+    /**
+     * Make the histograms of a new thread. They live as long as the recorder.
+     *
+     * @return the histograms, to be recorded by the calling thread only.
+     */
+    PerThread *registerThread();
+
+    /**
+     * Merge the histograms of all threads for a kind of request.
+     *
+     * @param op the kind of request.
+     * @param merged the histogram to add the counts to.
+     */
+    void collect(LatencyOp op, LatencyHistogram &merged);
+
+    /**
+     * Merge the histograms of all threads for all kinds of requests.
+     *
+     * @param merged the histogram to add the counts to.
+     */
+    void collectAll(LatencyHistogram &merged);
+
+    /**
+     * Clear the histograms of all threads. Values recorded concurrently may or may not be cleared.
+     */
+    void reset();
+
+  private:
+    std::vector<PerThread *> threads;
+    pthread_mutex_t threads_lock; // Guards the list of threads, not the histograms.
+};
+
+} // namespace multicore
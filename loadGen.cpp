@@ -0,0 +1,749 @@
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <cmath>
+#include <atomic>
+#include <vector>
+#include <deque>
+#include <string>
+
+#include "latencyHistogram.hpp"
+
+#define DEFAULT_HOST          "127.0.0.1" // Address of the server.
+#define DEFAULT_PORT_NO       10801       // Port of the server.
+#define DEFAULT_NUM_THREADS   2           // Number of client threads.
+#define DEFAULT_NUM_CONNS     16          // Number of connections, spread over the client threads.
+#define DEFAULT_DURATION      10          // Length of the measurement in seconds.
+#define DEFAULT_WARMUP        1           // Seconds of load before the measurement starts.
+#define DEFAULT_PIPELINE      1           // Max number of requests in flight on a connection.
+#define DEFAULT_MIX           "90:9:1"    // Percentages of GET, POST and DELETE requests.
+#define DEFAULT_VALUE_SIZE    "100"       // Size of the values posted, either fixed or a min-max range.
+#define DEFAULT_NUM_KEYS      100000      // Number of distinct keys.
+#define DEFAULT_KEY_DIST      "uniform"   // Distribution of the keys requested.
+#define DEFAULT_ZIPF_THETA    0.99        // Skew of the Zipfian distribution, as in YCSB.
+#define DEFAULT_HOT_FRACTION  0.2         // Fraction of the keys in the hot set.
+#define DEFAULT_HOT_PROB      0.8         // Probability of requesting a key in the hot set.
+#define PRELOAD_PIPELINE      64          // Requests in flight while preloading keys.
+#define READ_LENGTH           16384       // Size of each read from a socket.
+
+/**
+ * Load generator for the thread pool server.
+ *
+ * Client threads drive a number of connections each, multiplexed with poll. Requests are a random mix
+ * of GET, POST and DELETE on keys drawn from a uniform, Zipfian or hot-set distribution, with values of
+ * fixed or uniformly random size, and up to a pipelining depth of requests are in flight per connection.
+ * Connections are kept alive, or reopened for every request.
+ *
+ * In closed-loop mode (the default), every connection sends a new request as soon as a response
+ * comes back, and latencies are measured from sending. In open-loop mode (-r), requests are due at a
+ * fixed total rate, and latencies are measured from the time a request was due rather than from the
+ * time it could be sent, so a stalled server is charged for all the requests it held up
+ * (coordinated omission correction).
+ *
+ * Reports throughput and latency percentiles per operation, and optionally writes them as JSON.
+ */
+
+namespace multicore {
+
+enum ClientOp {
+    CLIENT_GET,
+    CLIENT_POST,
+    CLIENT_DELETE,
+    NUM_CLIENT_OPS
+};
+
+static const char *clientOpNames[NUM_CLIENT_OPS] = {"GET", "POST", "DELETE"};
+
+enum KeyDist {
+    KEYS_UNIFORM,
+    KEYS_ZIPF,
+    KEYS_HOTSET
+};
+
+struct LoadOptions {
+    std::string host;
+    unsigned short portno;
+    int nThreads;
+    int nConns;
+    int duration;
+    int warmup;
+    bool keepAlive;
+    int pipeline;
+    int mix[NUM_CLIENT_OPS];
+    size_t minValue, maxValue;
+    unsigned long nKeys;
+    KeyDist keyDist;
+    double zipfTheta;
+    double hotFraction, hotProb;
+    double rate; // Requests per second in total, or 0 for closed-loop.
+    bool preload;
+    std::string jsonPath;
+    struct sockaddr_in servAddr;
+};
+
+// Time in nanoseconds of a monotonic clock.
+static inline uint64_t nowNanos() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+// A small fast random number generator (xorshift64*), one per thread.
+class Random {
+  public:
+    explicit Random(uint64_t seed): state(seed ? seed : 88172645463325252UL) {}
+
+    inline uint64_t next() {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return state * 2685821657736338717UL;
+    }
+
+    // Uniform in [0, 1).
+    inline double nextDouble() {
+        return (next() >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+    // Uniform in [0, n).
+    inline uint64_t nextBelow(uint64_t n) {
+        return next() % n;
+    }
+
+  private:
+    uint64_t state;
+};
+
+// Draws key indexes from the configured distribution.
+//
+// The Zipfian generator is the one of YCSB (Gray et al., "Quickly generating billion-record synthetic
+// databases"), and the ranks it returns are scrambled by a hash, so that the popular keys are spread
+// over the shards of the server rather than being neighbours.
+class KeyChooser {
+  public:
+    explicit KeyChooser(const LoadOptions &options): n(options.nKeys), dist(options.keyDist), theta(options.zipfTheta),
+                                                     hotKeys((unsigned long) (options.nKeys * options.hotFraction)),
+                                                     hotProb(options.hotProb) {
+        if (hotKeys < 1) {
+            hotKeys = 1;
+        }
+        if (dist == KEYS_ZIPF) {
+            zetan = zeta(n, theta);
+            double zeta2 = zeta(2, theta);
+            alpha = 1.0 / (1.0 - theta);
+            eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / zetan);
+        }
+    }
+
+    inline unsigned long next(Random &rand) const {
+        switch (dist) {
+          case KEYS_ZIPF: {
+            double u = rand.nextDouble();
+            double uz = u * zetan;
+            unsigned long rank;
+            if (uz < 1.0) {
+                rank = 0;
+            } else if (uz < 1.0 + pow(0.5, theta)) {
+                rank = 1;
+            } else {
+                rank = (unsigned long) (n * pow(eta * u - eta + 1, alpha));
+            }
+            return scramble(rank < n ? rank : n - 1) % n;
+          }
+          case KEYS_HOTSET:
+            if (rand.nextDouble() < hotProb || hotKeys >= n) {
+                return rand.nextBelow(hotKeys);
+            }
+            return hotKeys + rand.nextBelow(n - hotKeys);
+          default:
+            return rand.nextBelow(n);
+        }
+    }
+
+  private:
+    unsigned long n;
+    KeyDist dist;
+    double theta;
+    unsigned long hotKeys;
+    double hotProb;
+    double zetan, alpha, eta;
+
+    static double zeta(unsigned long n, double theta) {
+        double sum = 0;
+        for (unsigned long i = 1; i <= n; ++i) {
+            sum += 1 / pow((double) i, theta);
+        }
+        return sum;
+    }
+
+    // FNV-1a of the 8 bytes of the rank.
+    static inline uint64_t scramble(uint64_t rank) {
+        uint64_t h = 14695981039346656037UL;
+        for (int i = 0; i < 8; ++i) {
+            h = (h ^ (rank & 0xff)) * 1099511628211UL;
+            rank >>= 8;
+        }
+        return h;
+    }
+};
+
+// A request in flight on a connection.
+struct InFlight {
+    uint64_t start; // When the request was sent, or due in open-loop mode.
+    ClientOp op;
+};
+
+// A connection driven by a client thread.
+struct ClientConn {
+    int fd;
+    std::string in; // Bytes received and not parsed yet.
+    std::string out; // Bytes to be sent.
+    size_t outSent;
+    std::deque<InFlight> inFlight;
+    uint64_t nextDue; // When the next request is due, in open-loop mode.
+    ClientConn(): fd(-1), outSent(0), nextDue(0) {}
+};
+
+// Results of a client thread.
+struct ThreadResult {
+    LatencyHistogram latency[NUM_CLIENT_OPS];
+    unsigned long ok; // 200 responses.
+    unsigned long notFound; // 404 responses, expected for keys not stored yet.
+    unsigned long errors; // Other responses and connection failures.
+    unsigned long connects;
+    ThreadResult(): ok(0), notFound(0), errors(0), connects(0) {}
+};
+
+struct ClientThread {
+    pthread_t tid;
+    unsigned int id;
+    int nConns;
+    const LoadOptions *options;
+    const KeyChooser *keys;
+    uint64_t measureStart, measureEnd;
+    ThreadResult result;
+};
+
+static std::string valueBytes; // Contents of every posted value, as long as the largest one.
+
+// Opens a blocking connection to the server, and then makes it non-blocking. Returns the socket, or -1.
+static int openConnection(const LoadOptions &options) {
+    int one = 1;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, (const struct sockaddr *) &options.servAddr, sizeof(options.servAddr))) {
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+// Appends a request to the output of a connection.
+static void appendRequest(std::string &out, ClientOp op, unsigned long key, size_t valueSize) {
+    char line[128];
+    switch (op) {
+      case CLIENT_GET:
+        out.append(line, snprintf(line, sizeof(line), "GET /key%lu HTTP/1.1\r\nHost: loadgen\r\n\r\n", key));
+        break;
+      case CLIENT_POST:
+        out.append(line, snprintf(line, sizeof(line), "POST /key%lu HTTP/1.1\r\nHost: loadgen\r\nContent-Length: %lu\r\n\r\n",
+                                  key, valueSize));
+        out.append(valueBytes.data(), valueSize);
+        break;
+      default:
+        out.append(line, snprintf(line, sizeof(line), "DELETE /key%lu HTTP/1.1\r\nHost: loadgen\r\n\r\n", key));
+        break;
+    }
+}
+
+// Parses one response at the start of a buffer. Returns its length and sets its status code,
+// 0 if the response is incomplete, or -1 if it is malformed.
+static long parseResponse(const char *data, size_t length, int &status) {
+    const char *headEnd = (const char *) memmem(data, length, "\r\n\r\n", 4);
+    if (headEnd == nullptr) {
+        return 0;
+    }
+    if (headEnd - data < 12 || memcmp(data, "HTTP/1.1 ", 9)) {
+        return -1;
+    }
+    status = atoi(data + 9);
+    size_t contentLength = 0;
+    for (const char *line = data; line < headEnd; ) {
+        line = (const char *) memmem(line, headEnd + 2 - line, "\r\n", 2) + 2; // Always found, at headEnd at the latest.
+        if (headEnd - line >= 15 && !strncasecmp(line, "Content-Length:", 15)) {
+            contentLength = strtoul(line + 15, nullptr, 10);
+        }
+    }
+    size_t total = headEnd + 4 - data + contentLength;
+    return length >= total ? (long) total : 0;
+}
+
+// Picks the next operation and key, and queues the request on a connection.
+static void sendNext(ClientConn &conn, const LoadOptions &options, const KeyChooser &keys, Random &rand, uint64_t start) {
+    int pick = rand.nextBelow(100);
+    ClientOp op = CLIENT_DELETE;
+    if (pick < options.mix[CLIENT_GET]) {
+        op = CLIENT_GET;
+    } else if (pick < options.mix[CLIENT_GET] + options.mix[CLIENT_POST]) {
+        op = CLIENT_POST;
+    }
+    size_t valueSize = options.minValue + (options.maxValue > options.minValue ?
+                                           rand.nextBelow(options.maxValue - options.minValue + 1) : 0);
+    appendRequest(conn.out, op, keys.next(rand), valueSize);
+    conn.inFlight.push_back(InFlight{start, op});
+}
+
+// Sends as much of the output of a connection as the socket accepts. Returns -1 on error.
+static int flushOutput(ClientConn &conn) {
+    while (conn.outSent < conn.out.size()) {
+        ssize_t n = send(conn.fd, conn.out.data() + conn.outSent, conn.out.size() - conn.outSent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        conn.outSent += n;
+    }
+    conn.out.clear();
+    conn.outSent = 0;
+    return 0;
+}
+
+// Drops a failed connection and opens a new one. Requests in flight on it are lost and counted as errors.
+static void resetConnection(ClientConn &conn, ClientThread *self) {
+    if (conn.fd >= 0) {
+        close(conn.fd);
+    }
+    self->result.errors += conn.inFlight.size();
+    conn.inFlight.clear();
+    conn.in.clear();
+    conn.out.clear();
+    conn.outSent = 0;
+    conn.fd = openConnection(*self->options);
+    if (conn.fd < 0) {
+        ++self->result.errors;
+        usleep(1000);
+    } else {
+        ++self->result.connects;
+    }
+}
+
+// Reads and handles the available responses of a connection. Returns -1 if the connection failed.
+static int readResponses(ClientConn &conn, ClientThread *self, uint64_t now) {
+    char buffer[READ_LENGTH];
+    bool peerClosed = false;
+    while (true) {
+        ssize_t n = read(conn.fd, buffer, sizeof(buffer));
+        if (n > 0) {
+            conn.in.append(buffer, n);
+            continue;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            return -1;
+        }
+        peerClosed = n == 0;
+        break;
+    }
+    size_t consumed = 0;
+    while (!conn.inFlight.empty()) {
+        int status = 0;
+        long length = parseResponse(conn.in.data() + consumed, conn.in.size() - consumed, status);
+        if (length < 0) {
+            return -1;
+        } else if (length == 0) {
+            break;
+        }
+        consumed += length;
+        InFlight request = conn.inFlight.front();
+        conn.inFlight.pop_front();
+        if (request.start >= self->measureStart && request.start < self->measureEnd) {
+            if (status == 200) {
+                ++self->result.ok;
+            } else if (status == 404) {
+                ++self->result.notFound;
+            } else {
+                ++self->result.errors;
+            }
+            self->result.latency[request.op].record(now - request.start);
+        }
+    }
+    conn.in.erase(0, consumed);
+    return peerClosed ? -1 : 0;
+}
+
+// The routine of a client thread.
+static void *clientRoutine(void *obj) {
+    ClientThread *self = (ClientThread *) obj;
+    const LoadOptions &options = *self->options;
+    Random rand(nowNanos() * (self->id + 1));
+    std::vector<ClientConn> conns(self->nConns);
+    std::vector<struct pollfd> fds(self->nConns);
+    // In open-loop mode every connection has an equal share of the rate, and connections are staggered.
+    uint64_t interval = options.rate > 0 ? (uint64_t) (1e9 * options.nConns / options.rate) : 0;
+    uint64_t begin = nowNanos();
+    for (int i = 0; i < self->nConns; ++i) {
+        resetConnection(conns[i], self);
+        conns[i].nextDue = begin + (interval ? rand.nextBelow(interval) : 0);
+    }
+    while (true) {
+        uint64_t now = nowNanos();
+        if (now >= self->measureEnd) {
+            break;
+        }
+        uint64_t wakeUp = now + 100000000UL; // Check the end of the run at least every 100ms.
+        for (int i = 0; i < self->nConns; ++i) {
+            ClientConn &conn = conns[i];
+            if (conn.fd < 0) {
+                resetConnection(conn, self);
+                fds[i].fd = -1;
+                continue;
+            }
+            int depth = options.keepAlive ? options.pipeline : 1;
+            if (interval) {
+                while ((int) conn.inFlight.size() < depth && conn.nextDue <= now) {
+                    sendNext(conn, options, *self->keys, rand, conn.nextDue);
+                    conn.nextDue += interval;
+                }
+                if ((int) conn.inFlight.size() < depth && conn.nextDue < wakeUp) {
+                    wakeUp = conn.nextDue;
+                }
+            } else {
+                while ((int) conn.inFlight.size() < depth) {
+                    sendNext(conn, options, *self->keys, rand, now);
+                }
+            }
+            if (flushOutput(conn)) {
+                resetConnection(conn, self);
+            }
+            fds[i].fd = conn.fd;
+            fds[i].events = POLLIN | (conn.out.empty() ? 0 : POLLOUT);
+            fds[i].revents = 0;
+        }
+        struct timespec timeout;
+        uint64_t wait = wakeUp > now ? wakeUp - now : 0;
+        timeout.tv_sec = wait / 1000000000UL;
+        timeout.tv_nsec = wait % 1000000000UL;
+        int n = ppoll(fds.data(), fds.size(), &timeout, nullptr);
+        if (n <= 0) {
+            continue;
+        }
+        now = nowNanos();
+        for (int i = 0; i < self->nConns; ++i) {
+            ClientConn &conn = conns[i];
+            if (fds[i].fd < 0 || !fds[i].revents) {
+                continue;
+            }
+            if ((fds[i].revents & POLLOUT) && flushOutput(conn)) {
+                resetConnection(conn, self);
+                continue;
+            }
+            if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                if (readResponses(conn, self, now)) {
+                    resetConnection(conn, self);
+                } else if (!options.keepAlive && conn.inFlight.empty()) {
+                    close(conn.fd); // One request per connection.
+                    conn.fd = openConnection(options);
+                    if (conn.fd < 0) {
+                        ++self->result.errors;
+                    } else {
+                        ++self->result.connects;
+                    }
+                }
+            }
+        }
+    }
+    for (ClientConn &conn : conns) {
+        if (conn.fd >= 0) {
+            close(conn.fd);
+        }
+    }
+    return nullptr;
+}
+
+// Posts every key once, so that GET requests find their keys. Returns 0 on success.
+static int preloadKeys(const LoadOptions &options) {
+    ClientThread self;
+    self.options = &options;
+    self.measureStart = self.measureEnd = 0;
+    ClientConn conn;
+    conn.fd = openConnection(options);
+    if (conn.fd < 0) {
+        return -1;
+    }
+    Random rand(1);
+    unsigned long next = 0, done = 0;
+    struct pollfd pfd;
+    while (done < options.nKeys) {
+        while (next < options.nKeys && conn.inFlight.size() < PRELOAD_PIPELINE) {
+            size_t valueSize = options.minValue + (options.maxValue > options.minValue ?
+                                                   rand.nextBelow(options.maxValue - options.minValue + 1) : 0);
+            appendRequest(conn.out, CLIENT_POST, next++, valueSize);
+            conn.inFlight.push_back(InFlight{0, CLIENT_POST});
+        }
+        if (flushOutput(conn)) {
+            close(conn.fd);
+            return -1;
+        }
+        pfd.fd = conn.fd;
+        pfd.events = POLLIN | (conn.out.empty() ? 0 : POLLOUT);
+        if (poll(&pfd, 1, 1000) <= 0) {
+            continue;
+        }
+        size_t before = conn.inFlight.size();
+        if ((pfd.revents & (POLLIN | POLLHUP | POLLERR)) && readResponses(conn, &self, 0)) {
+            close(conn.fd);
+            return -1;
+        }
+        done += before - conn.inFlight.size();
+    }
+    close(conn.fd);
+    return 0;
+}
+
+// Parses the arguments for the program.
+int argParser(int argc, char **argv, LoadOptions &options) {
+    int c;
+    const char *mix = DEFAULT_MIX;
+    const char *valueSize = DEFAULT_VALUE_SIZE;
+    const char *keyDist = DEFAULT_KEY_DIST;
+    options.host = DEFAULT_HOST;
+    options.portno = DEFAULT_PORT_NO;
+    options.nThreads = DEFAULT_NUM_THREADS;
+    options.nConns = DEFAULT_NUM_CONNS;
+    options.duration = DEFAULT_DURATION;
+    options.warmup = DEFAULT_WARMUP;
+    options.keepAlive = true;
+    options.pipeline = DEFAULT_PIPELINE;
+    options.nKeys = DEFAULT_NUM_KEYS;
+    options.rate = 0;
+    options.preload = false;
+    opterr = 0;
+    while ((c = getopt (argc, argv, "h:p:t:c:d:W:kP:m:v:K:D:r:Lj:")) != -1)
+        switch (c) {
+          case 'h':
+            options.host = optarg;
+            break;
+          case 'p':
+            options.portno = atoi(optarg);
+            break;
+          case 't':
+            options.nThreads = atoi(optarg);
+            break;
+          case 'c':
+            options.nConns = atoi(optarg);
+            break;
+          case 'd':
+            options.duration = atoi(optarg);
+            break;
+          case 'W':
+            options.warmup = atoi(optarg);
+            break;
+          case 'k':
+            options.keepAlive = false;
+            break;
+          case 'P':
+            options.pipeline = atoi(optarg);
+            break;
+          case 'm':
+            mix = optarg;
+            break;
+          case 'v':
+            valueSize = optarg;
+            break;
+          case 'K':
+            options.nKeys = strtoul(optarg, nullptr, 10);
+            break;
+          case 'D':
+            keyDist = optarg;
+            break;
+          case 'r':
+            options.rate = atof(optarg);
+            break;
+          case 'L':
+            options.preload = true;
+            break;
+          case 'j':
+            options.jsonPath = optarg;
+            break;
+          case '?':
+            if (isprint (optopt))
+                fprintf(stderr, "Unknown option or missing argument `-%c'.\n", optopt);
+            else
+                fprintf(stderr, "Unknown option character `\\x%x'.\n", optopt);
+            return 1;
+          default:
+            abort();
+        }
+    if (sscanf(mix, "%d:%d:%d", &options.mix[CLIENT_GET], &options.mix[CLIENT_POST], &options.mix[CLIENT_DELETE]) != 3 ||
+        options.mix[CLIENT_GET] + options.mix[CLIENT_POST] + options.mix[CLIENT_DELETE] != 100) {
+        fprintf(stderr, "The mix must be three percentages of GET:POST:DELETE adding up to 100.\n");
+        return 1;
+    }
+    if (sscanf(valueSize, "%lu-%lu", &options.minValue, &options.maxValue) == 1) {
+        options.maxValue = options.minValue;
+    } else if (options.maxValue < options.minValue) {
+        fprintf(stderr, "The value size must be a size or a min-max range.\n");
+        return 1;
+    }
+    options.zipfTheta = DEFAULT_ZIPF_THETA;
+    options.hotFraction = DEFAULT_HOT_FRACTION;
+    options.hotProb = DEFAULT_HOT_PROB;
+    if (!strncmp(keyDist, "uniform", 7)) {
+        options.keyDist = KEYS_UNIFORM;
+    } else if (!strncmp(keyDist, "zipf", 4)) {
+        options.keyDist = KEYS_ZIPF;
+        sscanf(keyDist, "zipf:%lf", &options.zipfTheta);
+    } else if (!strncmp(keyDist, "hot", 3)) {
+        options.keyDist = KEYS_HOTSET;
+        sscanf(keyDist, "hot:%lf:%lf", &options.hotFraction, &options.hotProb);
+    } else {
+        fprintf(stderr, "Unknown key distribution `%s'. Use uniform, zipf[:theta] or hot[:fraction:probability].\n", keyDist);
+        return 1;
+    }
+    if (options.nThreads < 1 || options.nConns < options.nThreads || options.duration < 1 || options.warmup < 0 ||
+        options.pipeline < 1 || options.nKeys < 2 || options.zipfTheta <= 0 || options.zipfTheta >= 1 ||
+        options.hotFraction <= 0 || options.hotFraction > 1 || options.hotProb < 0 || options.hotProb > 1) {
+        fprintf(stderr, "Invalid option value.\n");
+        return 1;
+    }
+    memset((char *) &options.servAddr, 0, sizeof(options.servAddr));
+    options.servAddr.sin_family = AF_INET;
+    options.servAddr.sin_port = htons(options.portno);
+    if (inet_pton(AF_INET, options.host.c_str(), &options.servAddr.sin_addr) != 1) {
+        fprintf(stderr, "Invalid host address `%s'.\n", options.host.c_str());
+        return 1;
+    }
+    return 0;
+}
+
+// Writes the latency statistics of a histogram as a JSON object, in microseconds.
+static void latencyJson(FILE *f, const LatencyHistogram &h) {
+    fprintf(f, "{\"count\": %lu, \"mean_us\": %.3f, \"p50_us\": %.3f, \"p90_us\": %.3f, \"p99_us\": %.3f, "
+               "\"p99.9_us\": %.3f, \"p99.99_us\": %.3f, \"max_us\": %.3f}",
+            (unsigned long) h.count(), h.mean() / 1e3, h.percentile(50) / 1e3, h.percentile(90) / 1e3,
+            h.percentile(99) / 1e3, h.percentile(99.9) / 1e3, h.percentile(99.99) / 1e3, h.max() / 1e3);
+}
+
+// Writes the options and results of the run as JSON.
+static void writeJson(FILE *f, const LoadOptions &options, const char *keyDist, const ThreadResult &total,
+                      const LatencyHistogram &all) {
+    fprintf(f, "{\n  \"config\": {\"host\": \"%s\", \"port\": %u, \"threads\": %d, \"connections\": %d, "
+               "\"duration_s\": %d, \"warmup_s\": %d, \"keep_alive\": %s, \"pipeline\": %d, "
+               "\"mix\": {\"get\": %d, \"post\": %d, \"delete\": %d}, \"value_size\": {\"min\": %lu, \"max\": %lu}, "
+               "\"keys\": %lu, \"key_distribution\": \"%s\", \"mode\": \"%s\", \"rate\": %.1f},\n",
+            options.host.c_str(), options.portno, options.nThreads, options.nConns, options.duration, options.warmup,
+            options.keepAlive ? "true" : "false", options.pipeline, options.mix[CLIENT_GET], options.mix[CLIENT_POST],
+            options.mix[CLIENT_DELETE], options.minValue, options.maxValue, options.nKeys, keyDist,
+            options.rate > 0 ? "open" : "closed", options.rate);
+    fprintf(f, "  \"requests\": %lu,\n  \"throughput_rps\": %.1f,\n  \"ok\": %lu,\n  \"not_found\": %lu,\n"
+               "  \"errors\": %lu,\n  \"connects\": %lu,\n  \"corrected_for_coordinated_omission\": %s,\n",
+            (unsigned long) all.count(), all.count() / (double) options.duration, total.ok, total.notFound,
+            total.errors, total.connects, options.rate > 0 ? "true" : "false");
+    fprintf(f, "  \"latency\": {\n    \"all\": ");
+    latencyJson(f, all);
+    for (int op = 0; op < NUM_CLIENT_OPS; ++op) {
+        fprintf(f, ",\n    \"%s\": ", clientOpNames[op]);
+        latencyJson(f, total.latency[op]);
+    }
+    fprintf(f, "\n  }\n}\n");
+}
+
+} // namespace multicore
+
+// Program entry.
+int main(int argc, char **argv) {
+    multicore::LoadOptions options;
+    if (multicore::argParser(argc, argv, options)) {
+        fprintf(stderr, "Usage: %s [-h host] [-p port] [-t threads] [-c connections] [-d seconds] [-W warmup seconds]\n"
+                        "       [-k (no keep-alive)] [-P pipeline depth] [-m get:post:delete] [-v size|min-max]\n"
+                        "       [-K keys] [-D uniform|zipf[:theta]|hot[:fraction:probability]] [-r requests/s (open-loop)]\n"
+                        "       [-L (preload keys)] [-j json file, - for stdout]\n", argv[0]);
+        exit(-1);
+    }
+    const char *keyDist = options.keyDist == multicore::KEYS_ZIPF ? "zipf" :
+                          options.keyDist == multicore::KEYS_HOTSET ? "hot" : "uniform";
+    multicore::valueBytes.assign(options.maxValue, 'v');
+    if (options.preload) {
+        printf("Preloading %lu keys...\n", options.nKeys);
+        if (multicore::preloadKeys(options)) {
+            fprintf(stderr, "Preloading keys failed. Terminating.\n");
+            exit(-1);
+        }
+    }
+    multicore::KeyChooser keys(options);
+    std::vector<multicore::ClientThread *> threads;
+    uint64_t start = multicore::nowNanos();
+    for (int i = 0; i < options.nThreads; ++i) {
+        multicore::ClientThread *t = new multicore::ClientThread;
+        t->id = i;
+        t->nConns = options.nConns / options.nThreads + (i < options.nConns % options.nThreads ? 1 : 0);
+        t->options = &options;
+        t->keys = &keys;
+        t->measureStart = start + options.warmup * 1000000000UL;
+        t->measureEnd = t->measureStart + options.duration * 1000000000UL;
+        if (pthread_create(&t->tid, nullptr, multicore::clientRoutine, (void *) t)) {
+            fprintf(stderr, "pthread_create failed. Terminating.\n");
+            exit(-1);
+        }
+        threads.push_back(t);
+    }
+    multicore::ThreadResult total;
+    multicore::LatencyHistogram all;
+    for (multicore::ClientThread *t : threads) {
+        pthread_join(t->tid, nullptr);
+        for (int op = 0; op < multicore::NUM_CLIENT_OPS; ++op) {
+            total.latency[op].merge(t->result.latency[op]);
+            all.merge(t->result.latency[op]);
+        }
+        total.ok += t->result.ok;
+        total.notFound += t->result.notFound;
+        total.errors += t->result.errors;
+        total.connects += t->result.connects;
+        delete t;
+    }
+    printf("%s-loop, %d threads, %d connections, pipeline %d, %s, keys %lu (%s), %d s\n",
+           options.rate > 0 ? "open" : "closed", options.nThreads, options.nConns, options.pipeline,
+           options.keepAlive ? "keep-alive" : "one request per connection", options.nKeys, keyDist, options.duration);
+    printf("requests = %lu, requests/s = %.1f, ok = %lu, not found = %lu, errors = %lu\n",
+           (unsigned long) all.count(), all.count() / (double) options.duration, total.ok, total.notFound, total.errors);
+    printf("%-8s %10s %10s %10s %10s %10s %10s %10s\n", "latency", "count", "mean(us)", "p50", "p90", "p99", "p99.9", "max");
+    for (int op = 0; op <= multicore::NUM_CLIENT_OPS; ++op) {
+        const multicore::LatencyHistogram &h = op < multicore::NUM_CLIENT_OPS ? total.latency[op] : all;
+        printf("%-8s %10lu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+               op < multicore::NUM_CLIENT_OPS ? multicore::clientOpNames[op] : "all", (unsigned long) h.count(),
+               h.mean() / 1e3, h.percentile(50) / 1e3, h.percentile(90) / 1e3, h.percentile(99) / 1e3,
+               h.percentile(99.9) / 1e3, h.max() / 1e3);
+    }
+    if (!options.jsonPath.empty()) {
+        FILE *f = options.jsonPath == "-" ? stdout : fopen(options.jsonPath.c_str(), "w");
+        if (f == nullptr) {
+            fprintf(stderr, "Opening `%s' failed.\n", options.jsonPath.c_str());
+            exit(-1);
+        }
+        multicore::writeJson(f, options, keyDist, total, all);
+        if (f != stdout) {
+            fclose(f);
+        }
+    }
+    return 0;
+}
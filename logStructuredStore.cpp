@@ -0,0 +1,416 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "logStructuredStore.hpp"
+#include "fileSystemIO.hpp"
+
+#define RECORD_HEADER_SIZE 16
+#define RECORD_PUT         0
+#define RECORD_TOMBSTONE   1
+
+namespace multicore {
+
+class Segment {
+  public:
+    Segment(uint32_t _id, const std::string &_path, int _fd)
+        : id(_id), path(_path), fd(_fd), size(0), deadBytes(0), obsolete(false) {}
+
+    // Closes the file, and deletes it if the segment has been compacted.
+    // Runs when the last reader holding the segment is done with it.
+    ~Segment() {
+        close(fd);
+        if (obsolete) {
+            unlink(path.c_str());
+        }
+    }
+
+    const uint32_t id;
+    const std::string path;
+    const int fd;
+    uint64_t size; // Bytes appended so far. Modified under append_lock.
+    uint64_t deadBytes; // Bytes of records that are overwritten, deleted, or tombstones. Modified under append_lock.
+    bool obsolete;
+};
+
+static inline uint32_t getU32(const char *buf) {
+    uint32_t val;
+    memcpy(&val, buf, sizeof(val));
+    return val;
+}
+
+static inline void putU32(char *buf, uint32_t val) {
+    memcpy(buf, &val, sizeof(val));
+}
+
+// Read exactly length bytes at offset. Returns 0 on success.
+static int preadAll(int fd, char *buf, size_t length, uint64_t offset) {
+    while (length) {
+        ssize_t n = pread(fd, buf, length, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        buf += n;
+        length -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+// Write exactly length bytes at offset. Returns 0 on success.
+static int pwriteAll(int fd, const char *buf, size_t length, uint64_t offset) {
+    while (length) {
+        ssize_t n = pwrite(fd, buf, length, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        buf += n;
+        length -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+LogStructuredStore::LogStructuredStore(const std::string &_dirPath, uint64_t _segmentSize)
+    : dirPath(_dirPath), segmentSize(_segmentSize), nextSegmentId(0) {
+    pthread_mutex_init(&append_lock, nullptr);
+    pthread_rwlock_init(&index_lock, nullptr);
+    load();
+}
+
+LogStructuredStore::~LogStructuredStore() {
+    active.reset();
+    segments.clear();
+    pthread_mutex_destroy(&append_lock);
+    pthread_rwlock_destroy(&index_lock);
+}
+
+// Load the segments already in the directory, and rebuild the index from their records.
+void LogStructuredStore::load() {
+    std::vector<std::string> names;
+    listFiles(dirPath, names);
+    std::vector<uint32_t> ids;
+    for (const std::string &name : names) {
+        unsigned int id;
+        int end = 0;
+        if (sscanf(name.c_str(), "%u.seg%n", &id, &end) == 1 && end == (int) name.size()) {
+            ids.push_back(id);
+        }
+    }
+    std::sort(ids.begin(), ids.end());
+    std::vector<char> buffer;
+    for (uint32_t id : ids) {
+        char name[32];
+        snprintf(name, sizeof(name), "/%08u.seg", id);
+        std::string path = dirPath + name;
+        int fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st)) {
+            fprintf(stderr, "Error on opening segment %s. Terminating.\n", path.c_str());
+            exit(-1);
+        }
+        std::shared_ptr<Segment> segment(new Segment(id, path, fd));
+        segments[id] = segment;
+        buffer.resize(st.st_size);
+        if (!buffer.empty() && preadAll(fd, &buffer[0], buffer.size(), 0)) {
+            fprintf(stderr, "Error on reading segment %s. Terminating.\n", path.c_str());
+            exit(-1);
+        }
+        bool last = id == ids.back();
+        uint64_t offset = 0;
+        while (offset + RECORD_HEADER_SIZE <= buffer.size()) {
+            const char *record = &buffer[offset];
+            uint32_t keyLength = getU32(record + 4);
+            uint32_t valueLength = getU32(record + 8);
+            uint64_t recordSize = RECORD_HEADER_SIZE + (uint64_t) keyLength + valueLength;
+            if (offset + recordSize > buffer.size() || (last && getU32(record) != crc32(record + 4, recordSize - 4))) {
+                break;
+            }
+            std::string key(record + RECORD_HEADER_SIZE, keyLength);
+            Location location = {id, offset + RECORD_HEADER_SIZE + keyLength, valueLength, (uint32_t) recordSize};
+            auto it = index.find(key);
+            if (it != index.end()) {
+                markDead(it->second);
+            }
+            if (record[12] == RECORD_PUT) {
+                if (it != index.end()) {
+                    it->second = location;
+                } else {
+                    index.emplace(std::move(key), location);
+                }
+            } else {
+                markDead(location);
+                if (it != index.end()) {
+                    index.erase(it);
+                }
+            }
+            offset += recordSize;
+        }
+        segment->size = offset;
+        if (offset < buffer.size()) {
+            if (last) { // cut short by a crash while it was the active segment
+                fprintf(stderr, "Truncating the incomplete record at the end of segment %s.\n", path.c_str());
+                if (ftruncate(fd, offset)) {
+                    fprintf(stderr, "Error on truncating segment %s. Terminating.\n", path.c_str());
+                    exit(-1);
+                }
+            } else {
+                fprintf(stderr, "Corrupted record in segment %s at offset %lu. Ignoring the rest of the segment.\n",
+                        path.c_str(), (unsigned long) offset);
+            }
+        }
+        if (last && fdatasync(fd)) { // it may hold writes that never were synced before the restart
+            fprintf(stderr, "Error on syncing segment %s. Terminating.\n", path.c_str());
+            exit(-1);
+        }
+    }
+    nextSegmentId = ids.empty() ? 0 : ids.back() + 1;
+}
+
+int LogStructuredStore::read(const std::string &key, std::string &value) {
+    pthread_rwlock_rdlock(&index_lock);
+    auto it = index.find(key);
+    if (it == index.end()) {
+        pthread_rwlock_unlock(&index_lock);
+        return -1;
+    }
+    Location location = it->second;
+    std::shared_ptr<Segment> segment = segments.find(location.segment)->second; // Keeps the file open even if it is compacted meanwhile.
+    pthread_rwlock_unlock(&index_lock);
+    value.resize(location.length);
+    if (location.length && preadAll(segment->fd, &value[0], location.length, location.offset)) {
+        fprintf(stderr, "Error on reading segment %s.\n", segment->path.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+int LogStructuredStore::locate(const std::string &key, DiskLocation &location) {
+    pthread_rwlock_rdlock(&index_lock);
+    auto it = index.find(key);
+    if (it == index.end()) {
+        pthread_rwlock_unlock(&index_lock);
+        return -1;
+    }
+    std::shared_ptr<Segment> segment = segments.find(it->second.segment)->second;
+    location.fd = segment->fd;
+    location.offset = it->second.offset;
+    location.length = it->second.length;
+    location.pin = segment;
+    pthread_rwlock_unlock(&index_lock);
+    return 0;
+}
+
+int LogStructuredStore::forEachKey(const std::function<void(const std::string &)> &callback) {
+    pthread_rwlock_rdlock(&index_lock);
+    for (const auto &ele : index) {
+        callback(ele.first);
+    }
+    pthread_rwlock_unlock(&index_lock);
+    return 0;
+}
+
+int LogStructuredStore::write(const std::string &key, const char *value, size_t length) {
+    Location location;
+    pthread_mutex_lock(&append_lock);
+    if (append(RECORD_PUT, key, value, length, location)) {
+        pthread_mutex_unlock(&append_lock);
+        return -1;
+    }
+    pthread_rwlock_wrlock(&index_lock);
+    auto it = index.find(key);
+    if (it != index.end()) {
+        markDead(it->second);
+        it->second = location;
+    } else {
+        index.emplace(key, location);
+    }
+    pthread_rwlock_unlock(&index_lock);
+    pthread_mutex_unlock(&append_lock);
+    return 0;
+}
+
+int LogStructuredStore::remove(const std::string &key) {
+    Location location;
+    pthread_mutex_lock(&append_lock);
+    auto it = index.find(key); // Only appends modify the index, so no need for index_lock here.
+    if (it == index.end()) {
+        pthread_mutex_unlock(&append_lock);
+        return 0;
+    }
+    if (append(RECORD_TOMBSTONE, key, nullptr, 0, location)) {
+        pthread_mutex_unlock(&append_lock);
+        return -1;
+    }
+    markDead(location); // A tombstone is dead space as soon as it is written.
+    pthread_rwlock_wrlock(&index_lock);
+    markDead(it->second);
+    index.erase(it);
+    pthread_rwlock_unlock(&index_lock);
+    pthread_mutex_unlock(&append_lock);
+    return 0;
+}
+
+// Append a record to the active segment, starting a new segment if it is full. Needs append_lock.
+int LogStructuredStore::append(uint8_t type, const std::string &key, const char *value, uint32_t valueLength, Location &location) {
+    uint32_t recordSize = RECORD_HEADER_SIZE + key.size() + valueLength;
+    if (!active || (active->size && active->size + recordSize > segmentSize)) {
+        if (active && fdatasync(active->fd)) { // sealed segments are always synced
+            fprintf(stderr, "Error on syncing segment %s.\n", active->path.c_str());
+            return -1;
+        }
+        char name[32];
+        snprintf(name, sizeof(name), "/%08u.seg", nextSegmentId);
+        std::string path = dirPath + name;
+        int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+        if (fd < 0) {
+            fprintf(stderr, "Error on creating segment %s.\n", path.c_str());
+            return -1;
+        }
+        std::shared_ptr<Segment> segment(new Segment(nextSegmentId++, path, fd));
+        pthread_rwlock_wrlock(&index_lock);
+        segments[segment->id] = segment;
+        pthread_rwlock_unlock(&index_lock);
+        active = segment;
+    }
+    std::vector<char> record(recordSize);
+    putU32(&record[4], key.size());
+    putU32(&record[8], valueLength);
+    record[12] = type;
+    memcpy(&record[RECORD_HEADER_SIZE], key.data(), key.size());
+    if (valueLength) {
+        memcpy(&record[RECORD_HEADER_SIZE + key.size()], value, valueLength);
+    }
+    putU32(&record[0], crc32(&record[4], recordSize - 4));
+    if (pwriteAll(active->fd, &record[0], recordSize, active->size)) {
+        fprintf(stderr, "Error on writing segment %s.\n", active->path.c_str());
+        return -1;
+    }
+    location.segment = active->id;
+    location.offset = active->size + RECORD_HEADER_SIZE + key.size();
+    location.length = valueLength;
+    location.recordSize = recordSize;
+    active->size += recordSize;
+    return 0;
+}
+
+int LogStructuredStore::sync() {
+    pthread_mutex_lock(&append_lock);
+    int ret = syncLocked();
+    pthread_mutex_unlock(&append_lock);
+    return ret;
+}
+
+// Sync the active segment, and the directory, so new segment files and deleted ones are durable too.
+// Needs append_lock.
+int LogStructuredStore::syncLocked() {
+    int ret = active && fdatasync(active->fd) ? -1 : 0;
+    int dirFd = open(dirPath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirFd < 0 || fsync(dirFd)) {
+        ret = -1;
+    }
+    if (dirFd >= 0) {
+        close(dirFd);
+    }
+    return ret;
+}
+
+// Account a record as dead space in its segment. Needs append_lock.
+void LogStructuredStore::markDead(const Location &location) {
+    auto it = segments.find(location.segment);
+    if (it != segments.end()) {
+        it->second->deadBytes += location.recordSize;
+    }
+}
+
+int LogStructuredStore::compact() {
+    std::shared_ptr<Segment> victim;
+    double worst = DEFAULT_COMPACTION_THRESHOLD;
+    pthread_mutex_lock(&append_lock);
+    for (auto &ele : segments) {
+        std::shared_ptr<Segment> &segment = ele.second;
+        if (segment == active || !segment->size) {
+            continue;
+        }
+        double deadRatio = (double) segment->deadBytes / segment->size;
+        if (deadRatio >= worst) {
+            worst = deadRatio;
+            victim = segment;
+        }
+    }
+    pthread_mutex_unlock(&append_lock);
+    return victim ? compactSegment(victim) : 0;
+}
+
+// Move the live records of a sealed segment to the active segment, and then drop the segment.
+int LogStructuredStore::compactSegment(std::shared_ptr<Segment> segment) {
+    std::vector<char> buffer(segment->size); // A sealed segment does not change any more.
+    if (!buffer.empty() && preadAll(segment->fd, &buffer[0], buffer.size(), 0)) {
+        fprintf(stderr, "Error on reading segment %s for compaction.\n", segment->path.c_str());
+        return -1;
+    }
+    uint64_t offset = 0;
+    while (offset + RECORD_HEADER_SIZE <= buffer.size()) {
+        const char *record = &buffer[offset];
+        uint32_t keyLength = getU32(record + 4);
+        uint32_t valueLength = getU32(record + 8);
+        uint8_t type = record[12];
+        uint64_t recordSize = RECORD_HEADER_SIZE + (uint64_t) keyLength + valueLength;
+        if (offset + recordSize > buffer.size() || getU32(record) != crc32(record + 4, recordSize - 4)) {
+            fprintf(stderr, "Corrupted record in segment %s at offset %lu. Stopping compaction.\n",
+                    segment->path.c_str(), (unsigned long) offset);
+            return -1;
+        }
+        std::string key(record + RECORD_HEADER_SIZE, keyLength);
+        const char *value = record + RECORD_HEADER_SIZE + keyLength;
+        Location location;
+        pthread_mutex_lock(&append_lock);
+        auto it = index.find(key);
+        if (type == RECORD_PUT && it != index.end() && it->second.segment == segment->id &&
+            it->second.offset == offset + RECORD_HEADER_SIZE + keyLength) { // still the live value of the key
+            if (append(RECORD_PUT, key, value, valueLength, location)) {
+                pthread_mutex_unlock(&append_lock);
+                return -1;
+            }
+            pthread_rwlock_wrlock(&index_lock);
+            it->second = location;
+            pthread_rwlock_unlock(&index_lock);
+        } else if (type == RECORD_TOMBSTONE && it == index.end() && segments.begin()->first < segment->id) {
+            // An older segment may still hold a value the tombstone is shadowing, so keep the tombstone.
+            if (append(RECORD_TOMBSTONE, key, nullptr, 0, location)) {
+                pthread_mutex_unlock(&append_lock);
+                return -1;
+            }
+            markDead(location);
+        }
+        pthread_mutex_unlock(&append_lock);
+        offset += recordSize;
+    }
+    pthread_mutex_lock(&append_lock);
+    if (syncLocked()) { // the moved records must be durable before the segment is gone
+        pthread_mutex_unlock(&append_lock);
+        fprintf(stderr, "Error on syncing the segments for compaction of %s.\n", segment->path.c_str());
+        return -1;
+    }
+    pthread_rwlock_wrlock(&index_lock);
+    segments.erase(segment->id);
+    segment->obsolete = true; // The file is deleted once the last reader is done with it.
+    pthread_rwlock_unlock(&index_lock);
+    pthread_mutex_unlock(&append_lock);
+    return 0;
+}
+
+} // namespace multicore
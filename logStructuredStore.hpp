@@ -0,0 +1,102 @@
+#pragma once
+
+#include <pthread.h>
+#include <cstdint>
+#include <string>
+#include <map>
+#include <memory>
+#include <unordered_map>
+
+#include "diskStore.hpp"
+
+#define DEFAULT_SEGMENT_SIZE          (16UL << 20) // A new segment file is started once the active one reaches this size.
+#define DEFAULT_COMPACTION_THRESHOLD  0.5          // A sealed segment is compacted once this fraction of it is dead.
+
+namespace multicore {
+
+// A segment file of the log. Defined in logStructuredStore.cpp.
+class Segment;
+
+/**
+ * @section DESCRIPTION
+ *
+ * Log-structured disk storage engine.
+ *
+ * All key-value pairs are appended to segment files in a directory, and an in memory index maps
+ * every key to the segment, offset and length of its latest value. Writing a key is a sequential
+ * append, reading a key is a single pread, and deleting a key appends a tombstone record.
+ * Overwritten values and tombstones are dead space, which is reclaimed by compact(): live records of
+ * a mostly dead segment are appended again to the active segment, and then the old segment is deleted.
+ *
+ * The segments already in the directory are loaded when the engine is made: the index is rebuilt by
+ * going through their records in the order they were appended. A segment is synced when it is sealed,
+ * so only the last one can have been cut short by a crash, and it is the only one whose checksums are
+ * verified; it is truncated after its last complete record.
+ *
+ * Record format: [crc32 (4 bytes)][key length (4 bytes)][value length (4 bytes)][type (1 byte)][padding (3 bytes)][key][value]
+ * The crc32 covers everything in the record after itself.
+ */
+class LogStructuredStore : public DiskStore {
+  public:
+    /**
+     * Constructor.
+     *
+     * @param _dirPath path to the directory of the segment files. Must already exist.
+     * @param _segmentSize size at which the active segment is sealed and a new one is started.
+     */
+    LogStructuredStore(const std::string &_dirPath, uint64_t _segmentSize = DEFAULT_SEGMENT_SIZE);
+
+    /**
+     * Destructor. Closes all segment files.
+     */
+    ~LogStructuredStore();
+
+    int read(const std::string &key, std::string &value);
+
+    /**
+     * Find where the value of a key is. The location holds its segment, so the value stays readable even if
+     * the segment is compacted meanwhile.
+     */
+    int locate(const std::string &key, DiskLocation &location);
+
+    int write(const std::string &key, const char *value, size_t length);
+    int remove(const std::string &key);
+
+    /**
+     * Compact the sealed segment with the most dead space, if at least DEFAULT_COMPACTION_THRESHOLD of it is dead.
+     */
+    int compact();
+
+    /**
+     * Sync the active segment, the only one that is not synced yet, and the directory.
+     */
+    int sync();
+
+    int forEachKey(const std::function<void(const std::string &)> &callback);
+
+  private:
+    // Where the latest value of a key is.
+    struct Location {
+        uint32_t segment; // Id of the segment.
+        uint64_t offset; // Offset of the value in the segment.
+        uint32_t length; // Length of the value.
+        uint32_t recordSize; // Size of the whole record.
+    };
+
+    void load();
+    int syncLocked();
+    int append(uint8_t type, const std::string &key, const char *value, uint32_t valueLength, Location &location);
+    void markDead(const Location &location);
+    int compactSegment(std::shared_ptr<Segment> segment);
+
+    const std::string dirPath;
+    const uint64_t segmentSize;
+    std::unordered_map<std::string, Location> index;
+    std::map<uint32_t, std::shared_ptr<Segment> > segments; // All segments that are not yet compacted, by id.
+    std::shared_ptr<Segment> active; // The segment being appended to.
+    uint32_t nextSegmentId;
+    pthread_mutex_t append_lock; // Serializes appends, and with them every modification of the index.
+    pthread_rwlock_t index_lock; // Protects index and segments, so readers don't wait for appends.
+};
+
+} // namespace multicore
@@ -1,20 +1,32 @@
 #include <cstdlib>
 #include <cctype>
 #include <cstdio>
+#include <cstring>
 #include <unistd.h>
-#include <algorithm>
-#include <numeric>
 
 #include "threadSafeKVStore.hpp"
 #include "threadPoolServer.hpp"
+#include "latencyHistogram.hpp"
 
 #define STRINGIFY_DIRECT(X)  #X
 #define STRINGIFY(X)         STRINGIFY_DIRECT(X)
 
 #define DEFAULT_NUM_THREADS  1                   // Default number of threads if no argument is given.
+#define DEFAULT_NUM_ACCEPTORS        1                   // Default number of acceptor threads (listening sockets).
+#define DEFAULT_BACKLOG              1024                // Default backlog of each listening socket.
 #define DEFAULT_PORT_NO              10801               // Port Number used by the program.
-#define DEFAULT_STORAGE_PATH         "./storage"         // path of disk storage. THIS DIRECTORY WILL BE WIPED CLEAN IF ALREADY EXISTS.
-#define DEFAULT_CACHE_SIZE           128                 // Size of in memory cache. Change this value to 0 to disable memory cache.
+#define DEFAULT_STORAGE_PATH         "./storage"         // path of disk storage. THIS DIRECTORY WILL BE WIPED CLEAN IF ALREADY EXISTS, unless -d is given.
+#define DEFAULT_CACHE_BYTES          (64UL << 20)        // Size of in memory cache in bytes. Use -c 0 to disable memory cache.
+#define DEFAULT_NUM_SHARDS           16                  // Default number of independent shards of the storage.
+#define DEFAULT_DISK_ENGINE          FILE_PER_KEY        // Default disk storage engine.
+#define DEFAULT_NUM_FLUSHERS         1                   // Default number of threads writing evicted entries to disk.
+#define DEFAULT_DIRTY_LIMIT          1024                // Max number of writes per shard waiting for the flushers.
+#define DEFAULT_FILTER_MAX_BYTES     0                   // Max total size of the Bloom filters of the keys on disk, 0 for no max.
+#define DEFAULT_WAL_POLICY           WAL_OFF             // Default durability: no write-ahead log, and the storage starts empty.
+#define DEFAULT_WAL_SYNC_MILLIS      1000                // Milliseconds between two syncs of the write-ahead logs by the background thread.
+#define DEFAULT_CHECKPOINT_INTERVAL  60                  // Default max seconds between two checkpoints of a shard.
+#define DEFAULT_MAX_QUEUE_WAIT       0                   // Max milliseconds a task waits in a run queue before it is shed, 0 for no max.
+#define DEFAULT_MAX_QUEUED_TASKS     0                   // Number of queued tasks from which new connections are refused, 0 for no max.
 
 namespace multicore {
 
@@ -22,20 +34,110 @@ std::atomic_ulong stat_num_lookup;
 std::atomic_ulong stat_num_insert;
 std::atomic_ulong stat_num_delete;
 std::atomic_bool isRunning;
-std::vector<float> requestTimes;
+LatencyRecorder latencies;
+ThreadSafeKVStore *store = nullptr;
+ThreadPoolServer *server = nullptr;
+
+// Options of the program.
+struct Options {
+    int nThreads;
+    int nAcceptors;
+    int backlog;
+    int nShards;
+    size_t cacheBytes;
+    DiskEngine engine;
+    int nFlushers;
+    double filterFpr;
+    size_t filterMaxBytes;
+    WalSyncPolicy walPolicy;
+    unsigned int walSyncMillis;
+    unsigned int checkpointInterval;
+    bool asyncDisk;
+    unsigned int maxQueueWait;
+    unsigned long maxQueuedTasks;
+};
+
+// Parses a size in bytes, optionally followed by a K, M or G suffix.
+size_t parseBytes(const char *str) {
+    char *end;
+    size_t value = strtoull(str, &end, 10);
+    switch (toupper(*end)) {
+      case 'G':
+        value <<= 10; // fall through
+      case 'M':
+        value <<= 10; // fall through
+      case 'K':
+        value <<= 10;
+    }
+    return value;
+}
 
 // Parses the arguments for the program.
-int argParser(int argc, char **argv) {
+int argParser(int argc, char **argv, Options &options) {
     char *nvalue = NULL;
+    char *avalue = NULL;
+    char *bvalue = NULL;
+    char *svalue = NULL;
+    char *cvalue = NULL;
+    char *evalue = NULL;
+    char *wvalue = NULL;
+    char *fvalue = NULL;
+    char *Fvalue = NULL;
+    char *dvalue = NULL;
+    char *ivalue = NULL;
+    char *tvalue = NULL;
+    char *Qvalue = NULL;
+    bool uflag = false;
     int c;
     opterr = 0;
-    while ((c = getopt (argc, argv, "n:")) != -1)
+    while ((c = getopt (argc, argv, "n:a:b:s:c:e:w:f:F:d:i:ut:Q:")) != -1)
 		switch (c) {
           case 'n':
             nvalue = optarg;
             break;
+          case 'a':
+            avalue = optarg;
+            break;
+          case 'b':
+            bvalue = optarg;
+            break;
+          case 's':
+            svalue = optarg;
+            break;
+          case 'c':
+            cvalue = optarg;
+            break;
+          case 'e':
+            evalue = optarg;
+            break;
+          case 'w':
+            wvalue = optarg;
+            break;
+          case 'f':
+            fvalue = optarg;
+            break;
+          case 'F':
+            Fvalue = optarg;
+            break;
+          case 'd':
+            dvalue = optarg;
+            break;
+          case 'i':
+            ivalue = optarg;
+            break;
+          case 'u':
+            uflag = true;
+            break;
+          case 't':
+            tvalue = optarg;
+            break;
+          case 'Q':
+            Qvalue = optarg;
+            break;
           case '?':
-            if (optopt == 'n')
+            if (optopt == 'n' || optopt == 'a' || optopt == 'b' || optopt == 's' || optopt == 'c' || optopt == 'e' || optopt == 'w' ||
+                optopt == 'f' || optopt == 'F' || optopt == 'd' || optopt == 'i' ||
+                optopt == 't' || optopt == 'Q')
                 fprintf(stderr, "Option -%c requires an argument.\n", optopt);
             else if (isprint (optopt))
                 fprintf(stderr, "Unknown option `-%c'.\n", optopt);
@@ -49,10 +151,50 @@ int argParser(int argc, char **argv) {
 		}
     if (nvalue == NULL) {
         printf("Option -n not specified, using default value " STRINGIFY(DEFAULT_NUM_THREADS) ".\n");
-        return DEFAULT_NUM_THREADS;
+        options.nThreads = DEFAULT_NUM_THREADS;
+    } else {
+        options.nThreads = atoi(nvalue);
+    }
+    options.nAcceptors = avalue == NULL ? DEFAULT_NUM_ACCEPTORS : atoi(avalue);
+    options.backlog = bvalue == NULL ? DEFAULT_BACKLOG : atoi(bvalue);
+    options.nShards = svalue == NULL ? DEFAULT_NUM_SHARDS : atoi(svalue);
+    options.cacheBytes = cvalue == NULL ? DEFAULT_CACHE_BYTES : parseBytes(cvalue);
+    options.nFlushers = wvalue == NULL ? DEFAULT_NUM_FLUSHERS : atoi(wvalue);
+    options.filterFpr = fvalue == NULL ? DEFAULT_FILTER_FPR : atof(fvalue);
+    options.filterMaxBytes = Fvalue == NULL ? DEFAULT_FILTER_MAX_BYTES : parseBytes(Fvalue);
+    if (options.filterFpr < 0 || options.filterFpr >= 1) {
+        fprintf(stderr, "The false positive rate of the Bloom filters must be at least 0 and less than 1.\n");
+        return 1;
+    }
+    options.checkpointInterval = ivalue == NULL ? DEFAULT_CHECKPOINT_INTERVAL : atoi(ivalue);
+    options.asyncDisk = !uflag;
+    options.maxQueueWait = tvalue == NULL ? DEFAULT_MAX_QUEUE_WAIT : atoi(tvalue);
+    options.maxQueuedTasks = Qvalue == NULL ? DEFAULT_MAX_QUEUED_TASKS : strtoul(Qvalue, NULL, 10);
+    options.walSyncMillis = DEFAULT_WAL_SYNC_MILLIS;
+    if (dvalue == NULL) {
+        options.walPolicy = DEFAULT_WAL_POLICY;
+    } else if (!strcmp(dvalue, "always")) {
+        options.walPolicy = WAL_SYNC_ALWAYS;
+    } else if (!strcmp(dvalue, "none")) {
+        options.walPolicy = WAL_SYNC_NONE;
+    } else if (atoi(dvalue) > 0) {
+        options.walPolicy = WAL_SYNC_INTERVAL;
+        options.walSyncMillis = atoi(dvalue);
+    } else {
+        fprintf(stderr, "Unknown sync policy `%s'. Use `always', `none' or a number of milliseconds.\n", dvalue);
+        return 1;
+    }
+    if (evalue == NULL) {
+        options.engine = DEFAULT_DISK_ENGINE;
+    } else if (!strcmp(evalue, "file")) {
+        options.engine = FILE_PER_KEY;
+    } else if (!strcmp(evalue, "log")) {
+        options.engine = LOG_STRUCTURED;
     } else {
-        return atoi(nvalue);
+        fprintf(stderr, "Unknown disk engine `%s'. Use `file' or `log'.\n", evalue);
+        return 1;
     }
+    return 0;
 }
 
 void printStats() {
@@ -61,54 +203,97 @@ void printStats() {
             stat_num_insert.load(),
             stat_num_delete.load(),
             stat_num_lookup.load());
-    std::sort(requestTimes.begin(), requestTimes.end());
-    float min = requestTimes.empty() ? 0 : *requestTimes.begin();
-    float max = requestTimes.empty() ? 0 : *(requestTimes.end() - 1);
-    float mean = requestTimes.empty() ? 0 : std::accumulate(requestTimes.begin(), requestTimes.end(), 0.0) / requestTimes.size();
-    float median = requestTimes.empty() ? 0 : (requestTimes.size() % 2 ?
-                                               requestTimes[requestTimes.size() / 2] :
-                                               (requestTimes[requestTimes.size() / 2 - 1] +
-                                                requestTimes[requestTimes.size() / 2]) / 2.0);
-    printf("Request time (ms): min = %f, avg = %f, max = %f, median = %f\n",
-            min, mean, max, median);
+    printf("%20s %10s %10s %10s %10s %10s %10s %10s\n",
+            "Request latency (ms)", "count", "mean", "p50", "p90", "p99", "p99.9", "max");
+    LatencyHistogram all;
+    for (int op = 0; op <= NUM_LATENCY_OPS; ++op) {
+        LatencyHistogram merged;
+        if (op < NUM_LATENCY_OPS) {
+            latencies.collect((LatencyOp) op, merged);
+            all.merge(merged);
+        }
+        const LatencyHistogram &h = op < NUM_LATENCY_OPS ? merged : all;
+        printf("%20s %10lu %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f\n",
+                op < NUM_LATENCY_OPS ? latencyOpName((LatencyOp) op) : "all", h.count(), h.mean() / 1e6,
+                h.percentile(50) / 1e6, h.percentile(90) / 1e6, h.percentile(99) / 1e6,
+                h.percentile(99.9) / 1e6, h.max() / 1e6);
+    }
+    if (store != nullptr) {
+        KVStoreStats storeStats;
+        store->getStats(storeStats);
+        printf("Cache: entries = %lu, resident bytes = %lu (index = %lu), budget bytes = %lu, writes pending for disk = %lu\n",
+                storeStats.cacheEntries, storeStats.residentBytes, storeStats.indexBytes, storeStats.cacheBytes,
+                storeStats.pendingWrites);
+        printf("Bloom filters: bytes = %lu, negatives = %lu, false positives = %lu, rebuilds = %lu\n",
+                storeStats.filterBytes, storeStats.filterNegatives, storeStats.filterFalsePositives, storeStats.filterRebuilds);
+        printf("Write-ahead logs: records = %lu, writes = %lu, syncs = %lu, bytes = %lu, checkpoints = %lu\n",
+                storeStats.logRecords, storeStats.logWrites, storeStats.logSyncs, storeStats.logBytes, storeStats.checkpoints);
+        printf("Warm-up: keys = %lu, %s\n", storeStats.warmedKeys, store->ready() ? "done" : "in progress");
+        for (const SlabClassStats &slabClass : storeStats.slabClasses) {
+            if (slabClass.pages) {
+                printf("Slab class of %zu byte chunks: pages = %lu, chunks used = %lu of %lu\n",
+                        slabClass.chunkSize, slabClass.pages, slabClass.usedChunks, slabClass.chunks);
+            }
+        }
+    }
     printf("****************************************************************************\n");
 }
 
 void clearStats() {
-    requestTimes.clear();
+    latencies.reset();
     stat_num_insert = 0;
     stat_num_delete = 0;
     stat_num_lookup = 0;
     printf(">>>> Stats cleared. (Note the key-value storage is not reset, only the statistics.)\n");
 }
 
-void *startThreadPoolServer(void *nThread) {
-    multicore::ThreadSafeKVStore *store = new multicore::ThreadSafeKVStore(DEFAULT_STORAGE_PATH, DEFAULT_CACHE_SIZE); // Create back-end storage.
-    multicore::ThreadPoolServer *server = new multicore::ThreadPoolServer(DEFAULT_PORT_NO, * (int*) nThread, store, DEFAULT_STORAGE_PATH); // Create thread pool.
+void *startThreadPoolServer(void *opts) {
+    Options *options = (Options *) opts;
+    store = new multicore::ThreadSafeKVStore(DEFAULT_STORAGE_PATH, options->cacheBytes, options->nShards, options->engine,
+                                             options->nFlushers, DEFAULT_DIRTY_LIMIT, options->filterFpr,
+                                             options->filterMaxBytes, options->walPolicy, options->walSyncMillis,
+                                             options->checkpointInterval); // Create back-end storage.
+    server = new multicore::ThreadPoolServer(DEFAULT_PORT_NO, options->nThreads, store,
+                                             options->nAcceptors, options->backlog, options->asyncDisk,
+                                             options->maxQueueWait, options->maxQueuedTasks); // Create thread pool.
     server->start(); // Start listening to connections.
+    return nullptr;
 }
 
 } // multicore
 
 // Program entry.
 int main(int argc, char **argv) {
-    int nThread = multicore::argParser(argc, argv);
+    multicore::Options options;
+    if (multicore::argParser(argc, argv, options)) {
+        exit(-1);
+    }
     multicore::isRunning = true;
     pthread_t tid;
     // Create thread-pool-server thread.
-    if (pthread_create(&tid, nullptr, multicore::startThreadPoolServer, (void *) &nThread)) {
+    if (pthread_create(&tid, nullptr, multicore::startThreadPoolServer, (void *) &options)) {
             fprintf(stderr, "thread-pool-server thread creation failed. Terminating.\n");
             exit(-1);
         }
     // Waiting for user input.
     while (multicore::isRunning.load()) {
-        printf(">>>> Server running... \nEnter 's' to print statistics,\n'r' to reset the statistics recording\nOr 'q' to terminate the server (all key-value storage will be lost).\n:");
-        char keyPressed = getchar();
-        if (keyPressed == 's') {
+        printf(">>>> Server running... \nEnter 's' to print statistics,\n'r' to reset the statistics recording\nOr 'q' to terminate the server (%s).\n:",
+               options.walPolicy == multicore::WAL_OFF ? "all key-value storage will be lost" : "the key-value storage is kept for the next start");
+        int keyPressed = getchar();
+        if (keyPressed == EOF) {
+            // No console, e.g. running as a daemon. Keep serving; statistics are available at /_/metrics.
+            printf("\n>>>> Standard input closed. Statistics are available at http://localhost:" STRINGIFY(DEFAULT_PORT_NO) "/_/metrics\n");
+            fflush(stdout);
+            pthread_join(tid, nullptr);
+            break;
+        } else if (keyPressed == 's') {
             multicore::printStats();
         } else if (keyPressed == 'r') {
             multicore::clearStats();
         } else if (keyPressed == 'q') {
+            if (multicore::store != nullptr) {
+                multicore::store->saveHotSet(); // so the next start can warm up the cache with what it holds now
+            }
             multicore::isRunning = false;
         }
         while ((keyPressed = getchar()) != '\n' && keyPressed != EOF) {}
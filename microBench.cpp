@@ -0,0 +1,412 @@
+#include <unistd.h>
+#include <pthread.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <functional>
+#include <algorithm>
+
+#include "threadSafeKVStore.hpp"
+#include "threadSafeQueue.hpp"
+#include "httpProcessingFunc.hpp"
+#include "fileSystemIO.hpp"
+
+#define DEFAULT_SUITES       "store,queue,parser" // Components to be measured.
+#define DEFAULT_MAX_THREADS  4                    // Largest number of threads to run with.
+#define DEFAULT_REPETITIONS  3                    // Number of measured runs of every benchmark, after one warmup run.
+#define DEFAULT_NUM_OPS      100000               // Number of operations per thread in every run.
+#define DEFAULT_CACHE_SIZES  "64M,1M"             // Cache sizes of the storage. 1M makes 4K values spill to disk.
+#define DEFAULT_KEY_COUNTS   "10000"              // Numbers of distinct keys in the storage.
+#define DEFAULT_VALUE_SIZES  "100,4096"           // Sizes of the values in the storage.
+#define DEFAULT_NUM_SHARDS   16                   // Number of shards of the storage.
+#define DEFAULT_BASE_DIR     "/tmp"               // Directory the temporary storage directory is made in.
+#define QUEUE_CAPACITY       1024                 // Capacity of the lock-free queue.
+#define BATCH_SIZE           100                  // Number of keys of a batch lookup.
+
+/**
+ * Microbenchmarks of the hot paths of the server, each exercised directly without any networking.
+ *
+ * store:  ThreadSafeKVStore insert, lookup, batch lookup and remove, for every combination of cache size, number of
+ *         keys and value size. A cache smaller than the data makes inserts evict to disk.
+ * queue:  ThreadSafeQueue and LockFreeQueue, with as many producer as consumer threads, so at least 2.
+ * parser: parseHTTP on a GET, on POSTs with small and large bodies, and on a GET arriving in 3 pieces.
+ *
+ * Every benchmark runs with 1, 2, 4, ... threads up to the max, once as warmup and then a number of
+ * measured times. Reports the median throughput, and the median and best time per operation, i.e.
+ * the wall time of a run divided by the operations each thread did. Runs offline: the storage lives
+ * in a temporary directory, which is deleted at the end.
+ */
+
+namespace multicore {
+
+struct BenchOptions {
+    std::vector<std::string> suites;
+    int maxThreads;
+    int repetitions;
+    long nOps;
+    std::vector<size_t> cacheSizes;
+    std::vector<size_t> keyCounts;
+    std::vector<size_t> valueSizes;
+    DiskEngine engine;
+    std::string baseDir;
+};
+
+// The routine run by every thread of a benchmark, given the index of the thread.
+typedef std::function<void(int)> ThreadBody;
+
+struct ThreadStart {
+    const ThreadBody *body;
+    int index;
+    pthread_barrier_t *barrier;
+};
+
+static void *threadStarter(void *obj) {
+    ThreadStart *start = (ThreadStart *) obj;
+    pthread_barrier_wait(start->barrier);
+    (*start->body)(start->index);
+    return nullptr;
+}
+
+// Runs body on nThreads threads at once. Returns the wall time in seconds.
+static double runThreads(int nThreads, const ThreadBody &body) {
+    pthread_barrier_t barrier;
+    pthread_barrier_init(&barrier, nullptr, nThreads + 1);
+    std::vector<pthread_t> threads(nThreads, 0);
+    std::vector<ThreadStart> starts(nThreads);
+    for (int i = 0; i < nThreads; ++i) {
+        starts[i] = ThreadStart{&body, i, &barrier};
+        if (pthread_create(&threads[i], nullptr, threadStarter, (void *) &starts[i])) {
+            fprintf(stderr, "pthread_create failed. Terminating.\n");
+            exit(-1);
+        }
+    }
+    // The clock starts before the threads are released, since they may well be done before this thread runs again.
+    std::chrono::time_point<std::chrono::high_resolution_clock> startTime = std::chrono::high_resolution_clock::now();
+    pthread_barrier_wait(&barrier);
+    for (pthread_t tid : threads) {
+        pthread_join(tid, nullptr);
+    }
+    std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - startTime;
+    pthread_barrier_destroy(&barrier);
+    return elapsed.count();
+}
+
+// Prints one result line. opsPerThread is the number of operations each thread did in one run.
+static void report(const char *suite, const std::string &config, int nThreads, const char *op, long opsPerThread,
+                   std::vector<double> seconds) {
+    std::sort(seconds.begin(), seconds.end());
+    double median = seconds[seconds.size() / 2];
+    printf("%-7s %-32s %7d %-14s %14.0f %12.1f %12.1f\n", suite, config.c_str(), nThreads, op,
+           opsPerThread * nThreads / median, median * 1e9 / opsPerThread, seconds[0] * 1e9 / opsPerThread);
+    fflush(stdout);
+}
+
+// Runs a benchmark once as warmup and then the given number of times, and reports it.
+// prepare is run before every run, untimed.
+static void measure(const BenchOptions &options, const char *suite, const std::string &config, int nThreads,
+                    const char *op, long opsPerThread, const ThreadBody &body,
+                    const std::function<void()> &prepare = std::function<void()>()) {
+    std::vector<double> seconds;
+    for (int rep = 0; rep <= options.repetitions; ++rep) {
+        if (prepare) {
+            prepare();
+        }
+        double elapsed = runThreads(nThreads, body);
+        if (rep > 0) {
+            seconds.push_back(elapsed);
+        }
+    }
+    report(suite, config, nThreads, op, opsPerThread, seconds);
+}
+
+// A small fast random number generator (xorshift64*), one per thread.
+static inline uint64_t nextRandom(uint64_t &state) {
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 2685821657736338717UL;
+}
+
+static std::string sizeName(size_t bytes) {
+    char name[32];
+    if (bytes >= (1 << 20) && bytes % (1 << 20) == 0) {
+        snprintf(name, sizeof(name), "%luM", bytes >> 20);
+    } else if (bytes >= (1 << 10) && bytes % (1 << 10) == 0) {
+        snprintf(name, sizeof(name), "%luK", bytes >> 10);
+    } else {
+        snprintf(name, sizeof(name), "%lu", bytes);
+    }
+    return name;
+}
+
+static void storeSuite(const BenchOptions &options, const std::string &dir) {
+    for (size_t cacheBytes : options.cacheSizes) {
+        for (size_t nKeys : options.keyCounts) {
+            for (size_t valueSize : options.valueSizes) {
+                std::string config = "cache=" + sizeName(cacheBytes) + " keys=" + std::to_string(nKeys) +
+                                     " value=" + sizeName(valueSize);
+                std::vector<std::string> keys;
+                for (size_t i = 0; i < nKeys; ++i) {
+                    keys.push_back("key" + std::to_string(i));
+                }
+                ValueBuffer value(std::string(valueSize, 'v'));
+                for (int nThreads = 1; nThreads <= options.maxThreads; nThreads *= 2) {
+                    ThreadSafeKVStore *store = new ThreadSafeKVStore(dir, cacheBytes, DEFAULT_NUM_SHARDS, options.engine);
+                    // Every thread writes its share of the keys. After the warmup run, which inserts them,
+                    // every run replaces existing values.
+                    ThreadBody insertAll = [&](int t) {
+                        for (size_t i = t; i < nKeys; i += nThreads) {
+                            store->insert(keys[i], value);
+                        }
+                    };
+                    long share = nKeys / nThreads;
+                    measure(options, "store", config, nThreads, "insert", share, insertAll);
+                    measure(options, "store", config, nThreads, "lookup", options.nOps, [&](int t) {
+                        uint64_t state = t + 1;
+                        ValueBuffer found;
+                        for (long i = 0; i < options.nOps; ++i) {
+                            store->lookup(keys[nextRandom(state) % nKeys], found);
+                        }
+                    });
+                    // Lookups of the same random keys, BATCH_SIZE at a time. Time per operation is per key.
+                    measure(options, "store", config, nThreads, "batch-lookup", options.nOps / BATCH_SIZE * BATCH_SIZE, [&](int t) {
+                        uint64_t state = t + 1;
+                        std::vector<BatchOp> ops(BATCH_SIZE);
+                        for (long i = 0; i < options.nOps / BATCH_SIZE; ++i) {
+                            for (BatchOp &op : ops) {
+                                op.type = BATCH_LOOKUP;
+                                op.key = keys[nextRandom(state) % nKeys];
+                            }
+                            store->batch(ops);
+                        }
+                    });
+                    measure(options, "store", config, nThreads, "lookup-absent", options.nOps, [&](int t) {
+                        uint64_t state = t + 1;
+                        ValueBuffer found;
+                        std::string key = "absent";
+                        for (long i = 0; i < options.nOps; ++i) {
+                            key.resize(6);
+                            key += std::to_string(nextRandom(state) % nKeys);
+                            store->lookup(key, found);
+                        }
+                    });
+                    measure(options, "store", config, nThreads, "remove", share, [&](int t) {
+                        for (size_t i = t; i < nKeys; i += nThreads) {
+                            store->remove(keys[i]);
+                        }
+                    }, [&]() { runThreads(nThreads, insertAll); });
+                    delete store; // Writes everything back, so the next store starts from an idle disk.
+                }
+            }
+        }
+    }
+}
+
+struct QueueElement { // Same size as a task of the thread pool server.
+    void *ptr;
+    long stamp;
+};
+
+// ThreadSafeQueue has no capacity, so it gets a constructor taking one.
+template <typename T>
+class UnboundedQueue: public ThreadSafeQueue<T> {
+  public:
+    explicit UnboundedQueue(size_t) {}
+};
+
+// Runs with as many producer as consumer threads. Consumers only dequeue elements known to come,
+// so that no consumer blocks forever at the end.
+template <typename Queue>
+static void queueBench(const BenchOptions &options, const char *name) {
+    for (int nPairs = 1; 2 * nPairs <= std::max(options.maxThreads, 2); nPairs *= 2) {
+        Queue queue(QUEUE_CAPACITY);
+        std::atomic_long remaining;
+        measure(options, "queue", name, 2 * nPairs, "enq+deq", options.nOps, [&](int t) {
+            if (t % 2 == 0) {
+                for (long i = 0; i < options.nOps; ++i) {
+                    queue.enqueue(QueueElement{nullptr, i});
+                }
+            } else {
+                while (remaining.fetch_sub(1) > 0) {
+                    queue.dequeue();
+                }
+            }
+        }, [&]() { remaining = options.nOps * nPairs; });
+    }
+}
+
+static void queueSuite(const BenchOptions &options) {
+    queueBench<UnboundedQueue<QueueElement>>(options, "ThreadSafeQueue");
+    queueBench<LockFreeQueue<QueueElement>>(options, "LockFreeQueue");
+}
+
+static void parserSuite(const BenchOptions &options) {
+    struct ParserCase {
+        const char *name;
+        std::string request;
+        int pieces; // Number of pieces the request arrives in.
+    };
+    std::vector<ParserCase> cases = {
+        {"GET", "GET /somekey HTTP/1.1\r\nHost: localhost\r\nUser-Agent: microbench\r\nAccept: */*\r\n\r\n", 1},
+        {"POST-100", "POST /somekey HTTP/1.1\r\nHost: localhost\r\nContent-Length: 100\r\n\r\n" + std::string(100, 'v'), 1},
+        {"POST-4K", "POST /somekey HTTP/1.1\r\nHost: localhost\r\nContent-Length: 4096\r\n\r\n" + std::string(4096, 'v'), 1},
+        {"GET-3-pieces", "GET /somekey HTTP/1.1\r\nHost: localhost\r\nUser-Agent: microbench\r\nAccept: */*\r\n\r\n", 3},
+    };
+    for (const ParserCase &c : cases) {
+        for (int nThreads = 1; nThreads <= options.maxThreads; nThreads *= 2) {
+            measure(options, "parser", c.name, nThreads, "parseHTTP", options.nOps, [&](int) {
+                HTTP_Parser parser;
+                HTTP_Request request;
+                const char *buffer = c.request.data();
+                size_t length = c.request.size();
+                for (long i = 0; i < options.nOps; ++i) {
+                    for (int piece = 1; piece <= c.pieces; ++piece) {
+                        if (parseHTTP(buffer, length * piece / c.pieces, parser, request) < 0) {
+                            fprintf(stderr, "Parsing failed. Terminating.\n");
+                            exit(-1);
+                        }
+                    }
+                }
+            });
+        }
+    }
+}
+
+// Parses a comma separated list of sizes, each optionally followed by a K, M or G suffix.
+static std::vector<size_t> parseSizes(const char *str) {
+    std::vector<size_t> sizes;
+    while (*str) {
+        char *end;
+        size_t value = strtoull(str, &end, 10);
+        switch (toupper(*end)) {
+          case 'G':
+            value <<= 10; // fall through
+          case 'M':
+            value <<= 10; // fall through
+          case 'K':
+            value <<= 10;
+            ++end;
+        }
+        sizes.push_back(value);
+        str = *end == ',' ? end + 1 : end + strlen(end);
+    }
+    return sizes;
+}
+
+// Parses the arguments for the program.
+int argParser(int argc, char **argv, BenchOptions &options) {
+    int c;
+    const char *suites = DEFAULT_SUITES;
+    const char *engine = "file";
+    options.maxThreads = DEFAULT_MAX_THREADS;
+    options.repetitions = DEFAULT_REPETITIONS;
+    options.nOps = DEFAULT_NUM_OPS;
+    options.cacheSizes = parseSizes(DEFAULT_CACHE_SIZES);
+    options.keyCounts = parseSizes(DEFAULT_KEY_COUNTS);
+    options.valueSizes = parseSizes(DEFAULT_VALUE_SIZES);
+    options.baseDir = DEFAULT_BASE_DIR;
+    opterr = 0;
+    while ((c = getopt (argc, argv, "s:t:r:o:c:K:v:e:d:")) != -1)
+        switch (c) {
+          case 's':
+            suites = optarg;
+            break;
+          case 't':
+            options.maxThreads = atoi(optarg);
+            break;
+          case 'r':
+            options.repetitions = atoi(optarg);
+            break;
+          case 'o':
+            options.nOps = atol(optarg);
+            break;
+          case 'c':
+            options.cacheSizes = parseSizes(optarg);
+            break;
+          case 'K':
+            options.keyCounts = parseSizes(optarg);
+            break;
+          case 'v':
+            options.valueSizes = parseSizes(optarg);
+            break;
+          case 'e':
+            engine = optarg;
+            break;
+          case 'd':
+            options.baseDir = optarg;
+            break;
+          case '?':
+            if (isprint (optopt))
+                fprintf(stderr, "Unknown option or missing argument `-%c'.\n", optopt);
+            else
+                fprintf(stderr, "Unknown option character `\\x%x'.\n", optopt);
+            return 1;
+          default:
+            abort();
+        }
+    for (const char *s = suites; *s; ) {
+        const char *end = strchr(s, ',');
+        options.suites.push_back(end ? std::string(s, end) : std::string(s));
+        s = end ? end + 1 : s + strlen(s);
+    }
+    for (const std::string &suite : options.suites) {
+        if (suite != "store" && suite != "queue" && suite != "parser") {
+            fprintf(stderr, "Unknown suite `%s'. Use store, queue or parser.\n", suite.c_str());
+            return 1;
+        }
+    }
+    if (!strcmp(engine, "file")) {
+        options.engine = FILE_PER_KEY;
+    } else if (!strcmp(engine, "log")) {
+        options.engine = LOG_STRUCTURED;
+    } else {
+        fprintf(stderr, "Unknown disk engine `%s'. Use `file' or `log'.\n", engine);
+        return 1;
+    }
+    for (size_t n : options.keyCounts) {
+        if (n < 1) {
+            fprintf(stderr, "The number of keys must be positive.\n");
+            return 1;
+        }
+    }
+    if (options.maxThreads < 1 || options.repetitions < 1 || options.nOps < 1) {
+        fprintf(stderr, "Invalid option value.\n");
+        return 1;
+    }
+    return 0;
+}
+
+} // namespace multicore
+
+// Program entry.
+int main(int argc, char **argv) {
+    multicore::BenchOptions options;
+    if (multicore::argParser(argc, argv, options)) {
+        fprintf(stderr, "Usage: %s [-s store,queue,parser] [-t max threads] [-r repetitions] [-o ops per thread]\n"
+                        "       [-c cache sizes] [-K key counts] [-v value sizes] [-e file|log] [-d temp dir base]\n", argv[0]);
+        exit(-1);
+    }
+    std::string dir = options.baseDir + "/microbench.XXXXXX";
+    if (mkdtemp(&dir[0]) == nullptr) {
+        fprintf(stderr, "Creating a temporary directory in `%s' failed. Terminating.\n", options.baseDir.c_str());
+        exit(-1);
+    }
+    printf("%-7s %-32s %7s %-14s %14s %12s %12s\n", "suite", "config", "threads", "op", "ops/s", "ns/op", "best ns/op");
+    for (const std::string &suite : options.suites) {
+        if (suite == "store") {
+            multicore::storeSuite(options, dir + "/storage");
+        } else if (suite == "queue") {
+            multicore::queueSuite(options);
+        } else {
+            multicore::parserSuite(options);
+        }
+    }
+    multicore::initDir(dir); // Empties the directory.
+    rmdir(dir.c_str());
+    return 0;
+}
@@ -0,0 +1,68 @@
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <cstdio>
+
+#include "outputQueue.hpp"
+
+#define MAX_COPY_LENGTH 1024 // Values up to this length are copied instead of being queued by reference.
+#define MAX_IOVECS      64   // Max number of segments sent by one writev.
+
+namespace multicore {
+
+void OutputQueue::append(const char *data, size_t length) {
+    if (segments.empty() || segments.back().value) {
+        segments.push_back(Segment());
+    }
+    segments.back().bytes.append(data, length);
+}
+
+void OutputQueue::append(const ValueBuffer &value) {
+    if (value.size() <= MAX_COPY_LENGTH) {
+        append(value.data(), value.size());
+        return;
+    }
+    segments.push_back(Segment());
+    segments.back().value = value;
+}
+
+int OutputQueue::flush(int sock) {
+    struct iovec iov[MAX_IOVECS];
+    struct msghdr msg = {};
+    while (!segments.empty()) {
+        int n = 0;
+        for (auto it = segments.begin(); it != segments.end() && n < MAX_IOVECS; ++it, ++n) {
+            size_t skip = n ? 0 : offset;
+            iov[n].iov_base = (void *) (it->data() + skip);
+            iov[n].iov_len = it->size() - skip;
+        }
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n;
+        ssize_t sent = sendmsg(sock, &msg, MSG_NOSIGNAL); // writev that does not raise SIGPIPE
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            return -1;
+        }
+        // Drop what has been sent.
+        size_t left = sent;
+        while (left && left >= segments.front().size() - offset) {
+            left -= segments.front().size() - offset;
+            segments.pop_front();
+            offset = 0;
+        }
+        offset += left;
+        if (!segments.empty() && segments.front().size() == offset) { // empty segment
+            segments.pop_front();
+            offset = 0;
+        }
+    }
+    return 0;
+}
+
+} // namespace multicore
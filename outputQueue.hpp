@@ -0,0 +1,73 @@
+#pragma once
+
+#include <string>
+#include <deque>
+#include <cstddef>
+
+#include "valueBuffer.hpp"
+
+namespace multicore {
+
+/**
+ * @section DESCRIPTION
+ *
+ * Queue of the bytes to be sent on a connection.
+ *
+ * Small pieces (status lines, headers, small values) are copied and coalesced into one segment, while
+ * large values are queued by reference, so the bytes of a large value are never copied between the
+ * cache and the socket. Everything queued is sent with writev.
+ */
+class OutputQueue {
+  public:
+    OutputQueue(): offset(0) {}
+
+    /**
+     * Queue bytes by copying them.
+     *
+     * @param data the bytes.
+     * @param length the number of bytes.
+     */
+    void append(const char *data, size_t length);
+
+    /**
+     * Queue a value. Small values are copied, large ones are queued by reference.
+     *
+     * @param value the value.
+     */
+    void append(const ValueBuffer &value);
+
+    /**
+     * @return true if there is nothing to be sent.
+     */
+    inline bool empty() const {
+        return segments.empty();
+    }
+
+    /**
+     * Send as much of the queue as the socket accepts without blocking.
+     *
+     * @param sock the socket.
+     * @return 0 on success, even if not everything could be sent;
+     *         -1 on error.
+     */
+    int flush(int sock);
+
+  private:
+    struct Segment {
+        std::string bytes; // Copied bytes, used when value is null.
+        ValueBuffer value; // A value queued by reference.
+
+        inline const char *data() const {
+            return value ? value.data() : bytes.data();
+        }
+
+        inline size_t size() const {
+            return value ? value.size() : bytes.size();
+        }
+    };
+
+    std::deque<Segment> segments;
+    size_t offset; // Bytes of the first segment already sent.
+};
+
+} // namespace multicore
@@ -0,0 +1,143 @@
+#include <unistd.h>
+#include <pthread.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cctype>
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+#include "threadSafeQueue.hpp"
+
+#define DEFAULT_MAX_THREADS  64      // Largest number of producer threads (and of consumer threads) to run with.
+#define DEFAULT_NUM_OPS      1000000 // Number of elements passed through the queue in each run.
+#define DEFAULT_CAPACITY     1024    // Capacity of the bounded lock-free queue.
+
+/**
+ * Task queue benchmark.
+ *
+ * Compares the lock-based ThreadSafeQueue with the lock-free LockFreeQueue. Every run starts the
+ * same number of producer and consumer threads, doubling from 1 up to the max number of threads.
+ * Producers enqueue their share of the elements and consumers dequeue until all elements are
+ * consumed, blocking on an empty queue like the thread pool does. Reports millions of elements
+ * passed through the queue per second.
+ */
+
+namespace multicore {
+
+struct BenchOptions {
+    int maxThreads;
+    long nOps;
+    size_t capacity;
+};
+
+struct Element { // Same size as a task of the thread pool server.
+    void *ptr;
+    long stamp;
+};
+
+template <typename Queue>
+struct Run {
+    Queue *queue;
+    long perProducer;
+    std::atomic_long remaining; // Elements not claimed by any consumer yet.
+    std::atomic_bool go;
+};
+
+template <typename Queue>
+void *producerRoutine(void *arg) {
+    Run<Queue> *run = (Run<Queue> *) arg;
+    while (!run->go.load()) {}
+    for (long i = 0; i < run->perProducer; ++i) {
+        run->queue->enqueue(Element{nullptr, i});
+    }
+    return nullptr;
+}
+
+template <typename Queue>
+void *consumerRoutine(void *arg) {
+    Run<Queue> *run = (Run<Queue> *) arg;
+    long sum = 0;
+    while (!run->go.load()) {}
+    // Only dequeue an element that is known to come, so no consumer blocks forever at the end.
+    while (run->remaining.fetch_sub(1) > 0) {
+        sum += run->queue->dequeue().stamp;
+    }
+    return (void *) sum;
+}
+
+// Passes options.nOps elements through the queue with nThreads producers and nThreads consumers.
+// Returns millions of elements per second.
+template <typename Queue>
+double runBench(Queue *queue, int nThreads, const BenchOptions &options) {
+    Run<Queue> run;
+    run.queue = queue;
+    run.perProducer = options.nOps / nThreads;
+    run.remaining = run.perProducer * nThreads;
+    run.go = false;
+    std::vector<pthread_t> threads(2 * nThreads, 0);
+    for (int i = 0; i < 2 * nThreads; ++i) {
+        if (pthread_create(&threads[i], nullptr, i % 2 ? consumerRoutine<Queue> : producerRoutine<Queue>, (void *) &run)) {
+            fprintf(stderr, "pthread_create failed. Terminating.\n");
+            exit(-1);
+        }
+    }
+    std::chrono::time_point<std::chrono::high_resolution_clock> startTime = std::chrono::high_resolution_clock::now();
+    run.go = true;
+    void *status;
+    for (pthread_t tid : threads) {
+        pthread_join(tid, &status);
+    }
+    std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - startTime;
+    return run.perProducer * nThreads / elapsed.count() / 1e6;
+}
+
+// Parses the arguments for the program.
+int argParser(int argc, char **argv, BenchOptions &options) {
+    int c;
+    options.maxThreads = DEFAULT_MAX_THREADS;
+    options.nOps = DEFAULT_NUM_OPS;
+    options.capacity = DEFAULT_CAPACITY;
+    opterr = 0;
+    while ((c = getopt (argc, argv, "t:o:q:")) != -1)
+        switch (c) {
+          case 't':
+            options.maxThreads = atoi(optarg);
+            break;
+          case 'o':
+            options.nOps = atol(optarg);
+            break;
+          case 'q':
+            options.capacity = atol(optarg);
+            break;
+          case '?':
+            if (isprint (optopt))
+                fprintf(stderr, "Unknown option or missing argument `-%c'.\n", optopt);
+            else
+                fprintf(stderr, "Unknown option character `\\x%x'.\n", optopt);
+            return 1;
+          default:
+            abort();
+        }
+    return 0;
+}
+
+} // namespace multicore
+
+// Program entry.
+int main(int argc, char **argv) {
+    multicore::BenchOptions options;
+    if (multicore::argParser(argc, argv, options) || options.maxThreads < 1 || options.nOps < 1) {
+        fprintf(stderr, "Usage: %s [-t max threads] [-o elements per run] [-q lock-free queue capacity]\n", argv[0]);
+        exit(-1);
+    }
+    printf("%8s %20s %20s\n", "threads", "ThreadSafeQueue", "LockFreeQueue");
+    for (int nThreads = 1; nThreads <= options.maxThreads; nThreads *= 2) {
+        multicore::ThreadSafeQueue<multicore::Element> lockedQueue;
+        multicore::LockFreeQueue<multicore::Element> lockFreeQueue(options.capacity);
+        double locked = multicore::runBench(&lockedQueue, nThreads, options);
+        double lockFree = multicore::runBench(&lockFreeQueue, nThreads, options);
+        printf("%8d %14.2f Mop/s %14.2f Mop/s\n", nThreads, locked, lockFree);
+    }
+    return 0;
+}
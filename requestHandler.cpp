@@ -1,4 +1,6 @@
 #include "requestHandler.hpp"
+#include "adminHandler.hpp"
+#include "batchHandler.hpp"
 
 namespace multicore {
 
@@ -6,40 +8,78 @@ extern std::atomic_ulong stat_num_lookup;
 extern std::atomic_ulong stat_num_insert;
 extern std::atomic_ulong stat_num_delete;
 
-string handleRequest(ThreadSafeKVStore *store, const HTTP_Request &request) {
+// Build the response to a GET, POST or DELETE of the storage from its result.
+static void buildResponse(RequestType type, int res, const ValueBuffer &val, HTTP_Response &response) {
+    response.body = ValueBuffer();
+    if (res) {
+        response.head = "HTTP/1.1 404 Not found\r\nContent-length: 0\r\n\r\n";
+    } else {
+        response.head = "HTTP/1.1 200 OK\r\nContent-length: ";
+        if (type == GET) {
+            response.head += std::to_string(val.size());
+            response.head += "\r\n\r\n";
+            response.body = val;
+        } else {
+            response.head += "0\r\n\r\n";
+        }
+    }
+}
+
+void handleRequest(ThreadSafeKVStore *store, const HTTP_Request &request, HTTP_Response &response) {
     int res;
-    string val;
-    string str;
+    ValueBuffer val;
+    response.cached = false;
+    response.pieces.clear();
+    if (isBatchRequest(request)) {
+        handleBatchRequest(store, request, response);
+        return;
+    }
+    if (isAdminRequest(request)) {
+        handleAdminRequest(store, request, response);
+        return;
+    }
+    string key = request.key.str();
     switch (request.type) {
       case GET:
-        res = store->lookup(request.key, val);
+        res = store->lookup(key, val, &response.cached);
         ++stat_num_lookup;
         break;
       case POST:
-        res = store->insert(request.key, request.value);
+        res = store->insert(key, ValueBuffer(request.value.data, request.value.length), request.ttl);
         ++stat_num_insert;
         break;
       case DELETE:
-        res = store->remove(request.key);
+        res = store->remove(key);
         ++stat_num_delete;
         break;
       default:
         exit(-1);
     }
-    if (res) {
-        str = "HTTP/1.1 404 Not found\r\nContent-length: 0\r\n\r\n";
-    } else {
-        str = "HTTP/1.1 200 OK\r\nContent-length: ";
-        if (request.type == GET) {
-            str += std::to_string(val.length());
-            str += "\r\n\r\n";
-            str += val;
-            str += "\r\n";
-        } else {
-            str += "0\r\n\r\n";
-        }
+    buildResponse(request.type, res, val, response);
+}
+
+bool startRequest(ThreadSafeKVStore *store, const HTTP_Request &request, HTTP_Response &response, DiskLookup &pending) {
+    if (request.type != GET || isBatchRequest(request) || isAdminRequest(request)) {
+        handleRequest(store, request, response);
+        return true;
+    }
+    ValueBuffer val;
+    response.pieces.clear();
+    int res = store->lookupStart(request.key.str(), val, &response.cached, pending);
+    ++stat_num_lookup;
+    if (res > 0) {
+        return false;
     }
-    return str;
+    buildResponse(GET, res, val, response);
+    return true;
+}
+
+void finishRequest(ThreadSafeKVStore *store, DiskLookup &pending, long bytesRead, HTTP_Response &response) {
+    ValueBuffer val;
+    int res = store->lookupFinish(pending, bytesRead, val);
+    response.cached = false;
+    response.pieces.clear();
+    buildResponse(GET, res, val, response);
 }
 
 } // namespace multicore
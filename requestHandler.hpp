@@ -3,21 +3,69 @@
 #include <string>
 #include <cstdlib>
 #include <atomic>
+#include <vector>
 
 #include "threadSafeKVStore.hpp"
 #include "httpProcessingFunc.hpp"
+#include "valueBuffer.hpp"
 
 namespace multicore {
 
+/**
+ * A part of a response made of many values: some bytes, followed by a value.
+ */
+struct ResponsePiece {
+    std::string bytes;
+    ValueBuffer value;
+};
+
+/**
+ * A response to an HTTP request: the status line and headers, followed by the body, which is
+ * a reference to a value of the storage so that it does not need to be copied. A response made
+ * of many values, such as a batch or a scan, has its body in pieces instead, so none of the values is
+ * copied into one buffer.
+ */
+struct HTTP_Response {
+    std::string head;
+    ValueBuffer body;
+    std::vector<ResponsePiece> pieces; // Sent in order after body.
+    bool cached; // For a GET, whether it was answered from memory rather than from disk.
+};
+
 /**
  * Handle an HTTP request and build a response.
+ * Batch requests, i.e. POSTs to "/_/batch", are answered by handleBatchRequest. Other requests for the
+ * reserved path prefix "/_/" are answered by handleAdminRequest instead of the storage.
  * Also maintains three special keys in the storage, "STAT_NUM_INSERT", "STAT_NUM_DELETE" and "STAT_NUM_LOOKUP",
  * which stores the number of inserts, deletes and lookups respectively.
  *
  * @param store the back-end storage.
  * @param request the parsed request information.
- * @return the response.
+ * @param response the argument to return the response.
+ */
+void handleRequest(ThreadSafeKVStore *store, const HTTP_Request &request, HTTP_Response &response);
+
+/**
+ * Handle an HTTP request like handleRequest, except that a GET whose value has to be read from disk is
+ * not answered yet, so the caller can read the value without blocking, see ThreadSafeKVStore::lookupStart.
+ *
+ * @param store the back-end storage.
+ * @param request the parsed request information.
+ * @param response the argument to return the response.
+ * @param pending the argument to return the read to do, if the response is not built yet.
+ * @return true if the response is built;
+ *         false if the value has to be read into pending first, after which finishRequest builds the response.
+ */
+bool startRequest(ThreadSafeKVStore *store, const HTTP_Request &request, HTTP_Response &response, DiskLookup &pending);
+
+/**
+ * Build the response to a GET that startRequest left unanswered, once its value is read.
+ *
+ * @param store the back-end storage.
+ * @param pending the read returned by startRequest.
+ * @param bytesRead the number of bytes read, or a negative error number.
+ * @param response the argument to return the response.
  */
-string handleRequest(ThreadSafeKVStore *store, const HTTP_Request &request);
+void finishRequest(ThreadSafeKVStore *store, DiskLookup &pending, long bytesRead, HTTP_Response &response);
 
 } // namespace multicore
@@ -0,0 +1,218 @@
+#include <sys/mman.h>
+#include <cstdint>
+
+#include "slabAllocator.hpp"
+
+namespace multicore {
+
+// The header at the start of every page.
+struct SlabPage {
+    SlabAllocator *allocator;
+    SlabPage *prev, *next; // Neighbours in the list of pages of the class with free chunks.
+    void *freeChunks; // Released chunks of the page, linked through their first bytes.
+    unsigned int slabClass;
+    unsigned int used; // Number of chunks handed out.
+    unsigned int carved; // Number of chunks ever handed out. The rest of the page has never been touched.
+};
+
+static_assert(sizeof(SlabPage) <= SLAB_PAGE_HEADER, "slab page header too large");
+
+SlabAllocator::SlabAllocator(): regionUsed(SLAB_REGION_SIZE), freePages(nullptr), refs(1), closing(false) {
+    pthread_mutex_init(&pages_lock, nullptr);
+    std::vector<size_t> sizes;
+    for (double size = SLAB_MIN_CHUNK; (size_t) size <= SLAB_PAGE_SIZE - SLAB_PAGE_HEADER; size *= SLAB_GROWTH_FACTOR) {
+        size_t chunkSize = ((size_t) size + 7) & ~(size_t) 7;
+        if (sizes.empty() || chunkSize > sizes.back()) {
+            sizes.push_back(chunkSize);
+        }
+        size = chunkSize;
+    }
+    numClasses = sizes.size();
+    classes = new SlabClass[numClasses];
+    for (unsigned int i = 0; i < numClasses; ++i) {
+        classes[i].chunkSize = sizes[i];
+        classes[i].chunksPerPage = (SLAB_PAGE_SIZE - SLAB_PAGE_HEADER) / sizes[i];
+        classes[i].partial = nullptr;
+        classes[i].pages.store(0, std::memory_order_relaxed);
+        classes[i].usedChunks.store(0, std::memory_order_relaxed);
+        pthread_mutex_init(&classes[i].lock, nullptr);
+    }
+    classBySize.resize((SLAB_PAGE_SIZE - SLAB_PAGE_HEADER) / 8 + 1);
+    for (size_t units = 0, c = 0; units < classBySize.size(); ++units) {
+        while (c < numClasses && classes[c].chunkSize < units * 8) {
+            ++c;
+        }
+        classBySize[units] = c;
+    }
+}
+
+SlabAllocator::~SlabAllocator() {
+    for (unsigned int i = 0; i < numClasses; ++i) {
+        pthread_mutex_destroy(&classes[i].lock);
+    }
+    delete[] classes;
+    for (char *region : regions) {
+        munmap(region, SLAB_REGION_SIZE);
+    }
+    pthread_mutex_destroy(&pages_lock);
+}
+
+void SlabAllocator::destroy() {
+    closing.store(true);
+    // Free the empty pages kept for reuse. The others are freed by the release of their last chunk.
+    unsigned long freed = 0;
+    for (unsigned int i = 0; i < numClasses; ++i) {
+        SlabClass &cls = classes[i];
+        pthread_mutex_lock(&cls.lock);
+        for (SlabPage *page = cls.partial; page != nullptr;) {
+            SlabPage *next = page->next;
+            if (!page->used) {
+                unlink(cls, page);
+                cls.pages.store(cls.pages.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+                ++freed;
+            }
+            page = next;
+        }
+        pthread_mutex_unlock(&cls.lock);
+    }
+    for (unsigned long i = 0; i < freed; ++i) {
+        unref();
+    }
+    unref();
+}
+
+void SlabAllocator::unref() {
+    if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        delete this;
+    }
+}
+
+SlabPage *SlabAllocator::newPage() {
+    pthread_mutex_lock(&pages_lock);
+    SlabPage *page = freePages;
+    if (page != nullptr) {
+        freePages = page->next;
+    } else {
+        if (regionUsed == SLAB_REGION_SIZE) {
+            // Map a little more than a region, and unmap what is around the part aligned to the page size.
+            size_t length = SLAB_REGION_SIZE + SLAB_PAGE_SIZE;
+            char *mem = (char *) mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (mem == MAP_FAILED) {
+                pthread_mutex_unlock(&pages_lock);
+                return nullptr;
+            }
+            char *region = (char *) (((uintptr_t) mem + SLAB_PAGE_SIZE - 1) & ~(uintptr_t) (SLAB_PAGE_SIZE - 1));
+            if (region > mem) {
+                munmap(mem, region - mem);
+            }
+            munmap(region + SLAB_REGION_SIZE, mem + length - (region + SLAB_REGION_SIZE));
+            regions.push_back(region);
+            regionUsed = 0;
+        }
+        page = (SlabPage *) (regions.back() + regionUsed);
+        regionUsed += SLAB_PAGE_SIZE;
+    }
+    pthread_mutex_unlock(&pages_lock);
+    return page;
+}
+
+void SlabAllocator::freePage(SlabPage *page) {
+    madvise(page, SLAB_PAGE_SIZE, MADV_DONTNEED); // The memory goes back to the system, the addresses stay.
+    pthread_mutex_lock(&pages_lock);
+    page->next = freePages;
+    freePages = page;
+    pthread_mutex_unlock(&pages_lock);
+}
+
+void SlabAllocator::unlink(SlabClass &cls, SlabPage *page) {
+    if (page->prev != nullptr) {
+        page->prev->next = page->next;
+    } else {
+        cls.partial = page->next;
+    }
+    if (page->next != nullptr) {
+        page->next->prev = page->prev;
+    }
+    page->prev = page->next = nullptr;
+}
+
+void *SlabAllocator::allocate(size_t size) {
+    unsigned int c = classOf(size);
+    if (c == numClasses) {
+        return nullptr;
+    }
+    SlabClass &cls = classes[c];
+    pthread_mutex_lock(&cls.lock);
+    SlabPage *page = cls.partial;
+    if (page == nullptr) { // every page of the class is full
+        page = newPage();
+        if (page == nullptr) {
+            pthread_mutex_unlock(&cls.lock);
+            return nullptr;
+        }
+        page->allocator = this;
+        page->prev = page->next = nullptr;
+        page->freeChunks = nullptr;
+        page->slabClass = c;
+        page->used = page->carved = 0;
+        cls.partial = page;
+        cls.pages.store(cls.pages.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        refs.fetch_add(1, std::memory_order_relaxed);
+    }
+    void *chunk;
+    if (page->freeChunks != nullptr) {
+        chunk = page->freeChunks;
+        page->freeChunks = *(void **) chunk;
+    } else {
+        chunk = (char *) page + SLAB_PAGE_HEADER + (size_t) page->carved++ * cls.chunkSize;
+    }
+    if (++page->used == cls.chunksPerPage) { // page is full now
+        unlink(cls, page);
+    }
+    cls.usedChunks.store(cls.usedChunks.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    pthread_mutex_unlock(&cls.lock);
+    return chunk;
+}
+
+void SlabAllocator::release(void *chunk) {
+    SlabPage *page = (SlabPage *) ((uintptr_t) chunk & ~(uintptr_t) (SLAB_PAGE_SIZE - 1));
+    SlabAllocator *allocator = page->allocator;
+    SlabClass &cls = allocator->classes[page->slabClass];
+    pthread_mutex_lock(&cls.lock);
+    if (page->used == cls.chunksPerPage) { // page was full, so it is not in the list
+        page->next = cls.partial;
+        if (cls.partial != nullptr) {
+            cls.partial->prev = page;
+        }
+        cls.partial = page;
+    }
+    *(void **) chunk = page->freeChunks;
+    page->freeChunks = chunk;
+    cls.usedChunks.store(cls.usedChunks.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+    // An empty page is kept if it is the only one of the class with free chunks, so a class whose usage
+    // goes up and down across a page boundary does not allocate and free a page every time.
+    bool emptied = --page->used == 0 && (allocator->closing.load() || cls.partial != page || page->next != nullptr);
+    if (emptied) {
+        unlink(cls, page);
+        cls.pages.store(cls.pages.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&cls.lock);
+    if (emptied) {
+        if (!allocator->closing.load()) { // otherwise the whole region is unmapped soon anyway
+            allocator->freePage(page);
+        }
+        allocator->unref();
+    }
+}
+
+void SlabAllocator::getStats(std::vector<SlabClassStats> &stats) const {
+    stats.resize(numClasses);
+    for (unsigned int i = 0; i < numClasses; ++i) {
+        stats[i].chunkSize = classes[i].chunkSize;
+        stats[i].pages = classes[i].pages.load(std::memory_order_relaxed);
+        stats[i].chunks = stats[i].pages * classes[i].chunksPerPage;
+        stats[i].usedChunks = classes[i].usedChunks.load(std::memory_order_relaxed);
+    }
+}
+
+} // namespace multicore
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <pthread.h>
+#include <atomic>
+#include <vector>
+#include <cstddef>
+
+#define SLAB_PAGE_SIZE     (64 * 1024)   // Bytes of a slab page. Pages are aligned to their size.
+#define SLAB_REGION_SIZE   (1024 * 1024) // Bytes mapped at once to be cut into pages.
+#define SLAB_PAGE_HEADER   64            // Bytes at the start of a page taken by its header.
+#define SLAB_MIN_CHUNK     64            // Bytes of a chunk of the smallest slab class.
+#define SLAB_GROWTH_FACTOR 1.125         // Ratio of the chunk sizes of two consecutive slab classes.
+
+namespace multicore {
+
+/**
+ * Usage of one slab class.
+ */
+struct SlabClassStats {
+    size_t chunkSize; // Bytes of a chunk of the class.
+    unsigned long pages; // Number of pages of the class.
+    unsigned long chunks; // Number of chunks in those pages, used or not.
+    unsigned long usedChunks; // Number of chunks handed out.
+};
+
+struct SlabPage;
+
+/**
+ * @section DESCRIPTION
+ *
+ * A slab allocator for many small blocks, in the manner of memcached. Sizes are rounded up to the chunk
+ * size of a slab class, whose chunk sizes grow by SLAB_GROWTH_FACTOR, so at most about 1/9 of a chunk is
+ * wasted. Every class carves its chunks out of pages of SLAB_PAGE_SIZE bytes, so a chunk costs no header
+ * and no call to malloc. Pages are cut out of regions mapped with mmap. A page whose chunks are all free
+ * goes back to the allocator, which returns its memory to the system and can give it to any class, so
+ * memory does not stay stuck in a class the workload no longer uses.
+ *
+ * Thread-safe: every class has its own lock. A chunk can be released by any thread, and finds its page
+ * and its allocator from its own address, since pages are aligned to their size.
+ */
+class SlabAllocator {
+  public:
+    /**
+     * Constructor. Makes an allocator without any page.
+     */
+    SlabAllocator();
+
+    /**
+     * Give up the allocator. It is deleted once every chunk is released, which may be later, since chunks
+     * can outlive their owner. Replaces the destructor.
+     */
+    void destroy();
+
+    /**
+     * Allocate a chunk.
+     *
+     * @param size the number of bytes needed.
+     * @return the chunk, aligned to 8 bytes, or nullptr if the size is larger than the largest class
+     *         or there is no memory left.
+     */
+    void *allocate(size_t size);
+
+    /**
+     * Free a chunk.
+     *
+     * @param chunk a chunk returned by allocate of any allocator.
+     */
+    static void release(void *chunk);
+
+    /**
+     * @param size a number of bytes.
+     * @return the size of the chunk that allocate returns for it, or 0 if it is larger than the largest class.
+     */
+    inline size_t chunkSize(size_t size) const {
+        unsigned int c = classOf(size);
+        return c < numClasses ? classes[c].chunkSize : 0;
+    }
+
+    /**
+     * Get the usage of every class. Does not take any lock.
+     *
+     * @param stats the argument to return the usage, by class, from the smallest chunk size.
+     */
+    void getStats(std::vector<SlabClassStats> &stats) const;
+
+  private:
+    struct alignas(64) SlabClass {
+        size_t chunkSize;
+        unsigned int chunksPerPage;
+        SlabPage *partial; // The pages with free chunks.
+        std::atomic<unsigned long> pages;
+        std::atomic<unsigned long> usedChunks;
+        pthread_mutex_t lock;
+    };
+
+    ~SlabAllocator();
+
+    // Find the smallest class whose chunks hold size bytes. Returns numClasses if there is none.
+    inline unsigned int classOf(size_t size) const {
+        return size <= SLAB_PAGE_SIZE - SLAB_PAGE_HEADER ? classBySize[(size + 7) / 8] : numClasses;
+    }
+
+    // Drop one reference to the allocator, deleting it with the last one.
+    void unref();
+
+    static void unlink(SlabClass &cls, SlabPage *page);
+
+    // Get a page for a class, or nullptr if there is no memory left.
+    SlabPage *newPage();
+
+    // Give back the page of a class whose chunks are all free.
+    void freePage(SlabPage *page);
+
+    SlabClass *classes;
+    unsigned int numClasses;
+    std::vector<unsigned char> classBySize; // The class of every size, in units of 8 bytes.
+    std::vector<char *> regions; // Every region mapped.
+    size_t regionUsed; // Bytes of the last region already cut into pages.
+    SlabPage *freePages; // Pages given back, linked through their headers.
+    pthread_mutex_t pages_lock; // Protects regions, regionUsed and freePages.
+    std::atomic<unsigned long> refs; // One for the owner, and one per page.
+    std::atomic<bool> closing; // Whether the owner gave up the allocator, so empty pages are freed right away.
+};
+
+} // namespace multicore
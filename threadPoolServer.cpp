@@ -1,8 +1,12 @@
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <pthread.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
@@ -13,32 +17,114 @@
 #include "threadPoolServer.hpp"
 #include "httpProcessingFunc.hpp"
 #include "requestHandler.hpp"
-#include "fileSystemIO.hpp"
+#include "adminHandler.hpp"
+#include "batchHandler.hpp"
 
-#define BUFFER_LENGTH 4096 // Max length of a HTTP request
+#define READ_BUFFER_LENGTH 65536 // Size of the buffer of each thread in the pool that sockets are read into
+#define MAX_EVENTS      256  // Max number of events returned by one epoll_wait
+#define MAX_IDLE_BUFFER 65536 // Max capacity of the input buffer kept by a connection between requests
+#define RUN_QUEUE_CAPACITY 16384 // Capacity of the run queue of each thread in the pool
+#define IO_SUBMIT_BATCH 8 // Reads prepared on the io_uring of a thread are submitted once there are this many, or its run queue is empty
+#define RING_EVENT_TAG 1 // Tags the epoll events of the io_uring eventfds, which carry their (aligned) worker instead of a connection
+
+// The response to a request shed for waiting too long, and to a connection refused for overload.
+static const char SHED_RESPONSE[] = "HTTP/1.1 503 Service unavailable\r\nRetry-After: 1\r\nContent-length: 0\r\n\r\n";
+static const char REFUSED_RESPONSE[] = "HTTP/1.1 503 Service unavailable\r\nRetry-After: 1\r\nConnection: close\r\nContent-length: 0\r\n\r\n";
 
 namespace multicore {
 
-typedef unsigned int FileDescriptor;
 extern std::atomic_bool isRunning;
 extern std::atomic_ulong stat_num_lookup;
 extern std::atomic_ulong stat_num_insert;
 extern std::atomic_ulong stat_num_delete;
-extern std::vector<float> requestTimes;
-
-ThreadPoolServer::ThreadPoolServer(unsigned short _portno, unsigned int nThreads, ThreadSafeKVStore *_store, string _storagePath):
-                                   portno(_portno), store(_store), storagePath(_storagePath) {
-    pthread_cond_init(&task, nullptr);
-    pthread_mutex_init(&cond_lock, nullptr);
-    pthread_mutex_init(&stat_record_lock, nullptr);
-    taskQueue = new ThreadSafeQueue<Task>;
-    threads = new std::vector<pthread_t>(nThreads, 0);
+extern LatencyRecorder latencies;
+
+// A thread in the thread pool, with its own run queue.
+class ThreadPoolServer::Worker {
+  public:
+    ThreadPoolServer *server;
+    const unsigned int id; // Index in the thread pool.
+    pthread_t tid;
+    LockFreeQueue<Task> runQueue; // Tasks of the connections whose home is this thread.
+    FutexEvent ready; // Signaled when a task is added to the run queue.
+    LatencyRecorder::PerThread *latencies; // Latencies of the requests served by this thread.
+    std::vector<LatencyOp> served; // Kinds of the requests whose responses are being sent.
+    IoRing *ring; // Where this thread reads values from disk asynchronously, or null if it reads them synchronously.
+    char readBuffer[READ_BUFFER_LENGTH]; // Where sockets are read into, before the bytes are appended to the input buffer of their connection.
+
+    Worker(ThreadPoolServer *_server, unsigned int _id): server(_server), id(_id), tid(0), runQueue(RUN_QUEUE_CAPACITY),
+                                                          latencies(nullptr), ring(nullptr) {}
+
+    ~Worker() {
+        delete ring;
+    }
+};
+
+// Queue the response to a request on its connection, for flushConnection.
+static void appendResponse(Connection *conn, const HTTP_Response &response) {
+    conn->out.append(response.head.data(), response.head.size());
+    if (response.body) {
+        conn->out.append(response.body);
+    }
+    for (const ResponsePiece &piece : response.pieces) {
+        conn->out.append(piece.bytes.data(), piece.bytes.size());
+        if (piece.value) {
+            conn->out.append(piece.value);
+        }
+    }
+}
+
+ThreadPoolServer::ThreadPoolServer(unsigned short _portno, unsigned int nThreads, ThreadSafeKVStore *_store,
+                                   unsigned int _nAcceptors, int _backlog, bool asyncDisk,
+                                   unsigned int maxQueueWaitMillis, unsigned long _maxQueuedTasks):
+                                   portno(_portno), nAcceptors(_nAcceptors ? _nAcceptors : 1), backlog(_backlog),
+                                   maxQueueWait(std::chrono::milliseconds(maxQueueWaitMillis)),
+                                   maxQueuedTasks(_maxQueuedTasks), store(_store) {
+    nextHome = 0;
+    numAccepted = 0;
+    numClosed = 0;
+    numShed = 0;
+    numRefused = 0;
+    if (!nThreads) {
+        nThreads = 1;
+    }
+    for (unsigned int i = 0; i < nThreads; ++i) {
+        workers.push_back(new Worker(this, i));
+    }
+    // Initialize event loop.
+    epollfd = epoll_create1(0);
+    if (epollfd < 0) {
+        fprintf(stderr, "epoll_create1 failed. Terminating.\n");
+        exit(-1);
+    }
+    // Every thread gets its own io_uring, whose completions are announced to the event loop.
+    for (Worker *w : workers) {
+        if (!asyncDisk) {
+            break;
+        }
+        w->ring = new IoRing;
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.u64 = (uintptr_t) w | RING_EVENT_TAG;
+        if (!w->ring->available() || epoll_ctl(epollfd, EPOLL_CTL_ADD, w->ring->eventFd(), &ev)) {
+            printf("io_uring is not available. Values are read from disk synchronously.\n");
+            for (Worker *other : workers) {
+                delete other->ring;
+                other->ring = nullptr;
+            }
+            break;
+        }
+    }
+    if (pthread_create(&eventLoopThread, nullptr, eventLoopStarter, (void *)this)) {
+        fprintf(stderr, "pthread_create failed. Terminating.\n");
+        exit(-1);
+    }
     // Initialize thread pool.
     pthread_attr_t attr;
     pthread_attr_init(&attr);
     pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
-    for (unsigned int i = 0; i < nThreads; ++i) {
-        if (pthread_create(&threads->at(i), &attr, questHandlerStarter, (void *)this)) {
+    for (Worker *w : workers) {
+        if (pthread_create(&w->tid, &attr, questHandlerStarter, (void *)w)) {
             fprintf(stderr, "pthread_create failed. Terminating.\n");
             exit(-1);
         }
@@ -53,35 +139,53 @@ ThreadPoolServer::ThreadPoolServer(unsigned short _portno, unsigned int nThreads
 ThreadPoolServer::~ThreadPoolServer() {
     // Join all spawned threads in the thread-pool.
     void *status;
-    for (pthread_t tid : *threads) {
-        if (pthread_join(tid, &status)) {
+    for (Worker *w : workers) {
+        if (pthread_join(w->tid, &status)) {
             fprintf(stderr, "ERROR: Problem with joining threads in pool. There may be in-memory cache not written back to disk. \n");
             exit(-1);
         }
     }
-    pthread_cond_destroy(&task);
-    pthread_mutex_destroy(&cond_lock);
-    pthread_mutex_destroy(&stat_record_lock);
-    delete taskQueue;
-    delete threads;
+    pthread_join(eventLoopThread, &status);
+    close(epollfd);
+    for (Worker *w : workers) {
+        delete w;
+    }
 }
 
 void ThreadPoolServer::start() {
-    // Initialize disk storage
-    if (initDir(storagePath)) {
-        fprintf(stderr, "Disk storage initialization failed. Terminating.\n");
-        exit(-1);
+    // Start acceptor threads, and wait for them.
+    std::vector<pthread_t> acceptors(nAcceptors, 0);
+    for (unsigned int i = 0; i < nAcceptors; ++i) {
+        if (pthread_create(&acceptors[i], nullptr, acceptLoopStarter, (void *)this)) {
+            fprintf(stderr, "pthread_create failed. Terminating.\n");
+            exit(-1);
+        }
+    }
+    void *status;
+    for (pthread_t tid : acceptors) {
+        pthread_join(tid, &status);
     }
+}
 
+// The routine for each acceptor thread to run.
+// Every acceptor has its own listening socket bound to the same port with SO_REUSEPORT,
+// so the kernel load-balances new connections across acceptors without any shared lock.
+void *ThreadPoolServer::acceptLoop() {
     // Create an Internet socket
-    FileDescriptor sockfd, newsockfd;
+    int sockfd, newsockfd;
+    int one = 1;
     socklen_t clilen;
     struct sockaddr_in serv_addr, cli_addr;
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    sockfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
     if (sockfd < 0) {
         fprintf(stderr, "Creating socked failed. Terminating.\n");
         exit(-1);
     }
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) ||
+        setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one))) {
+        fprintf(stderr, "Setting socket options failed. Terminating.\n");
+        exit(-1);
+    }
     memset((char *) &serv_addr, 0, sizeof(serv_addr));
     serv_addr.sin_family = AF_INET;
     serv_addr.sin_addr.s_addr = INADDR_ANY;
@@ -90,72 +194,353 @@ void ThreadPoolServer::start() {
         fprintf(stderr, "Binding failed. Terminating.\n");
         exit(-1);
     }
-    listen(sockfd,5);
-    clilen = sizeof(cli_addr);
+    if (listen(sockfd, backlog) < 0) {
+        fprintf(stderr, "Listening failed. Terminating.\n");
+        exit(-1);
+    }
     // Listen to incoming connections
     while (isRunning.load()) {
-        newsockfd = accept(sockfd, (struct sockaddr *) &cli_addr, &clilen);
+        clilen = sizeof(cli_addr);
+        newsockfd = accept4(sockfd, (struct sockaddr *) &cli_addr, &clilen, SOCK_NONBLOCK | SOCK_CLOEXEC);
         if (newsockfd < 0) {
-            fprintf(stderr, "Connection failed. Skipping current connection.\n");
+            if (errno != EINTR && errno != ECONNABORTED) {
+                fprintf(stderr, "Connection failed. Skipping current connection.\n");
+            }
             continue;
         }
-        pthread_mutex_lock(&cond_lock);
-        taskQueue->enqueue(Task(newsockfd, std::chrono::high_resolution_clock::now())); // Register the arriving connection as a new task.
-        pthread_cond_signal(&task); // Signal the thread pool a new task has arrived.
-        pthread_mutex_unlock(&cond_lock);
+        if (maxQueuedTasks && queuedTasks() >= maxQueuedTasks) {
+            // Overloaded. Refusing the connection tells its client to back off now, instead of queueing its
+            // requests behind tasks that are late already.
+            (void) write(newsockfd, REFUSED_RESPONSE, sizeof(REFUSED_RESPONSE) - 1);
+            close(newsockfd);
+            numRefused.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+        setsockopt(newsockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        // Hand the connection over to the event loop.
+        Connection *conn = new Connection(newsockfd, nextHome.fetch_add(1, std::memory_order_relaxed) % workers.size());
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET | EPOLLONESHOT;
+        ev.data.ptr = conn;
+        numAccepted.fetch_add(1, std::memory_order_relaxed);
+        if (epoll_ctl(epollfd, EPOLL_CTL_ADD, newsockfd, &ev)) {
+            fprintf(stderr, "Registering connection to event loop failed. Skipping current connection.\n");
+            closeConnection(conn);
+        }
     }
     close(sockfd);
+    return nullptr;
 }
 
-// The routine for each thread in the thread pool to run.
-void *ThreadPoolServer::questHandler() {
-    int n;
-    char buffer[BUFFER_LENGTH];
-    unsigned int sock;
-    HTTP_Request request;
-    std::string response;
+// The routine of the event loop thread.
+// Every connection is registered as edge-triggered and one-shot, so once a connection is
+// reported ready it is owned by exactly one thread in the pool until that thread re-arms it.
+void *ThreadPoolServer::eventLoop() {
+    struct epoll_event events[MAX_EVENTS];
     while (isRunning.load()) {
-        pthread_mutex_lock(&cond_lock);
-        while (taskQueue->empty()) {
-            pthread_cond_wait(&task, &cond_lock);
-        }
-        pthread_mutex_unlock(&cond_lock);
-        Task t = taskQueue->dequeue();
-        std::chrono::time_point<std::chrono::high_resolution_clock> arriveTime = t.arriveTime;
-        sock = t.socket;
-        while(true) {
-            memset(buffer, 0, BUFFER_LENGTH);
-            n = read(sock, buffer, BUFFER_LENGTH - 1); // Leave at least one character for 0 which is used for denoting end of string.
-            if (n < 0) {
-                fprintf(stderr, "Reading from socket failed. Terminating current connection. ERROR CODE: %d\n", errno);
+        int n = epoll_wait(epollfd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno != EINTR) {
+                fprintf(stderr, "epoll_wait failed. ERROR CODE: %d\n", errno);
+            }
+            continue;
+        }
+        std::chrono::time_point<std::chrono::high_resolution_clock> now = std::chrono::high_resolution_clock::now();
+        for (int i = 0; i < n; ++i) {
+            if (events[i].data.u64 & RING_EVENT_TAG) {
+                Worker *owner = (Worker *) (uintptr_t) (events[i].data.u64 & ~(uint64_t) RING_EVENT_TAG);
+                // Reads completed. The eventfd is reset first, so reads completing meanwhile are reported again.
+                uint64_t count;
+                while (read(owner->ring->eventFd(), &count, sizeof(count)) < 0 && errno == EINTR) {}
+                owner->ring->reap([this](void *data, int result) {
+                    Connection *conn = (Connection *) data;
+                    conn->readResult = result;
+                    schedule(Task(conn, conn->arriveTime)); // Its latency counts from when its requests arrived.
+                });
+                continue;
+            }
+            schedule(Task((Connection *) events[i].data.ptr, now)); // Register the ready connection as a new task.
+        }
+    }
+    return nullptr;
+}
+
+// Read everything available on a ready connection, handle the complete requests and write the responses.
+// The latency of every request handled, from the connection becoming ready to the response being sent,
+// is recorded by the worker. Returns false if the connection should be closed.
+// A GET whose value has to be read from disk parks the connection, and stops the handling of the requests
+// after it until the connection is served again with the value read.
+// A shed task answers its requests with 503 instead, apart from the probes of /_/metrics and /_/ready.
+bool ThreadPoolServer::serveConnection(Worker *self, const Task &t, bool shed) {
+    Connection *conn = t.conn;
+    ssize_t n;
+    long ret;
+    bool peerClosed = false;
+    HTTP_Request request;
+    HTTP_Response response;
+    std::string &in = conn->inBuffer;
+    if (!conn->out.empty() && !flushConnection(conn)) { // Finish writing responses left over from last time first.
+        return false;
+    }
+    if (conn->parked) { // Back from reading the value of a GET. Its response goes before those of the requests after it.
+        conn->parked = false;
+        finishRequest(store, conn->pending, conn->readResult, response);
+        self->served.push_back(OP_GET_MISS);
+        appendResponse(conn, response);
+    }
+    // Edge-triggered: drain the socket until it would block.
+    // Only the bytes received are appended to the input buffer, which grows geometrically for large requests,
+    // so its spare capacity is never filled in.
+    while (true) {
+        n = read(conn->socket, self->readBuffer, READ_BUFFER_LENGTH);
+        if (n > 0) {
+            in.append(self->readBuffer, n);
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
                 break;
-            } else if (n == 0) { // client has closed connection
+            }
+            fprintf(stderr, "Reading from socket failed. Terminating current connection. ERROR CODE: %d\n", errno);
+            return false;
+        } else if (n == 0) { // client has closed connection
+            peerClosed = true;
+            break;
+        } else if (n < READ_BUFFER_LENGTH) {
+            // A short read means the socket is drained, which saves the read that would fail with EAGAIN.
+            // Re-arming the connection reports it again if more bytes arrive in the meantime.
+            break;
+        }
+    }
+    // Handle every complete (possibly pipelined) request in the buffer, in order, and send all the
+    // responses at once. An incomplete request stays in the buffer until more bytes arrive.
+    size_t consumed = 0;
+    while (consumed < in.size()) {
+        ret = parseHTTP(in.data() + consumed, in.size() - consumed, conn->parser, request);
+        if (ret < 0) {
+            fprintf(stderr, "Invalid HTTP request. Terminating current connection. ERROR CODE: %ld. Request is:\n%s\n", ret, in.c_str() + consumed);
+            // Tell the client why, after the responses to the requests before, as far as the socket takes it.
+            const char *error = parseErrorResponse(ret);
+            conn->out.append(error, strlen(error));
+            flushConnection(conn);
+            return false;
+        } else if (ret == 0) {
+            break;
+        }
+        consumed += ret;
+        if (shed && !isProbeRequest(request)) {
+            conn->out.append(SHED_RESPONSE, sizeof(SHED_RESPONSE) - 1);
+            numShed.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+        if (self->ring == nullptr) {
+            handleRequest(store, request, response);
+        } else if (!startRequest(store, request, response, conn->pending)) {
+            // Only a value that is not in the page cache parks the connection.
+            DiskLookup &pending = conn->pending;
+            long n = IoRing::readCached(pending.location.fd, &pending.buffer[0], pending.location.length, pending.location.offset);
+            if (n < (long) pending.location.length) {
+                conn->parked = true;
                 break;
-            } else {
-                if (n = parseHTTP(buffer, request)) {
-                    fprintf(stderr, "Invalid HTTP request. Terminating current connection. ERROR CODE: %d. Request is:\n%s\n", n, buffer);
-                    break;
-                } else {
-                    response = handleRequest(store, request);
-                    n = write(sock, response.c_str(), response.length());
-                    if (n < 0) {
-                        fprintf(stderr, "Responding to socket failed. Terminating current connection.\n");
-                        break;
-                    }
-                }
             }
+            finishRequest(store, pending, n, response);
+        }
+        if (isBatchRequest(request)) {
+            self->served.push_back(OP_BATCH);
+        } else if (!isAdminRequest(request)) {
+            self->served.push_back(request.type == GET ? (response.cached ? OP_GET_HIT : OP_GET_MISS) :
+                                   request.type == POST ? OP_POST : OP_DELETE);
+        }
+        appendResponse(conn, response);
+    }
+    bool flushed = flushConnection(conn);
+    if (!self->served.empty()) {
+        uint64_t latency = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::high_resolution_clock::now() - t.arriveTime).count();
+        for (LatencyOp op : self->served) {
+            self->latencies->record(op, latency);
+        }
+        self->served.clear();
+    }
+    if (!flushed) {
+        return false;
+    }
+    in.erase(0, consumed);
+    if (in.empty() && in.capacity() > MAX_IDLE_BUFFER) { // Don't keep the memory of a large request on an idle connection.
+        std::string().swap(in);
+    }
+    return conn->parked || !peerClosed; // A parked connection sees the end of the stream again once it is back.
+}
+
+// Prepare the read of the GET a connection is parked on, on the io_uring of the thread, which submits it
+// along with others. If the io_uring is full, the connection is scheduled again right away, and the value
+// is then read synchronously. Must be the last access to the connection, since another thread may pick
+// it up as soon as the read completes.
+void ThreadPoolServer::parkConnection(Worker *self, const Task &t) {
+    Connection *conn = t.conn;
+    const DiskLocation &location = conn->pending.location;
+    conn->arriveTime = t.arriveTime;
+    conn->readResult = 0;
+    if (!self->ring->prepareRead(location.fd, &conn->pending.buffer[0], location.length, location.offset, conn)) {
+        schedule(t);
+    }
+}
+
+// Submit the reads prepared on the io_uring of a thread, once there are enough of them to be worth a system
+// call, or once the thread has nothing else to do, so they do not wait for it any longer.
+void ThreadPoolServer::submitReads(Worker *self) {
+    unsigned int unsubmitted = self->ring->unsubmitted();
+    if (unsubmitted && (unsubmitted >= IO_SUBMIT_BATCH || self->runQueue.empty())) {
+        self->ring->submit();
+    }
+}
+
+// Write as much of the pending output of a connection as the socket accepts.
+// Returns false if the connection should be closed.
+bool ThreadPoolServer::flushConnection(Connection *conn) {
+    if (conn->out.flush(conn->socket)) {
+        fprintf(stderr, "Responding to socket failed. Terminating current connection.\n");
+        return false;
+    }
+    return true;
+}
+
+// Give a connection back to the event loop. Must be the last access to the connection,
+// since another thread may pick it up as soon as it is re-armed.
+void ThreadPoolServer::rearmConnection(Connection *conn) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET | EPOLLONESHOT;
+    if (!conn->out.empty()) {
+        ev.events |= EPOLLOUT;
+    }
+    ev.data.ptr = conn;
+    if (epoll_ctl(epollfd, EPOLL_CTL_MOD, conn->socket, &ev)) {
+        fprintf(stderr, "Re-arming connection failed. Terminating current connection.\n");
+        closeConnection(conn);
+    }
+}
+
+void ThreadPoolServer::closeConnection(Connection *conn) {
+    close(conn->socket); // Also removes the socket from the epoll set.
+    delete conn;
+    numClosed.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Number of tasks waiting in the run queues. The result may be outdated as soon as it is returned.
+unsigned long ThreadPoolServer::queuedTasks() const {
+    unsigned long queued = 0;
+    for (Worker *w : workers) {
+        queued += w->runQueue.size();
+    }
+    return queued;
+}
+
+void ThreadPoolServer::getStats(ServerStats &stats) const {
+    // Closed is read before accepted, so connections accepted and closed in between cannot make the difference negative.
+    unsigned long closed = numClosed.load(std::memory_order_relaxed);
+    stats.acceptedConnections = numAccepted.load(std::memory_order_relaxed);
+    stats.activeConnections = stats.acceptedConnections > closed ? stats.acceptedConnections - closed : 0;
+    stats.queuedTasks = queuedTasks();
+    stats.poolThreads = workers.size();
+    stats.asyncReads = stats.ioSubmits = 0;
+    for (Worker *w : workers) {
+        if (w->ring != nullptr) {
+            stats.asyncReads += w->ring->reads.load(std::memory_order_relaxed);
+            stats.ioSubmits += w->ring->submits.load(std::memory_order_relaxed);
         }
-        close(sock);
-        std::chrono::time_point<std::chrono::high_resolution_clock> endTime = std::chrono::high_resolution_clock::now();
-        pthread_mutex_lock(&stat_record_lock);
-        std::chrono::duration<float, std::milli> diff = endTime - arriveTime;
-        requestTimes.push_back(diff.count()); // Record how many milliseconds have elapsed.
-        pthread_mutex_unlock(&stat_record_lock);
     }
+    stats.shedRequests = numShed.load(std::memory_order_relaxed);
+    stats.refusedConnections = numRefused.load(std::memory_order_relaxed);
+}
+
+// Put a task on the run queue of the home thread of its connection, and wake up a thread to run it.
+// If the home thread is busy, an idle thread is woken up instead, so that it steals the task.
+void ThreadPoolServer::schedule(const Task &t) {
+    Worker *home = workers[t.conn->home];
+    if (!home->runQueue.tryEnqueue(t)) {
+        // The home run queue is full. Fall back on the run queue of any other thread, or wait for room.
+        unsigned int i = 1;
+        for (; i < workers.size(); ++i) {
+            if (workers[(home->id + i) % workers.size()]->runQueue.tryEnqueue(t)) {
+                break;
+            }
+        }
+        if (i == workers.size()) {
+            home->runQueue.enqueue(t);
+        }
+    }
+    std::atomic_thread_fence(std::memory_order_seq_cst); // Pairs with a thread announcing itself as waiting.
+    if (home->ready.hasWaiters()) {
+        home->ready.wake();
+        return;
+    }
+    for (unsigned int i = 1; i < workers.size(); ++i) {
+        Worker *w = workers[(home->id + i) % workers.size()];
+        if (w->ready.hasWaiters()) {
+            w->ready.wake();
+            return;
+        }
+    }
+    // Every thread is busy. The home thread will find the task once it is done.
+    home->ready.wake();
+}
+
+// Take a task from the run queue of a thread, or steal one from the other threads.
+// Returns false if all run queues are empty.
+bool ThreadPoolServer::findTask(Worker *self, Task &t) {
+    if (self->runQueue.tryDequeue(t)) {
+        return true;
+    }
+    for (unsigned int i = 1; i < workers.size(); ++i) {
+        if (workers[(self->id + i) % workers.size()]->runQueue.tryDequeue(t)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// The routine for each thread in the thread pool to run.
+void *ThreadPoolServer::questHandler(Worker *self) {
+    self->latencies = latencies.registerThread();
+    while (isRunning.load()) {
+        Task t;
+        if (!findTask(self, t)) {
+            if (self->ring != nullptr) {
+                submitReads(self);
+            }
+            self->ready.wait([this, self, &t]() { return findTask(self, t); }); // Sleeps until a task arrives.
+        }
+        // A task that waited too long is shed, unless its connection is back from reading from disk: the
+        // read is done by then, and the GET it was for has been waited for already.
+        bool shed = maxQueueWait.count() && !t.conn->parked &&
+                    std::chrono::high_resolution_clock::now() - t.arriveTime > maxQueueWait;
+        if (!serveConnection(self, t, shed)) {
+            closeConnection(t.conn);
+        } else if (t.conn->parked) {
+            parkConnection(self, t);
+        } else {
+            rearmConnection(t.conn);
+        }
+        if (self->ring != nullptr) {
+            submitReads(self);
+        }
+    }
+    return nullptr;
 }
 
 void *ThreadPoolServer::questHandlerStarter(void *obj) {
-    ((ThreadPoolServer *) obj)->questHandler();
+    Worker *w = (Worker *) obj;
+    return w->server->questHandler(w);
+}
+
+void *ThreadPoolServer::acceptLoopStarter(void *obj) {
+    return ((ThreadPoolServer *) obj)->acceptLoop();
+}
+
+void *ThreadPoolServer::eventLoopStarter(void *obj) {
+    return ((ThreadPoolServer *) obj)->eventLoop();
 }
 
 } // namespace multicore
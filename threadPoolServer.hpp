@@ -1,20 +1,54 @@
 #pragma once
 
 #include <vector>
+#include <string>
 #include <pthread.h>
 #include <atomic>
 #include <chrono>
 
 #include "threadSafeKVStore.hpp"
 #include "threadSafeQueue.hpp"
+#include "httpProcessingFunc.hpp"
+#include "outputQueue.hpp"
+#include "latencyHistogram.hpp"
+#include "ioRing.hpp"
 
 namespace multicore {
 
-struct Task { // Represents a task in the task queue.
-    unsigned int socket; // Socket descriptor of the incoming connection.
-    std::chrono::time_point<std::chrono::high_resolution_clock> arriveTime; // Arriving time of the task. Used for calculating completing time of the task.
+struct Connection { // Represents a client connection owned by the event loop.
+    int socket; // Socket descriptor of the connection.
+    std::string inBuffer; // Bytes read from the socket but not yet processed. Starts at the start of a request.
+    OutputQueue out; // Responses not yet written to the socket.
+    HTTP_Parser parser; // State of parsing the request at the start of inBuffer.
+    unsigned int home; // Index of the worker whose run queue the connection is scheduled on.
+    // A connection is parked while the value of a GET is read from disk through io_uring: it is then neither
+    // watched by the event loop nor on a run queue, and the requests after the GET wait in inBuffer.
+    bool parked;
+    DiskLookup pending; // The lookup of the GET, while parked.
+    long readResult; // Result of the read, set when it completes.
+    std::chrono::time_point<std::chrono::high_resolution_clock> arriveTime; // Arriving time of the task that parked the connection.
+    Connection(int _socket, unsigned int _home): socket(_socket), home(_home), parked(false), readResult(0) {}
+};
+
+struct Task { // Represents a task in the task queue, i.e. a connection that is ready for reading or writing.
+    Connection *conn; // The ready connection.
+    std::chrono::time_point<std::chrono::high_resolution_clock> arriveTime; // Arriving time of the task. Used for calculating the latencies of its requests.
     Task() {}
-    Task(unsigned int _socket, std::chrono::time_point<std::chrono::high_resolution_clock> _arriveTime): socket(_socket), arriveTime(_arriveTime) {}
+    Task(Connection *_conn, std::chrono::time_point<std::chrono::high_resolution_clock> _arriveTime): conn(_conn), arriveTime(_arriveTime) {}
+};
+
+/**
+ * Statistics of the thread pool server.
+ */
+struct ServerStats {
+    unsigned long acceptedConnections; // Number of connections accepted so far.
+    unsigned long activeConnections; // Number of connections currently open.
+    unsigned long queuedTasks; // Number of ready connections waiting in the run queues.
+    unsigned int poolThreads; // Number of threads in the thread pool.
+    unsigned long asyncReads; // Number of values read from disk through io_uring.
+    unsigned long ioSubmits; // Number of system calls submitting reads to io_uring, each for a batch of reads.
+    unsigned long shedRequests; // Number of requests answered with 503 because they waited too long in a run queue.
+    unsigned long refusedConnections; // Number of connections refused because too many tasks were queued.
 };
 
 class ThreadPoolServer {
@@ -25,9 +59,17 @@ class ThreadPoolServer {
      * @param _portno the port number used by the thread pool server.
      * @param nThreads the number of threads in the thread pool.
      * @param _store pointer to the back-end storage.
-     * @param _storagePath path to the storage directory. THIS DIRECTORY WILL BE WIPED CLEAN IF IT ALREADY EXISTS.
+     * @param _nAcceptors the number of acceptor threads, each with its own listening socket.
+     * @param _backlog the backlog of each listening socket.
+     * @param asyncDisk whether to read values from disk through io_uring, if the kernel supports it.
+     * @param maxQueueWaitMillis the max milliseconds a task may wait in a run queue before its requests
+     *                           are answered with 503, or 0 for no max.
+     * @param _maxQueuedTasks the number of tasks waiting in the run queues from which new connections are
+     *                        refused, or 0 for no max.
      */
-    ThreadPoolServer(unsigned short _portno, unsigned int nThreads, ThreadSafeKVStore *_store, string _storagePath);
+    ThreadPoolServer(unsigned short _portno, unsigned int nThreads, ThreadSafeKVStore *_store,
+                     unsigned int _nAcceptors, int _backlog, bool asyncDisk = true,
+                     unsigned int maxQueueWaitMillis = 0, unsigned long _maxQueuedTasks = 0);
 
     /**
      * Destructor.
@@ -36,20 +78,74 @@ class ThreadPoolServer {
 
     /**
      * Start the server. Press "ESC" to end the server and print statistics.
+     *
+     * Connections are accepted by a number of acceptor threads, each listening on its own
+     * SO_REUSEPORT socket so that the kernel spreads incoming connections across them.
+     * Accepted connections are made non-blocking and registered with the event loop, which
+     * owns them from then on. The event loop only hands a connection to the thread pool when
+     * it has data ready, so idle keep-alive connections do not occupy any thread in the pool.
+     *
+     * Every thread in the pool has its own run queue. Each connection is assigned a home thread
+     * round-robin when it is accepted, and the event loop always schedules it on the run queue
+     * of its home thread, so its buffers stay in the caches of the same core. A thread whose run
+     * queue is empty steals tasks from the run queues of the other threads before sleeping.
+     *
+     * With io_uring, a GET whose value has to be read from disk does not block its thread: the read
+     * is prepared on the io_uring of the thread and the connection is parked, and the thread moves on
+     * to other connections. Reads are submitted in batches, once a few are prepared or once the run
+     * queue of the thread is empty. The event loop reaps the completed reads, and schedules their
+     * connections again, which then answer the GET and go on with their next requests. Both disk
+     * engines locate their values, so only reads of a thread whose io_uring is full are read
+     * synchronously instead.
+     *
+     * Under overload, the server sheds load instead of letting the run queues grow. A task that waited
+     * longer than the max queue wait is not served: its requests are answered with 503 at once, since
+     * their clients have likely given up on them, and serving them would only make the tasks behind
+     * them late as well. Only the cheap probes of /_/metrics and /_/ready are still served, and so are
+     * connections back from reading a value from disk. Scans and batches are shed like other requests.
+     * Once the run queues hold the max number of queued tasks, acceptors answer new connections with
+     * 503 and close them.
      */
     void start();
 
+    /**
+     * Get statistics of the server. Does not take any lock.
+     *
+     * @param stats the argument to return the statistics.
+     */
+    void getStats(ServerStats &stats) const;
+
   private:
+    class Worker;
+
     const unsigned short portno;
-    const std::string storagePath;
-    ThreadSafeQueue<Task> *taskQueue;
-    std::vector<pthread_t> *threads;
+    const unsigned int nAcceptors;
+    const int backlog;
+    std::vector<Worker *> workers;
+    std::atomic_uint nextHome; // Round-robin counter for assigning new connections to workers.
+    std::atomic_ulong numAccepted, numClosed;
+    const std::chrono::nanoseconds maxQueueWait;
+    const unsigned long maxQueuedTasks;
+    std::atomic_ulong numShed, numRefused;
+    pthread_t eventLoopThread;
+    int epollfd;
     ThreadSafeKVStore *store;
-    pthread_cond_t task;
-    pthread_mutex_t cond_lock, stat_record_lock;
 
-    void *questHandler();
+    void *questHandler(Worker *self);
     static void *questHandlerStarter(void *obj);
+    void schedule(const Task &t);
+    bool findTask(Worker *self, Task &t);
+    void *acceptLoop();
+    static void *acceptLoopStarter(void *obj);
+    void *eventLoop();
+    static void *eventLoopStarter(void *obj);
+    bool serveConnection(Worker *self, const Task &t, bool shed);
+    unsigned long queuedTasks() const;
+    void parkConnection(Worker *self, const Task &t);
+    void submitReads(Worker *self);
+    bool flushConnection(Connection *conn);
+    void rearmConnection(Connection *conn);
+    void closeConnection(Connection *conn);
     void printStats();
 };
 
@@ -1,33 +1,1268 @@
 #include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <exception>
 #include <unordered_map>
-#include <list>
+#include <set>
+#include <queue>
+#include <vector>
 #include <string>
+#include <functional>
+#include <tuple>
+#include <atomic>
+#include <algorithm>
+#include <chrono>
 
 #include "threadSafeKVStore.hpp"
 #include "fileSystemIO.hpp"
+#include "diskStore.hpp"
+#include "timerWheel.hpp"
+#include "slabAllocator.hpp"
+#include "writeAheadLog.hpp"
+
+#define COMPACTION_INTERVAL 1    // Seconds between two rounds of disk tier maintenance.
+#define FLUSH_BATCH_SIZE    256  // Max number of pending writes a flusher takes from a shard at once.
+#define EXPIRY_INTERVAL     1    // Seconds between two rounds of removing expired keys.
+#define EXPIRY_BATCH_SIZE   256  // Max number of expired keys removed under one write lock.
+#define INITIAL_BUCKETS     16   // Number of buckets of the hash table of an empty cache. A power of two.
+#define INLINE_VALUE_MAX    1024 // Largest value copied into its cache item. Larger ones are kept by reference.
+#define CHECKPOINT_POLL     1    // Seconds between two checks of whether a shard is due for a checkpoint.
+#define CHECKPOINT_LOG_BYTES (16UL << 20) // A shard is checkpointed once this many bytes were logged since its last checkpoint.
+#define WAL_DIR             "wal"    // Sub-directory of the storage holding the write-ahead logs.
+#define FORMAT_FILE         "FORMAT" // File of the storage recording the number of shards and the disk engine.
+#define HOTSET_FILE         "HOTSET" // File of the storage listing the keys of the cache, to warm it up on the next start.
+#define WARMUP_THREADS      4    // Number of threads reading the keys of the hot set into the cache on start.
 
 namespace multicore {
 
-class ThreadSafeKVStoreImpl {
+// A key-value pair in the in memory cache. The item is followed by its key and then its value, all in one
+// chunk of the slab allocator of the shard, or in one malloc'd block if the pair is too large for any slab
+// class. The key is the only copy of it the cache has: the hash table and the CLOCK ring link the items
+// themselves. The item is also the block of the ValueBuffers lookups return, so a value being sent keeps
+// its item alive after it has left the cache.
+//
+// Values larger than INLINE_VALUE_MAX, for which the overhead of a separate block does not matter, are not
+// copied: the item holds a ValueBuffer referring to them, between the item and the key, instead.
+struct CacheItem : ValueBlock {
+    CacheItem *hashNext; // Next item in the same bucket of the hash table.
+    CacheItem *clockPrev, *clockNext; // Neighbours on the CLOCK ring.
+    uint32_t valueLength;
+    uint16_t keyLength;
+    std::atomic<bool> referenced; // CLOCK reference bit. Set by cache hits, which only hold the read lock.
+    bool dirty; // Whether the value differs from the one on disk, i.e. has to be written back on eviction.
+
+    explicit CacheItem(ValueBlockKind kind): ValueBlock(kind), referenced(false), dirty(false) {}
+
+    inline bool external() const {
+        return valueLength > INLINE_VALUE_MAX;
+    }
+
+    inline ValueBuffer *externalValue() {
+        return (ValueBuffer *) (this + 1);
+    }
+
+    inline char *key() {
+        return (char *) (this + 1) + (external() ? sizeof(ValueBuffer) : 0);
+    }
+
+    inline const char *value() {
+        return external() ? externalValue()->data() : key() + keyLength;
+    }
+
+    inline bool keyIs(const string &str) {
+        return str.size() == keyLength && !memcmp(key(), str.data(), keyLength);
+    }
+
+    // A reference to the value, which keeps the item alive if the value is inline.
+    inline ValueBuffer valueBuffer() {
+        return external() ? *externalValue() : ValueBuffer(this, key() + keyLength, valueLength);
+    }
+};
+
+// A write (or delete) that has left the cache but is not on disk yet.
+struct PendingWrite {
+    ValueBuffer value;
+    bool deleted; // Whether the key is to be deleted from disk instead.
+    unsigned long seq; // Identifies this version of the pending write, so the flusher knows if it was replaced meanwhile.
+};
+
+// A copy of a pending write taken by a flusher.
+struct FlushItem {
+    string key;
+    ValueBuffer value;
+    bool deleted;
+    unsigned long seq;
+};
+
+class Shard;
+
+// A background thread writing the pending writes of a subset of the shards to disk.
+struct Flusher {
+    pthread_t tid;
+    pthread_mutex_t lock;
+    pthread_cond_t work; // Signaled when an owned shard gets pending writes, or on shutdown.
+    pthread_cond_t space; // Broadcast after a batch is written, for threads waiting on a full dirty queue.
+    std::vector<Shard *> shards; // The shards owned by this flusher.
+    std::atomic_bool *running;
+};
+
+// Event counters of a shard. On a cache line of their own, since they are updated by lookups, which only
+// hold the read lock and so may run on many threads at once.
+struct alignas(64) ShardCounters {
+    std::atomic<unsigned long> hits;
+    std::atomic<unsigned long> misses;
+    std::atomic<unsigned long> evictions;
+    std::atomic<unsigned long> diskReads;
+    std::atomic<unsigned long> diskWrites;
+    std::atomic<unsigned long> diskDeletes;
+    std::atomic<unsigned long> expirations;
+    std::atomic<unsigned long> checkpoints;
+    std::atomic<unsigned long> warmed;
+    ShardCounters(): hits(0), misses(0), evictions(0), diskReads(0), diskWrites(0), diskDeletes(0), expirations(0), checkpoints(0),
+                     warmed(0) {}
+
+    static inline void bump(std::atomic<unsigned long> &counter, unsigned long n = 1) {
+        counter.fetch_add(n, std::memory_order_relaxed);
+    }
+};
+
+// Milliseconds on a monotonic clock. Expiry times of keys are on this clock.
+static inline uint64_t nowMillis() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Milliseconds since the epoch. Expiry times in the write-ahead log are on this clock, which still means
+// the same after a restart.
+static inline int64_t wallMillis() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// Convert a time of nowMillis to the clock of wallMillis.
+static inline uint64_t toWallMillis(uint64_t millis) {
+    return millis + (wallMillis() - (int64_t) nowMillis());
+}
+
+// Convert a time of wallMillis to the clock of nowMillis. Times too far in the past for it become 1.
+static inline uint64_t fromWallMillis(uint64_t millis) {
+    int64_t converted = (int64_t) millis - (wallMillis() - (int64_t) nowMillis());
+    return converted > 0 ? converted : 1;
+}
+
+// Hash of a key for the hash table of a shard. Independent of std::hash, which selects the shard, so the
+// keys of a shard are spread over all the buckets. Every 8 bytes are mixed in with a multiplication, which
+// carries them to the top bits.
+static inline uint64_t hashBytes(const char *data, size_t length) {
+    uint64_t h = 0x9e3779b97f4a7c15UL ^ length;
+    uint64_t word;
+    for (; length >= sizeof(word); data += sizeof(word), length -= sizeof(word)) {
+        memcpy(&word, data, sizeof(word));
+        h = (h ^ word) * 0xbf58476d1ce4e5b9UL;
+        h ^= h >> 31;
+    }
+    word = 0;
+    memcpy(&word, data, length);
+    return (h ^ word) * 0x94d049bb133111ebUL;
+}
+
+// One independent partition of the storage. Every key belongs to exactly one shard, selected by its hash.
+//
+// The cached items are chained in a hash table and linked in a ring for eviction, both through the items
+// themselves, which are carved out of the slabs of the shard, so caching a key-value pair usually takes no
+// malloc at all. A pair is charged the chunk it is stored in plus a bucket of the hash table.
+//
+// The cache is managed with the CLOCK (second chance) approximation of LRU: a cache hit only sets the
+// reference bit of the item, so it never modifies the table or the ring and can run under the read lock.
+// On eviction, the hand goes around the ring, and items with the reference bit set get their bit cleared
+// and are passed over instead of being evicted. New items are put right behind the hand, so they are the
+// last ones it reaches. Every step is O(1).
+//
+// Keys inserted with a TTL have their expiry time in a map, checked by every lookup, and in a timer wheel
+// with ticks of a second, from which the expirer thread removes them once they are due.
+//
+// Writes to disk are never done while holding the lock of the shard. Evicted dirty entries, spilled values
+// and deletes become pending writes, which a flusher thread writes to disk in batches. Until then, lookups
+// are answered from the pending writes. Clean entries (read from disk and not modified) are simply dropped
+// on eviction.
+//
+// If the storage is durable, every insert and delete is also appended to the write-ahead log of the shard
+// under the write lock, and the caller commits it after releasing the lock, so writers of many shards and
+// of the same shard share the writes and syncs of the log. A checkpoint writes what the cache and the
+// pending writes hold to disk and syncs it, after which the log files before it are deleted.
+class Shard {
   public:
-    ThreadSafeKVStoreImpl(std::string _storagePath, unsigned int _cacheSize)
-        : storagePath(_storagePath), cacheSize( _cacheSize) {
+    Shard(DiskStore *_disk, size_t _cacheBytes, size_t _dirtyLimit)
+        : buckets(INITIAL_BUCKETS, nullptr), bucketBits(__builtin_ctzl(INITIAL_BUCKETS)), hand(nullptr),
+          slabs(new SlabAllocator), wheel(nowMillis() / 1000), disk(_disk), cacheBytes(_cacheBytes), dirtyLimit(_dirtyLimit),
+          generation(0), pendingSeq(0), flusher(nullptr), wal(nullptr), lastCheckpoint(nowMillis()), checkpointLogBytes(0),
+          recovered(false), residentBytes(0), indexBytes(0), numEntries(0), numPending(0) {
         pthread_rwlock_init(&rw_lock, nullptr);
+        pthread_mutex_init(&flush_lock, nullptr);
     }
 
-    ~ThreadSafeKVStoreImpl() {
+    ~Shard() {
+        while (hand != nullptr) {
+            CacheItem *item = hand;
+            unlinkItem(item);
+            dropItem(item);
+        }
+        slabs->destroy(); // Chunks still referenced by ValueBuffers are freed when they are released.
         pthread_rwlock_destroy(&rw_lock);
+        pthread_mutex_destroy(&flush_lock);
+        delete wal;
+        delete disk;
     }
 
-    std::unordered_map<string, string> store;
-    std::list<string> cacheList;
-    const std::string storagePath;
-    const unsigned int cacheSize;
+    // Whether a key-value pair can be cached at all. Pairs larger than the whole budget of the shard bypass the cache.
+    inline bool cacheable(const string &key, const ValueBuffer &value) const {
+        return key.size() <= UINT16_MAX && value.size() <= UINT32_MAX && itemCharge(key.size(), value.size()) <= cacheBytes;
+    }
+
+    // Find a key in the cache. Needs the read lock.
+    CacheItem *cacheFind(const string &key) {
+        for (CacheItem *item = buckets[bucketOf(key.data(), key.size())]; item != nullptr; item = item->hashNext) {
+            if (item->keyIs(key)) {
+                return item;
+            }
+        }
+        return nullptr;
+    }
+
+    // Look up a key in the cache and in the pending writes. Needs the read lock.
+    // Returns 0 if the key was found, -1 if it is pending deletion, or 1 if it is only on disk, if anywhere.
+    int lookupInMemory(const string &key, ValueBuffer &value) {
+        if (!expiries.empty() && expired(key)) { // not removed yet, but already gone for readers
+            return -1;
+        }
+        CacheItem *item = cacheFind(key);
+        if (item != nullptr) { // key already in cache
+            value = item->valueBuffer(); // Only takes a reference.
+            if (!item->referenced.load(std::memory_order_relaxed)) {
+                item->referenced.store(true, std::memory_order_relaxed);
+            }
+            return 0;
+        }
+        auto pit = pending.find(key);
+        if (pit != pending.end()) { // key on its way to disk
+            if (pit->second.deleted) {
+                return -1;
+            }
+            value = pit->second.value;
+            return 0;
+        }
+        return 1;
+    }
+
+    // Whether the TTL of a key has run out. Needs the read lock.
+    inline bool expired(const string &key) const {
+        auto it = expiries.find(key);
+        return it != expiries.end() && it->second <= nowMillis();
+    }
+
+    // Give a key an expiry time, in milliseconds of nowMillis. Needs the write lock.
+    void setExpiry(const string &key, uint64_t expiry) {
+        expiries[key] = expiry;
+        wheel.add(key, (expiry + 999) / 1000); // Rounded up, so the key is never removed early.
+    }
+
+    // Insert or update a key-value pair, which expires after ttl seconds unless ttl is 0. Needs the write lock.
+    // Returns the position to commit the write-ahead log up to once the lock is released, or 0 if there is no log.
+    uint64_t insertLocked(const string &key, const ValueBuffer &value, unsigned long ttl) {
+        ++generation;
+        uint64_t expiry = ttl ? nowMillis() + ttl * 1000 : 0;
+        if (ttl) {
+            setExpiry(key, expiry);
+        } else if (!expiries.empty()) {
+            expiries.erase(key);
+        }
+        CacheItem *item = cacheFind(key);
+        if (item == nullptr) { // a cached key is in the index already
+            indexInsert(key);
+        }
+        if (!cacheable(key, value)) { // cache is disabled or value is too large, spill to disk directly
+            cacheErase(key);
+            addPending(key, value, false);
+        } else if (item != nullptr) { // key exists in cache
+            cacheUpdate(item, value);
+        } else { // key does not exist in cache
+            cacheAdd(key, value, true);
+        }
+        return wal != nullptr ? wal->append(WAL_PUT, key, value.data(), value.size(), ttl ? toWallMillis(expiry) : 0) : 0;
+    }
+
+    // Delete a key-value pair. Needs the write lock.
+    // Returns the position to commit the write-ahead log up to once the lock is released, or 0 if there is no log.
+    uint64_t removeLocked(const string &key) {
+        ++generation;
+        indexErase(key);
+        if (!expiries.empty()) {
+            expiries.erase(key);
+        }
+        cacheErase(key);
+        addPending(key, ValueBuffer(), true);
+        return wal != nullptr ? wal->append(WAL_DELETE, key, nullptr, 0, 0) : 0;
+    }
+
+    // Add a key to the index and charge its node to the cache budget. Needs the write lock, unless the shard is
+    // not shared yet.
+    inline void indexInsert(const string &key) {
+        if (index.insert(key).second) {
+            indexBytes.store(indexBytes.load(std::memory_order_relaxed) + indexCharge(key.size()), std::memory_order_relaxed);
+            charge(indexCharge(key.size()));
+        }
+    }
+
+    // Remove a key from the index and discharge its node. Needs the write lock.
+    inline void indexErase(const string &key) {
+        if (index.erase(key)) {
+            indexBytes.store(indexBytes.load(std::memory_order_relaxed) - indexCharge(key.size()), std::memory_order_relaxed);
+            discharge(indexCharge(key.size()));
+        }
+    }
+
+    // Wait until the write-ahead log holds every write up to a position returned by insertLocked or removeLocked,
+    // as durably as its policy says. Must not hold the shard lock.
+    inline void commit(uint64_t position) {
+        if (position) {
+            wal->commit(position);
+        }
+    }
+
+    // Redo a write read back from the write-ahead log. Needs the write lock, and the log must not be open yet.
+    void replay(WalRecord &record) {
+        switch (record.type) {
+          case WAL_PUT:
+            insertLocked(record.key, ValueBuffer(std::move(record.value)), 0);
+            if (record.expiry) {
+                setExpiry(record.key, fromWallMillis(record.expiry)); // Removed by the expirer soon if it is past.
+            }
+            break;
+          case WAL_DELETE:
+            removeLocked(record.key);
+            break;
+          case WAL_EXPIRY:
+            if (index.count(record.key)) {
+                setExpiry(record.key, fromWallMillis(record.expiry));
+            }
+            break;
+        }
+    }
+
+    // Add a value a lookup read from disk to the cache, if it fits. Takes the write lock, and skips the key if the
+    // shard has been modified since readGeneration, when the lookup missed the cache, in which case the value
+    // may be stale. Another lookup of the same key may have cached it in between, which does not modify the
+    // shard. Must not hold the shard lock.
+    void cacheRead(const string &key, const ValueBuffer &value, unsigned long readGeneration) {
+        if (!cacheable(key, value)) {
+            return;
+        }
+        pthread_rwlock_wrlock(&rw_lock);
+        if (generation == readGeneration && cacheFind(key) == nullptr) {
+            cacheAdd(key, value, false);
+        }
+        pthread_rwlock_unlock(&rw_lock);
+        waitForFlusher();
+    }
+
+    // Add a key that is not in the cache yet, evicting other keys if the cache is full. Needs the write lock.
+    void cacheAdd(const string &key, const ValueBuffer &value, bool dirty) {
+        CacheItem *item = makeItem(key.data(), key.size(), value);
+        item->dirty = dirty;
+        linkItem(item);
+        shrinkToBudget();
+    }
+
+    // Replace the value of a key already in the cache. Needs the write lock.
+    void cacheUpdate(CacheItem *item, const ValueBuffer &value) {
+        // An inline value is overwritten in place if it keeps its size and nothing else refers to the item,
+        // which cannot change meanwhile, since taking a reference needs the lock. Otherwise the item is
+        // replaced, and the old one lives on until the last reference to it is gone.
+        if (item->external() && value.size() > INLINE_VALUE_MAX) {
+            discharge(itemCharge(item->keyLength, item->valueLength));
+            *item->externalValue() = value;
+            item->valueLength = value.size();
+            charge(itemCharge(item->keyLength, item->valueLength));
+        } else if (!item->external() && item->valueLength == value.size() &&
+                   item->refs.load(std::memory_order_acquire) == 1) {
+            memcpy(item->key() + item->keyLength, value.data(), value.size());
+        } else {
+            CacheItem *replacement = makeItem(item->key(), item->keyLength, value);
+            unlinkItem(item);
+            dropItem(item);
+            item = replacement;
+            linkItem(item);
+        }
+        item->dirty = true;
+        item->referenced.store(true, std::memory_order_relaxed);
+        shrinkToBudget();
+    }
+
+    // Remove a key from the cache if it is there. Needs the write lock.
+    void cacheErase(const string &key) {
+        CacheItem *item = cacheFind(key);
+        if (item != nullptr) {
+            unlinkItem(item);
+            dropItem(item);
+        }
+    }
+
+    // Append the keys of the cache, most recently used first: those referenced since the hand last passed
+    // them, and then the others, each from the newest to the oldest on the ring. Needs the read lock.
+    void hotKeys(std::vector<string> &keys) {
+        if (hand == nullptr) {
+            return;
+        }
+        for (bool referenced : {true, false}) {
+            CacheItem *item = hand;
+            do {
+                item = item->clockPrev;
+                if (item->referenced.load(std::memory_order_relaxed) == referenced) {
+                    keys.emplace_back(item->key(), item->keyLength);
+                }
+            } while (item != hand);
+        }
+    }
+
+    // Read a key from disk into the cache, unless it is in memory already or expired, as long as it fits in
+    // what is left of the budget, so warming up the cache never evicts what the requests brought in.
+    // Once the cache is full, returns without reading. Takes the locks itself.
+    void prefetch(const string &key) {
+        if (residentBytes.load(std::memory_order_relaxed) + itemCharge(key.size(), 0) > cacheBytes) {
+            return;
+        }
+        pthread_rwlock_rdlock(&rw_lock);
+        if (cacheFind(key) != nullptr || pending.count(key) || (!expiries.empty() && expired(key))) {
+            pthread_rwlock_unlock(&rw_lock);
+            return;
+        }
+        unsigned long readGeneration = generation;
+        pthread_rwlock_unlock(&rw_lock);
+        string str;
+        bool found = !disk->read(key, str); // without the lock, as in lookup
+        ShardCounters::bump(counters.diskReads);
+        if (!found) {
+            return;
+        }
+        ValueBuffer value(std::move(str));
+        pthread_rwlock_wrlock(&rw_lock);
+        if (cacheable(key, value) && generation == readGeneration && cacheFind(key) == nullptr && // as in lookup
+            residentBytes.load(std::memory_order_relaxed) + itemCharge(key.size(), value.size()) <= cacheBytes) {
+            cacheAdd(key, value, false);
+            ShardCounters::bump(counters.warmed);
+        }
+        pthread_rwlock_unlock(&rw_lock);
+    }
+
+    // Evict entries until the cache fits in its byte budget. Needs the write lock.
+    void shrinkToBudget() {
+        while (residentBytes.load(std::memory_order_relaxed) > cacheBytes && hand != nullptr) { // cache is full
+            evictOne();
+        }
+    }
+
+    // Pop one item in cache, and hand it to the flusher if it is dirty. Needs the write lock.
+    void evictOne() {
+        while (true) {
+            CacheItem *item = hand;
+            hand = item->clockNext;
+            if (item->referenced.load(std::memory_order_relaxed)) { // give it a second chance
+                item->referenced.store(false, std::memory_order_relaxed);
+                continue;
+            }
+            if (item->dirty) { // The pending write shares the value, so the item stays alive until it is flushed.
+                addPending(string(item->key(), item->keyLength), item->valueBuffer(), false);
+            }
+            unlinkItem(item);
+            dropItem(item);
+            ShardCounters::bump(counters.evictions);
+            return;
+        }
+    }
+
+    // Queue a write (or delete, if deleted is true) of a key to disk, replacing any older pending write of the key.
+    // Needs the write lock.
+    void addPending(const string &key, const ValueBuffer &value, bool deleted) {
+        auto res = pending.emplace(key, PendingWrite());
+        PendingWrite &write = res.first->second;
+        write.value = value;
+        write.deleted = deleted;
+        write.seq = ++pendingSeq;
+        if (res.second && numPending.fetch_add(1, std::memory_order_relaxed) == 0) { // wake up the flusher
+            pthread_mutex_lock(&flusher->lock);
+            pthread_cond_signal(&flusher->work);
+            pthread_mutex_unlock(&flusher->lock);
+        }
+    }
+
+    // Block while the shard has too many pending writes, so the flusher can keep up. Must not hold the shard lock.
+    void waitForFlusher() {
+        if (numPending.load(std::memory_order_relaxed) <= dirtyLimit) {
+            return;
+        }
+        pthread_mutex_lock(&flusher->lock);
+        while (numPending.load(std::memory_order_relaxed) > dirtyLimit && flusher->running->load()) {
+            pthread_cond_wait(&flusher->space, &flusher->lock);
+        }
+        pthread_mutex_unlock(&flusher->lock);
+    }
+
+    // Remove the keys whose TTL has run out, like remove does, so they are also deleted from disk. Called by
+    // the expirer. The write lock is taken once to advance the timer wheel and then once per batch of keys,
+    // so it is never held for long. Returns the number of keys removed.
+    size_t expire() {
+        std::vector<TimerEntry> due;
+        uint64_t now = nowMillis();
+        pthread_rwlock_wrlock(&rw_lock);
+        wheel.advance(now / 1000, due);
+        pthread_rwlock_unlock(&rw_lock);
+        size_t removed = 0;
+        for (size_t begin = 0; begin < due.size(); begin += EXPIRY_BATCH_SIZE) {
+            pthread_rwlock_wrlock(&rw_lock);
+            for (size_t i = begin; i < due.size() && i < begin + EXPIRY_BATCH_SIZE; ++i) {
+                // Keys removed, or inserted again with another TTL or none, since they were added to the wheel are skipped.
+                auto it = expiries.find(due[i].key);
+                if (it != expiries.end() && it->second <= now) {
+                    removeLocked(due[i].key);
+                    ++removed;
+                }
+            }
+            pthread_rwlock_unlock(&rw_lock);
+            waitForFlusher();
+        }
+        ShardCounters::bump(counters.expirations, removed);
+        return removed;
+    }
+
+    // Make everything in the write-ahead log durable on disk, and delete the log files. Called by the checkpointer.
+    //
+    // Under the write lock, the log is switched to a new file, which starts with the expiry times of the keys,
+    // and the pending writes and the dirty items are taken, just like a flush takes pending writes. They are
+    // written to disk and synced without the lock, and then the log files before the new one are deleted.
+    // The flush lock is held throughout, so the flusher does not write a newer value of a key meanwhile, which
+    // an older one taken here would overwrite. What was written is then no longer dirty or pending, unless it
+    // has been replaced meanwhile.
+    void checkpoint() {
+        std::vector<FlushItem> writes;
+        std::vector<std::pair<string, ValueBuffer>> dirtyItems;
+        pthread_mutex_lock(&flush_lock);
+        pthread_rwlock_wrlock(&rw_lock);
+        uint64_t oldSeq = wal->rotate();
+        for (const auto &ele : expiries) {
+            wal->append(WAL_EXPIRY, ele.first, nullptr, 0, toWallMillis(ele.second));
+        }
+        for (const auto &ele : pending) {
+            FlushItem item = {ele.first, ele.second.value, ele.second.deleted, ele.second.seq}; // Shares the value, no copy.
+            writes.push_back(std::move(item));
+        }
+        CacheItem *item = hand;
+        for (size_t i = numEntries.load(std::memory_order_relaxed); i > 0; --i, item = item->clockNext) {
+            if (item->dirty) {
+                dirtyItems.emplace_back(string(item->key(), item->keyLength), item->valueBuffer());
+            }
+        }
+        pthread_rwlock_unlock(&rw_lock);
+        // A pending write of a key is older than its dirty item, if it has both.
+        for (const FlushItem &write : writes) {
+            if (write.deleted ? disk->remove(write.key) : disk->write(write.key, write.value.data(), write.value.size())) {
+                fprintf(stderr, "Error on writing to disk. Terminating.\n");
+                exit(-1);
+            }
+            ShardCounters::bump(write.deleted ? counters.diskDeletes : counters.diskWrites);
+        }
+        for (const auto &dirty : dirtyItems) {
+            if (disk->write(dirty.first, dirty.second.data(), dirty.second.size())) {
+                fprintf(stderr, "Error on writing to disk. Terminating.\n");
+                exit(-1);
+            }
+            ShardCounters::bump(counters.diskWrites);
+        }
+        wal->flush(true); // the expiry times
+        if (disk->sync()) {
+            fprintf(stderr, "Error on syncing the disk storage. Terminating.\n");
+            exit(-1);
+        }
+        wal->removeFiles(oldSeq);
+        pthread_rwlock_wrlock(&rw_lock);
+        for (const FlushItem &write : writes) {
+            auto it = pending.find(write.key);
+            if (it != pending.end() && it->second.seq == write.seq) {
+                pending.erase(it);
+                numPending.fetch_sub(1, std::memory_order_relaxed);
+            }
+        }
+        // The values taken keep their items alive, so an item with the same value is the one taken.
+        for (const auto &dirty : dirtyItems) {
+            CacheItem *cached = cacheFind(dirty.first);
+            if (cached != nullptr && cached->value() == dirty.second.data()) {
+                cached->dirty = false;
+            }
+            auto it = pending.find(dirty.first); // the item may have been evicted meanwhile
+            if (it != pending.end() && !it->second.deleted && it->second.value.data() == dirty.second.data()) {
+                pending.erase(it);
+                numPending.fetch_sub(1, std::memory_order_relaxed);
+            }
+        }
+        checkpointLogBytes = wal->size();
+        lastCheckpoint = nowMillis();
+        recovered = false;
+        pthread_rwlock_unlock(&rw_lock);
+        pthread_mutex_unlock(&flush_lock);
+        ShardCounters::bump(counters.checkpoints);
+    }
+
+    // Write one batch of pending writes to disk. Called by the flusher, without holding the shard lock.
+    // Returns the number of pending writes flushed.
+    size_t flush() {
+        std::vector<FlushItem> batch;
+        pthread_mutex_lock(&flush_lock);
+        pthread_rwlock_rdlock(&rw_lock);
+        for (const auto &ele : pending) {
+            if (batch.size() == FLUSH_BATCH_SIZE) {
+                break;
+            }
+            FlushItem item = {ele.first, ele.second.value, ele.second.deleted, ele.second.seq}; // Shares the value, no copy.
+            batch.push_back(std::move(item));
+        }
+        pthread_rwlock_unlock(&rw_lock);
+        for (const FlushItem &item : batch) {
+            if (item.deleted ? disk->remove(item.key) : disk->write(item.key, item.value.data(), item.value.size())) {
+                fprintf(stderr, "Error on writing to disk. Terminating.\n");
+                exit(-1);
+            }
+            ShardCounters::bump(item.deleted ? counters.diskDeletes : counters.diskWrites);
+        }
+        // The writes are on disk now, so they no longer need to be served from memory,
+        // unless they have been replaced by newer ones meanwhile.
+        pthread_rwlock_wrlock(&rw_lock);
+        for (const FlushItem &item : batch) {
+            auto it = pending.find(item.key);
+            if (it != pending.end() && it->second.seq == item.seq) {
+                pending.erase(it);
+                numPending.fetch_sub(1, std::memory_order_relaxed);
+            }
+        }
+        pthread_rwlock_unlock(&rw_lock);
+        pthread_mutex_unlock(&flush_lock);
+        return batch.size();
+    }
+
+    std::vector<CacheItem *> buckets; // Hash table of the cache. Its size is a power of two.
+    unsigned int bucketBits; // Log2 of the number of buckets.
+    CacheItem *hand; // The CLOCK hand: the next item considered for eviction, or null if the cache is empty.
+    SlabAllocator *slabs; // Where the items are allocated. Given up, not deleted, with the shard.
+    std::unordered_map<string, PendingWrite> pending; // Writes waiting for the flusher.
+    // Every key of the shard, whether it is in the cache, pending or only on disk, in order. Its nodes are charged to
+    // the cache budget, so a shard with many keys on disk caches fewer values instead of outgrowing its budget.
+    std::set<string> index;
+    std::unordered_map<string, uint64_t> expiries; // Expiry times of the keys with a TTL, in milliseconds of nowMillis.
+    TimerWheel wheel; // The keys with a TTL, by the second they expire in.
+    DiskStore *const disk; // Disk tier of this shard. Owned by the shard.
+    const size_t cacheBytes; // Byte budget of the cache of this shard.
+    const size_t dirtyLimit; // Max number of pending writes before writers have to wait for the flusher.
+    unsigned long generation; // Increased by every insert or remove. Lets lookup detect changes while it read from disk.
+    unsigned long pendingSeq;
+    Flusher *flusher; // The flusher that owns this shard.
+    WriteAheadLog *wal; // The write-ahead log of the shard, or null if the storage is not durable. Owned by the shard.
+    uint64_t lastCheckpoint; // Time of the last checkpoint, in milliseconds of nowMillis.
+    uint64_t checkpointLogBytes; // Size of the log file right after the last checkpoint.
+    bool recovered; // Whether log files replayed when the storage was opened are still there.
+    // Memory accounting. Only modified under the write lock, but can be read at any time without locking.
+    std::atomic<size_t> residentBytes;
+    std::atomic<size_t> indexBytes; // The part of residentBytes taken by the index.
+    std::atomic<size_t> numEntries;
+    std::atomic<size_t> numPending;
+    ShardCounters counters;
     pthread_rwlock_t rw_lock;
+    pthread_mutex_t flush_lock; // Serializes disk writes of the shard, so they reach the disk in order.
+
+  private:
+    inline void charge(size_t bytes) {
+        residentBytes.store(residentBytes.load(std::memory_order_relaxed) + bytes, std::memory_order_relaxed);
+    }
+
+    inline void discharge(size_t bytes) {
+        residentBytes.store(residentBytes.load(std::memory_order_relaxed) - bytes, std::memory_order_relaxed);
+    }
+
+    // The bucket of a key: the top bits of its hash, which depend on all of its bytes.
+    inline size_t bucketOf(const char *key, size_t keyLength) const {
+        return hashBytes(key, keyLength) >> (64 - bucketBits);
+    }
+
+    // Number of bytes of an item.
+    static inline size_t itemSize(size_t keyLength, size_t valueLength) {
+        return sizeof(CacheItem) + keyLength + (valueLength > INLINE_VALUE_MAX ? sizeof(ValueBuffer) : valueLength);
+    }
+
+    // Number of bytes a key in the index is charged against the cache budget: the node of the tree (its three links
+    // and color), the string, and the key itself if it is too long to be stored inside the string.
+    static inline size_t indexCharge(size_t keyLength) {
+        static const size_t inlineKeyMax = string().capacity();
+        return 4 * sizeof(void *) + sizeof(string) + (keyLength > inlineKeyMax ? keyLength + 1 : 0);
+    }
+
+    // Number of bytes a key-value pair is charged against the cache budget: the memory its item really takes,
+    // and its value if that is not inline.
+    inline size_t itemCharge(size_t keyLength, size_t valueLength) const {
+        size_t size = itemSize(keyLength, valueLength);
+        size_t chunk = slabs->chunkSize(size);
+        return (chunk ? chunk : size) + sizeof(CacheItem *) + (valueLength > INLINE_VALUE_MAX ? valueLength : 0);
+    }
+
+    // Make a new item holding a copy of a key-value pair, with one reference, which is the cache's.
+    CacheItem *makeItem(const char *key, size_t keyLength, const ValueBuffer &value) {
+        size_t size = itemSize(keyLength, value.size());
+        void *mem = slabs->allocate(size);
+        CacheItem *item;
+        if (mem != nullptr) {
+            item = new (mem) CacheItem(VALUE_SLAB);
+        } else { // too large for any slab class
+            mem = malloc(size);
+            if (mem == nullptr) {
+                throw std::bad_alloc();
+            }
+            item = new (mem) CacheItem(VALUE_HEAP);
+        }
+        item->keyLength = keyLength;
+        item->valueLength = value.size();
+        memcpy(item->key(), key, keyLength);
+        if (item->external()) {
+            new (item->externalValue()) ValueBuffer(value);
+        } else {
+            memcpy(item->key() + keyLength, value.data(), value.size());
+        }
+        return item;
+    }
+
+    // Drop the cache's reference to an item taken out of the cache.
+    static inline void dropItem(CacheItem *item) {
+        if (item->external()) { // nothing else refers to the item, only to its value
+            item->externalValue()->~ValueBuffer();
+        }
+        item->unref();
+    }
+
+    // Put an item in the hash table, and on the ring right behind the hand. Needs the write lock.
+    void linkItem(CacheItem *item) {
+        if (numEntries.load(std::memory_order_relaxed) >= buckets.size()) {
+            growTable();
+        }
+        CacheItem *&bucket = buckets[bucketOf(item->key(), item->keyLength)];
+        item->hashNext = bucket;
+        bucket = item;
+        if (hand == nullptr) {
+            item->clockPrev = item->clockNext = item;
+            hand = item;
+        } else {
+            item->clockPrev = hand->clockPrev;
+            item->clockNext = hand;
+            hand->clockPrev->clockNext = item;
+            hand->clockPrev = item;
+        }
+        charge(itemCharge(item->keyLength, item->valueLength));
+        numEntries.store(numEntries.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    // Take an item out of the hash table and the ring. The caller drops the cache's reference. Needs the write lock.
+    void unlinkItem(CacheItem *item) {
+        CacheItem **link = &buckets[bucketOf(item->key(), item->keyLength)];
+        while (*link != item) {
+            link = &(*link)->hashNext;
+        }
+        *link = item->hashNext;
+        if (item->clockNext == item) { // last item
+            hand = nullptr;
+        } else {
+            if (hand == item) {
+                hand = item->clockNext;
+            }
+            item->clockPrev->clockNext = item->clockNext;
+            item->clockNext->clockPrev = item->clockPrev;
+        }
+        discharge(itemCharge(item->keyLength, item->valueLength));
+        numEntries.store(numEntries.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+    }
+
+    // Double the number of buckets. Needs the write lock.
+    void growTable() {
+        std::vector<CacheItem *> old(buckets.size() * 2, nullptr);
+        old.swap(buckets);
+        ++bucketBits;
+        for (CacheItem *item : old) {
+            while (item != nullptr) {
+                CacheItem *next = item->hashNext;
+                CacheItem *&bucket = buckets[bucketOf(item->key(), item->keyLength)];
+                item->hashNext = bucket;
+                bucket = item;
+                item = next;
+            }
+        }
+    }
+};
+
+// The work of parallelFor.
+struct ParallelWork {
+    const std::function<void(size_t)> *func;
+    std::atomic<size_t> next;
+    size_t n;
 };
 
-ThreadSafeKVStore::ThreadSafeKVStore(std::string storagePath, unsigned int cacheSize) {
-    pImpl_ = new ThreadSafeKVStoreImpl(storagePath, cacheSize);
+static void *parallelRoutine(void *obj) {
+    ParallelWork *work = (ParallelWork *) obj;
+    for (size_t i = work->next.fetch_add(1); i < work->n; i = work->next.fetch_add(1)) {
+        (*work->func)(i);
+    }
+    return nullptr;
+}
+
+// Call a function on 0, 1, ..., n - 1, with as many threads as there are processors, but at most n.
+static void parallelFor(size_t n, const std::function<void(size_t)> &func) {
+    ParallelWork work;
+    work.func = &func;
+    work.next = 0;
+    work.n = n;
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    std::vector<pthread_t> threads(std::min(n, (size_t) std::max(processors, 1L)));
+    for (pthread_t &tid : threads) {
+        if (pthread_create(&tid, nullptr, parallelRoutine, (void *) &work)) {
+            fprintf(stderr, "pthread_create failed. Terminating.\n");
+            exit(-1);
+        }
+    }
+    for (pthread_t &tid : threads) {
+        pthread_join(tid, nullptr);
+    }
+}
+
+// Append a number to a string in 7 bits per byte, the low bits first, so short lengths take a single byte.
+static void putVarint(std::string &out, uint64_t n) {
+    while (n >= 0x80) {
+        out += (char) (n | 0x80);
+        n >>= 7;
+    }
+    out += (char) n;
+}
+
+// Read a number written by putVarint at pos, and move pos past it. Returns 0 on success, or -1 if the
+// string ends before the number does.
+static int getVarint(const std::string &in, size_t &pos, uint64_t &n) {
+    n = 0;
+    for (int shift = 0; pos < in.size() && shift < 64; shift += 7) {
+        unsigned char c = in[pos++];
+        n |= (uint64_t) (c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+class ThreadSafeKVStoreImpl {
+  public:
+    ThreadSafeKVStoreImpl(std::string _storagePath, size_t _cacheBytes, unsigned int _numShards, DiskEngine engine,
+                          unsigned int numFlushers, size_t dirtyLimit, double filterFpr, size_t filterMaxBytes,
+                          WalSyncPolicy _walPolicy, unsigned int _walSyncMillis, unsigned int _checkpointInterval)
+        : storagePath(_storagePath), walPath(_storagePath + "/" WAL_DIR), cacheBytes(_cacheBytes), walPolicy(_walPolicy),
+          walSyncMillis(_walSyncMillis ? _walSyncMillis : 1), checkpointInterval(_checkpointInterval), running(true),
+          warm(true), lastHotSet(nowMillis()), nextWarmKey(0), warmersLeft(0) {
+        // Without a log, what is on disk misses what was in memory, so a storage that is not durable starts empty.
+        bool durable = walPolicy != WAL_OFF;
+        uint64_t start = nowMillis();
+        pthread_mutex_init(&hotSetLock, nullptr);
+        if (durable ? makeDir(storagePath) || makeDir(walPath) : initDir(storagePath)) {
+            fprintf(stderr, "Disk storage initialization failed. Terminating.\n");
+            exit(-1);
+        }
+        checkFormat(_numShards, engine);
+        // The cache budget is split evenly among the shards. The disk tiers of the shards load what they already
+        // hold in parallel, and so does the ordered index of the keys, which has every key on disk.
+        size_t shardCacheBytes = _cacheBytes / _numShards;
+        shards.resize(_numShards, nullptr);
+        parallelFor(_numShards, [&](size_t i) {
+            std::string shardPath = storagePath + "/" + std::to_string(i);
+            if (makeDir(shardPath)) {
+                fprintf(stderr, "Disk storage initialization failed. Terminating.\n");
+                exit(-1);
+            }
+            Shard *shard = new Shard(makeDiskStore(engine, shardPath, filterFpr, filterMaxBytes / _numShards),
+                                     shardCacheBytes, dirtyLimit);
+            if (durable && shard->disk->forEachKey([shard](const std::string &key) { shard->indexInsert(key); })) {
+                fprintf(stderr, "Error on listing the keys on disk. Terminating.\n");
+                exit(-1);
+            }
+            shards[i] = shard;
+        });
+        // Every shard is owned by one flusher, so the writes of a shard reach the disk in order.
+        for (unsigned int i = 0; i < numFlushers; ++i) {
+            Flusher *flusher = new Flusher;
+            pthread_mutex_init(&flusher->lock, nullptr);
+            pthread_cond_init(&flusher->work, nullptr);
+            pthread_cond_init(&flusher->space, nullptr);
+            flusher->running = &running;
+            flushers.push_back(flusher);
+        }
+        for (unsigned int i = 0; i < _numShards; ++i) {
+            shards[i]->flusher = flushers[i % numFlushers];
+            flushers[i % numFlushers]->shards.push_back(shards[i]);
+        }
+        for (Flusher *flusher : flushers) {
+            if (pthread_create(&flusher->tid, nullptr, flusherRoutine, (void *) flusher)) {
+                fprintf(stderr, "pthread_create failed. Terminating.\n");
+                exit(-1);
+            }
+        }
+        if (durable) {
+            unsigned long replayed = recover(); // The flushers are running, so the replayed writes can be evicted as usual.
+            unsigned long keys = 0;
+            for (Shard *shard : shards) {
+                keys += shard->index.size();
+            }
+            printf("Recovered %lu keys, replaying %lu log records, in %.3f seconds.\n", keys, replayed,
+                   (nowMillis() - start) / 1000.0);
+            fflush(stdout);
+            // The keys that were in the cache when the hot set was last saved are read back into it in the
+            // background, while the storage is already in use.
+            if (cacheBytes && !loadHotSet()) {
+                warm = false;
+                warmStart = nowMillis();
+                warmersLeft = WARMUP_THREADS;
+                warmers.resize(WARMUP_THREADS);
+                for (pthread_t &tid : warmers) {
+                    if (pthread_create(&tid, nullptr, warmerStarter, (void *) this)) {
+                        fprintf(stderr, "pthread_create failed. Terminating.\n");
+                        exit(-1);
+                    }
+                }
+            }
+        }
+        if (pthread_create(&compactor, nullptr, compactorStarter, (void *) this)) {
+            fprintf(stderr, "pthread_create failed. Terminating.\n");
+            exit(-1);
+        }
+        if (pthread_create(&expirer, nullptr, expirerStarter, (void *) this)) {
+            fprintf(stderr, "pthread_create failed. Terminating.\n");
+            exit(-1);
+        }
+        if (durable && (pthread_create(&checkpointer, nullptr, checkpointerStarter, (void *) this) ||
+                        pthread_create(&walSyncer, nullptr, walSyncerStarter, (void *) this))) {
+            fprintf(stderr, "pthread_create failed. Terminating.\n");
+            exit(-1);
+        }
+    }
+
+    // Check that the storage was made with the same number of shards and disk engine, since keys are stored
+    // by shard and by engine, or record them if the storage is new.
+    void checkFormat(unsigned int numShards, DiskEngine engine) {
+        std::string format = "shards=" + std::to_string(numShards) + " engine=" + (engine == LOG_STRUCTURED ? "log" : "file") + "\n";
+        std::string path = storagePath + "/" FORMAT_FILE;
+        std::string old;
+        if (!readFile(path, old)) {
+            if (old != format) {
+                fprintf(stderr, "Storage %s was made with %.*s, not with %.*s. Terminating.\n", storagePath.c_str(),
+                        (int) old.size() - 1, old.c_str(), (int) format.size() - 1, format.c_str());
+                exit(-1);
+            }
+        } else if (writeFile(path, format)) {
+            fprintf(stderr, "Disk storage initialization failed. Terminating.\n");
+            exit(-1);
+        }
+    }
+
+    // Replay the write-ahead log of every shard, in parallel, and start a new log file for each. The files
+    // replayed are deleted by the first checkpoint of the shard. Returns the number of records replayed.
+    unsigned long recover() {
+        std::atomic<unsigned long> replayed(0);
+        parallelFor(shards.size(), [&](size_t i) {
+            Shard *shard = shards[i];
+            uint64_t lastSeq;
+            replayed += WriteAheadLog::replay(walPath, i, [shard](WalRecord &record) {
+                pthread_rwlock_wrlock(&shard->rw_lock);
+                shard->replay(record);
+                pthread_rwlock_unlock(&shard->rw_lock);
+                shard->waitForFlusher();
+            }, lastSeq);
+            shard->wal = new WriteAheadLog(walPath, i, lastSeq + 1, walPolicy);
+            shard->recovered = lastSeq > 0;
+        });
+        return replayed.load();
+    }
+
+    // Save the keys of the cache of every shard, hottest first, as the hot set, so the next start can read
+    // them back into the cache. Only the keys are saved, since the values are on disk or in the logs.
+    // Format: [crc32 (4 bytes)][number of shards (4 bytes)], then for every shard [number of keys (4 bytes)]
+    // and its keys, each as [length (varint)][key]. The crc32 covers everything after itself. The file is
+    // replaced at once, so a crash leaves either the old or the new one. Returns 0 on success, or -1.
+    int saveHotSet() {
+        if (walPolicy == WAL_OFF || !warm) { // A warm-up cut short would leave a poorer hot set than the last one.
+            return -1;
+        }
+        std::string content(2 * sizeof(uint32_t), '\0');
+        std::vector<string> keys;
+        uint32_t n = shards.size();
+        memcpy(&content[sizeof(uint32_t)], &n, sizeof(n));
+        for (Shard *shard : shards) {
+            keys.clear();
+            pthread_rwlock_rdlock(&shard->rw_lock);
+            shard->hotKeys(keys);
+            pthread_rwlock_unlock(&shard->rw_lock);
+            n = keys.size();
+            content.append((const char *) &n, sizeof(n));
+            for (const string &key : keys) {
+                putVarint(content, key.size());
+                content += key;
+            }
+        }
+        uint32_t crc = crc32(content.data() + sizeof(uint32_t), content.size() - sizeof(uint32_t));
+        memcpy(&content[0], &crc, sizeof(crc));
+        std::string path = storagePath + "/" HOTSET_FILE;
+        std::string tmpPath = path + ".tmp";
+        pthread_mutex_lock(&hotSetLock);
+        int ret = writeFile(tmpPath, content) || rename(tmpPath.c_str(), path.c_str()) ? -1 : 0;
+        pthread_mutex_unlock(&hotSetLock);
+        if (ret) {
+            fprintf(stderr, "Error on saving the hot set to %s.\n", path.c_str());
+        }
+        return ret;
+    }
+
+    // Read the hot set saved by saveHotSet into hotSet, interleaving the shards, so the hottest keys of every
+    // shard come first. Returns 0 on success, or -1 if there is no valid hot set of this number of shards.
+    int loadHotSet() {
+        std::string content;
+        if (readFile(storagePath + "/" HOTSET_FILE, content) || content.size() < 2 * sizeof(uint32_t)) {
+            return -1;
+        }
+        uint32_t crc, n;
+        memcpy(&crc, &content[0], sizeof(crc));
+        memcpy(&n, &content[sizeof(uint32_t)], sizeof(n));
+        if (crc != crc32(content.data() + sizeof(uint32_t), content.size() - sizeof(uint32_t)) || n != shards.size()) {
+            fprintf(stderr, "Ignored the hot set, which is corrupt or of another number of shards.\n");
+            return -1;
+        }
+        std::vector<std::vector<string>> keys(n);
+        size_t pos = 2 * sizeof(uint32_t);
+        for (auto &shardKeys : keys) {
+            if (pos + sizeof(n) > content.size()) {
+                return -1;
+            }
+            memcpy(&n, &content[pos], sizeof(n));
+            pos += sizeof(n);
+            shardKeys.resize(n);
+            for (string &key : shardKeys) {
+                uint64_t length;
+                if (getVarint(content, pos, length) || length > content.size() - pos) {
+                    return -1;
+                }
+                key.assign(content, pos, length);
+                pos += length;
+            }
+        }
+        hotSet.clear();
+        for (size_t i = 0, left = 1; left; ++i) {
+            left = 0;
+            for (unsigned int shard = 0; shard < keys.size(); ++shard) {
+                if (i < keys[shard].size()) {
+                    hotSet.emplace_back(shard, std::move(keys[shard][i]));
+                    ++left;
+                }
+            }
+        }
+        return 0;
+    }
+
+    ~ThreadSafeKVStoreImpl() {
+        running = false;
+        for (Flusher *flusher : flushers) {
+            pthread_mutex_lock(&flusher->lock);
+            pthread_cond_broadcast(&flusher->work);
+            pthread_cond_broadcast(&flusher->space);
+            pthread_mutex_unlock(&flusher->lock);
+            pthread_join(flusher->tid, nullptr);
+            pthread_mutex_destroy(&flusher->lock);
+            pthread_cond_destroy(&flusher->work);
+            pthread_cond_destroy(&flusher->space);
+            delete flusher;
+        }
+        pthread_join(compactor, nullptr);
+        pthread_join(expirer, nullptr);
+        for (pthread_t &tid : warmers) {
+            pthread_join(tid, nullptr);
+        }
+        if (walPolicy != WAL_OFF) {
+            pthread_join(checkpointer, nullptr);
+            pthread_join(walSyncer, nullptr);
+            saveHotSet();
+        }
+        pthread_mutex_destroy(&hotSetLock);
+        for (Shard *shard : shards) {
+            delete shard;
+        }
+    }
+
+    // The routine of a flusher thread.
+    static void *flusherRoutine(void *obj) {
+        Flusher *flusher = (Flusher *) obj;
+        while (flusher->running->load()) {
+            size_t flushed = 0;
+            for (Shard *shard : flusher->shards) {
+                if (shard->numPending.load(std::memory_order_relaxed)) {
+                    flushed += shard->flush();
+                }
+            }
+            pthread_mutex_lock(&flusher->lock);
+            pthread_cond_broadcast(&flusher->space);
+            if (!flushed) {
+                bool idle = true;
+                for (Shard *shard : flusher->shards) {
+                    if (shard->numPending.load(std::memory_order_relaxed)) {
+                        idle = false;
+                    }
+                }
+                if (idle && flusher->running->load()) {
+                    pthread_cond_wait(&flusher->work, &flusher->lock);
+                }
+            }
+            pthread_mutex_unlock(&flusher->lock);
+        }
+        return nullptr;
+    }
+
+    // The routine of the background thread maintaining the disk tier of every shard.
+    void *compactorRoutine() {
+        while (running.load()) {
+            for (Shard *shard : shards) {
+                shard->disk->compact();
+            }
+            sleep(COMPACTION_INTERVAL);
+        }
+        return nullptr;
+    }
+
+    static void *compactorStarter(void *obj) {
+        return ((ThreadSafeKVStoreImpl *) obj)->compactorRoutine();
+    }
+
+    // The routine of the background thread removing expired keys from every shard.
+    void *expirerRoutine() {
+        while (running.load()) {
+            for (Shard *shard : shards) {
+                shard->expire();
+            }
+            sleep(EXPIRY_INTERVAL);
+        }
+        return nullptr;
+    }
+
+    static void *expirerStarter(void *obj) {
+        return ((ThreadSafeKVStoreImpl *) obj)->expirerRoutine();
+    }
+
+    // The routine of a thread warming up the cache. The threads take the keys of the hot set one by one,
+    // hottest first. The last one to finish marks the cache as warm.
+    void *warmerRoutine() {
+        for (size_t i = nextWarmKey.fetch_add(1); i < hotSet.size() && running.load(); i = nextWarmKey.fetch_add(1)) {
+            shards[hotSet[i].first]->prefetch(hotSet[i].second);
+        }
+        if (warmersLeft.fetch_sub(1) == 1) {
+            unsigned long warmed = 0;
+            for (Shard *shard : shards) {
+                warmed += shard->counters.warmed.load(std::memory_order_relaxed);
+            }
+            std::vector<std::pair<unsigned int, string>>().swap(hotSet);
+            warm = true;
+            printf("Warmed up the cache with %lu keys in %.3f seconds.\n", warmed, (nowMillis() - warmStart) / 1000.0);
+            fflush(stdout);
+        }
+        return nullptr;
+    }
+
+    static void *warmerStarter(void *obj) {
+        return ((ThreadSafeKVStoreImpl *) obj)->warmerRoutine();
+    }
+
+    // The routine of the background thread checkpointing the shards, each once its log has grown by
+    // CHECKPOINT_LOG_BYTES, or once checkpointInterval seconds have passed if anything was logged.
+    // The hot set is saved every checkpointInterval seconds too, once the cache is warm.
+    void *checkpointerRoutine() {
+        while (running.load()) {
+            if (nowMillis() - lastHotSet >= checkpointInterval * 1000UL) {
+                saveHotSet();
+                lastHotSet = nowMillis();
+            }
+            for (Shard *shard : shards) {
+                uint64_t logged = shard->wal->size() - shard->checkpointLogBytes;
+                if (shard->recovered || logged >= CHECKPOINT_LOG_BYTES ||
+                    (logged && nowMillis() - shard->lastCheckpoint >= checkpointInterval * 1000UL)) {
+                    shard->checkpoint();
+                }
+            }
+            sleep(CHECKPOINT_POLL);
+        }
+        return nullptr;
+    }
+
+    static void *checkpointerStarter(void *obj) {
+        return ((ThreadSafeKVStoreImpl *) obj)->checkpointerRoutine();
+    }
+
+    // The routine of the background thread writing what is left in the buffers of the logs, e.g. the deletes
+    // of expired keys, which nobody waits for, and syncing the logs with WAL_SYNC_INTERVAL.
+    void *walSyncerRoutine() {
+        while (running.load()) {
+            usleep(walSyncMillis * 1000);
+            for (Shard *shard : shards) {
+                shard->wal->flush(walPolicy != WAL_SYNC_NONE);
+            }
+        }
+        return nullptr;
+    }
+
+    static void *walSyncerStarter(void *obj) {
+        return ((ThreadSafeKVStoreImpl *) obj)->walSyncerRoutine();
+    }
+
+    inline unsigned int shardIndexOf(const string &key) {
+        return hasher(key) % shards.size();
+    }
+
+    inline Shard &shardOf(const string &key) {
+        return *shards[shardIndexOf(key)];
+    }
+
+    std::vector<Shard *> shards;
+    std::vector<Flusher *> flushers;
+    std::hash<string> hasher;
+    const std::string storagePath;
+    const std::string walPath;
+    const size_t cacheBytes;
+    const WalSyncPolicy walPolicy;
+    const unsigned int walSyncMillis; // Milliseconds between two syncs of the logs by the syncer.
+    const unsigned int checkpointInterval; // Max seconds between two checkpoints of a shard that logged anything.
+    std::atomic_bool running;
+    std::atomic_bool warm; // Whether the warm-up of the cache is over, or there was none.
+    uint64_t lastHotSet; // Time the hot set was last saved by the checkpointer, in milliseconds of nowMillis.
+    pthread_mutex_t hotSetLock; // Serializes the saves of the hot set.
+    uint64_t warmStart; // Time the warm-up started, in milliseconds of nowMillis.
+    std::vector<std::pair<unsigned int, string>> hotSet; // The keys to warm up the cache with, by shard, hottest first.
+    std::atomic<size_t> nextWarmKey; // Index in hotSet of the next key to be read by a warmer.
+    std::atomic<unsigned int> warmersLeft; // Number of warmers still running.
+    std::vector<pthread_t> warmers;
+    pthread_t compactor;
+    pthread_t expirer;
+    pthread_t checkpointer;
+    pthread_t walSyncer;
+};
+
+ThreadSafeKVStore::ThreadSafeKVStore(std::string storagePath, size_t cacheBytes, unsigned int numShards, DiskEngine engine,
+                                     unsigned int numFlushers, size_t dirtyLimit, double filterFpr, size_t filterMaxBytes,
+                                     WalSyncPolicy walPolicy, unsigned int walSyncMillis, unsigned int checkpointInterval) {
+    pImpl_ = new ThreadSafeKVStoreImpl(storagePath, cacheBytes, numShards ? numShards : 1, engine,
+                                       numFlushers ? numFlushers : 1, dirtyLimit, filterFpr, filterMaxBytes,
+                                       walPolicy, walSyncMillis, checkpointInterval);
 }
 
 ThreadSafeKVStore::~ThreadSafeKVStore() {
@@ -41,36 +1276,107 @@ ThreadSafeKVStore::~ThreadSafeKVStore() {
 
 int ThreadSafeKVStore::cacheWriteBack() {
     int ret = 0;
-    for (auto ele : pImpl_->store) {
-        if (writeFile(pImpl_->storagePath + "/" + ele.first, ele.second)) {
-            ret = -1;
+    for (Shard *shard : pImpl_->shards) {
+        pthread_mutex_lock(&shard->flush_lock);
+        pthread_rwlock_wrlock(&shard->rw_lock);
+        for (const auto &ele : shard->pending) {
+            if (ele.second.deleted ? shard->disk->remove(ele.first)
+                                   : shard->disk->write(ele.first, ele.second.value.data(), ele.second.value.size())) {
+                ret = -1;
+            }
+            ShardCounters::bump(ele.second.deleted ? shard->counters.diskDeletes : shard->counters.diskWrites);
+        }
+        shard->pending.clear();
+        shard->numPending = 0;
+        CacheItem *item = shard->hand;
+        for (size_t i = shard->numEntries.load(std::memory_order_relaxed); i > 0; --i, item = item->clockNext) {
+            if (item->dirty) {
+                if (shard->disk->write(string(item->key(), item->keyLength), item->value(), item->valueLength)) {
+                    ret = -1;
+                } else {
+                    item->dirty = false;
+                }
+                ShardCounters::bump(shard->counters.diskWrites);
+            }
         }
+        pthread_rwlock_unlock(&shard->rw_lock);
+        pthread_mutex_unlock(&shard->flush_lock);
     }
     return ret;
 }
 
+void ThreadSafeKVStore::getStats(KVStoreStats &stats) const {
+    stats.cacheEntries = 0;
+    stats.residentBytes = 0;
+    stats.indexBytes = 0;
+    stats.cacheBytes = pImpl_->cacheBytes;
+    stats.pendingWrites = 0;
+    stats.cacheHits = stats.cacheMisses = stats.evictions = 0;
+    stats.diskReads = stats.diskWrites = stats.diskDeletes = 0;
+    stats.expirations = 0;
+    stats.filterBytes = stats.filterNegatives = stats.filterFalsePositives = stats.filterRebuilds = 0;
+    stats.logRecords = stats.logWrites = stats.logSyncs = stats.logBytes = stats.checkpoints = 0;
+    stats.warmedKeys = 0;
+    stats.slabClasses.clear();
+    std::vector<SlabClassStats> slabStats;
+    for (Shard *shard : pImpl_->shards) {
+        const ShardCounters &c = shard->counters;
+        stats.cacheHits += c.hits.load(std::memory_order_relaxed);
+        stats.cacheMisses += c.misses.load(std::memory_order_relaxed);
+        stats.evictions += c.evictions.load(std::memory_order_relaxed);
+        stats.diskReads += c.diskReads.load(std::memory_order_relaxed);
+        stats.diskWrites += c.diskWrites.load(std::memory_order_relaxed);
+        stats.diskDeletes += c.diskDeletes.load(std::memory_order_relaxed);
+        stats.expirations += c.expirations.load(std::memory_order_relaxed);
+        stats.checkpoints += c.checkpoints.load(std::memory_order_relaxed);
+        stats.warmedKeys += c.warmed.load(std::memory_order_relaxed);
+        if (shard->wal != nullptr) {
+            stats.logRecords += shard->wal->records.load(std::memory_order_relaxed);
+            stats.logWrites += shard->wal->writes.load(std::memory_order_relaxed);
+            stats.logSyncs += shard->wal->syncs.load(std::memory_order_relaxed);
+            stats.logBytes += shard->wal->size();
+        }
+        DiskStoreStats diskStats;
+        shard->disk->getStats(diskStats);
+        stats.filterBytes += diskStats.filterBytes;
+        stats.filterNegatives += diskStats.filterNegatives;
+        stats.filterFalsePositives += diskStats.filterFalsePositives;
+        stats.filterRebuilds += diskStats.filterRebuilds;
+        stats.pendingWrites += shard->numPending.load(std::memory_order_relaxed);
+        stats.cacheEntries += shard->numEntries.load(std::memory_order_relaxed);
+        stats.residentBytes += shard->residentBytes.load(std::memory_order_relaxed);
+        stats.indexBytes += shard->indexBytes.load(std::memory_order_relaxed);
+        shard->slabs->getStats(slabStats); // Every shard has the same classes.
+        stats.slabClasses.resize(slabStats.size());
+        for (size_t i = 0; i < slabStats.size(); ++i) {
+            stats.slabClasses[i].chunkSize = slabStats[i].chunkSize;
+            stats.slabClasses[i].pages += slabStats[i].pages;
+            stats.slabClasses[i].chunks += slabStats[i].chunks;
+            stats.slabClasses[i].usedChunks += slabStats[i].usedChunks;
+        }
+    }
+}
+
+int ThreadSafeKVStore::saveHotSet() {
+    return pImpl_->saveHotSet();
+}
+
+bool ThreadSafeKVStore::ready() const {
+    return pImpl_->warm.load();
+}
+
 int ThreadSafeKVStore::insert(const string &key, const string &value) {
+    return insert(key, ValueBuffer(value.data(), value.size()));
+}
+
+int ThreadSafeKVStore::insert(const string &key, const ValueBuffer &value, unsigned long ttl) {
+    Shard &shard = pImpl_->shardOf(key);
     try {
-        pthread_rwlock_wrlock(&pImpl_->rw_lock);
-        if (pImpl_->store.count(key)) { // key exists in cache
-            pImpl_->cacheList.remove(key);
-            pImpl_->cacheList.push_back(key);
-            pImpl_->store[key] = value;
-        } else { // key does not exist in cache
-            pImpl_->cacheList.push_back(key);
-            pImpl_->store[key] = value;
-            if (pImpl_->cacheList.size() > pImpl_->cacheSize) { // cache is full
-                // pop one item in cache and write it back to disk.
-                if (writeFile(pImpl_->storagePath + "/" + pImpl_->cacheList.front(),
-                              pImpl_->store[pImpl_->cacheList.front()])) {
-                    fprintf(stderr, "Error on writing to disk. Terminating.\n");
-                    exit(-1);
-                }
-                pImpl_->store.erase(pImpl_->cacheList.front());
-                pImpl_->cacheList.pop_front();
-            }
-        }
-        pthread_rwlock_unlock(&pImpl_->rw_lock);
+        pthread_rwlock_wrlock(&shard.rw_lock);
+        uint64_t position = shard.insertLocked(key, value, ttl);
+        pthread_rwlock_unlock(&shard.rw_lock);
+        shard.commit(position);
+        shard.waitForFlusher();
     } catch(...) {
         return -1;
     }
@@ -78,45 +1384,307 @@ int ThreadSafeKVStore::insert(const string &key, const string &value) {
 }
 
 int ThreadSafeKVStore::lookup(const string &key, string &value) {
-    bool found = false;
-    pthread_rwlock_rdlock(&pImpl_->rw_lock);
-    if (pImpl_->store.find(key) != pImpl_->store.end()) { // key already in cache
-        found = true;
-        value = pImpl_->store.at(key);
-        pImpl_->cacheList.remove(key);
-        pImpl_->cacheList.push_back(key);
-    } else if (!readFile(pImpl_->storagePath + "/" + key, value)) { // key not in cache but on disk
-        found = true;
-        if (pImpl_->cacheSize) { // cache is not disabled
-            if (pImpl_->cacheList.size() == pImpl_->cacheSize) { // cache is full
-                // pop one item in cache and write it back to disk.
-                if (writeFile(pImpl_->storagePath + "/" + pImpl_->cacheList.front(),
-                              pImpl_->store[pImpl_->cacheList.front()])) {
-                    fprintf(stderr, "Error on writing to disk. Terminating.\n");
-                    exit(-1);
-                }
-                pImpl_->store.erase(pImpl_->cacheList.front());
-                pImpl_->cacheList.pop_front();
-            }
-            pImpl_->store[key] = value;
-            pImpl_->cacheList.push_back(key);
+    ValueBuffer buffer;
+    int ret = lookup(key, buffer);
+    if (!ret) {
+        value.assign(buffer.data(), buffer.size());
+    }
+    return ret;
+}
+
+int ThreadSafeKVStore::lookup(const string &key, ValueBuffer &value, bool *cached) {
+    Shard &shard = pImpl_->shardOf(key);
+    bool dummy;
+    if (cached == nullptr) {
+        cached = &dummy;
+    }
+    *cached = true;
+    pthread_rwlock_rdlock(&shard.rw_lock);
+    int ret = shard.lookupInMemory(key, value);
+    if (ret <= 0) {
+        pthread_rwlock_unlock(&shard.rw_lock);
+        ShardCounters::bump(shard.counters.hits);
+        return ret;
+    }
+    // Not pending, so no write of the key is in flight and the disk is up to date. The read is done without
+    // the lock, so writers do not wait for the disk. A write of the key meanwhile may or may not be seen,
+    // as the engines replace values atomically, but then it changes the generation, which keeps what was
+    // read out of the cache.
+    *cached = false;
+    unsigned long generation = shard.generation;
+    pthread_rwlock_unlock(&shard.rw_lock);
+    string str;
+    bool found = !shard.disk->read(key, str);
+    ShardCounters::bump(shard.counters.misses);
+    ShardCounters::bump(shard.counters.diskReads);
+    if (!found) {
+        return -1;
+    }
+    value = ValueBuffer(std::move(str));
+    shard.cacheRead(key, value, generation);
+    return 0;
+}
+
+int ThreadSafeKVStore::lookupStart(const string &key, ValueBuffer &value, bool *cached, DiskLookup &pending) {
+    Shard &shard = pImpl_->shardOf(key);
+    *cached = true;
+    pthread_rwlock_rdlock(&shard.rw_lock);
+    int ret = shard.lookupInMemory(key, value);
+    if (ret <= 0) {
+        pthread_rwlock_unlock(&shard.rw_lock);
+        ShardCounters::bump(shard.counters.hits);
+        return ret;
+    }
+    // Not pending, so the disk is up to date. Locating the value may touch the disk, so it is done without
+    // the lock, as a read in lookup is. The engine keeps the value it finds readable at its location.
+    *cached = false;
+    pending.generation = shard.generation;
+    pthread_rwlock_unlock(&shard.rw_lock);
+    ret = shard.disk->locate(key, pending.location);
+    if (ret > 0) {
+        return lookup(key, value, cached);
+    }
+    ShardCounters::bump(shard.counters.misses);
+    ShardCounters::bump(shard.counters.diskReads);
+    if (ret < 0) {
+        return -1;
+    }
+    pending.key = key;
+    pending.buffer.resize(pending.location.length);
+    if (!pending.location.length) {
+        return lookupFinish(pending, 0, value);
+    }
+    return 1;
+}
+
+int ThreadSafeKVStore::lookupFinish(DiskLookup &pending, long bytesRead, ValueBuffer &value) {
+    Shard &shard = pImpl_->shardOf(pending.key);
+    const DiskLocation &location = pending.location;
+    size_t done = bytesRead > 0 ? bytesRead : 0;
+    while (done < location.length) {
+        ssize_t n = pread(location.fd, &pending.buffer[done], location.length - done, location.offset + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
         }
+        if (n <= 0) {
+            fprintf(stderr, "Error on reading the value of a key from disk.\n");
+            pending.location = DiskLocation();
+            return -1;
+        }
+        done += n;
     }
-    pthread_rwlock_unlock(&pImpl_->rw_lock);
-    return found ? 0 : -1;
+    pending.location = DiskLocation();
+    value = ValueBuffer(std::move(pending.buffer));
+    shard.cacheRead(pending.key, value, pending.generation);
+    return 0;
 }
 
 int ThreadSafeKVStore::remove(const string &key) {
+    Shard &shard = pImpl_->shardOf(key);
     try {
-        pthread_rwlock_wrlock(&pImpl_->rw_lock);
-        pImpl_->store.erase(key);
-        pImpl_->cacheList.remove(key);
-        deleteFile(pImpl_->storagePath + "/" + key);
-        pthread_rwlock_unlock(&pImpl_->rw_lock);
+        pthread_rwlock_wrlock(&shard.rw_lock);
+        uint64_t position = shard.removeLocked(key);
+        pthread_rwlock_unlock(&shard.rw_lock);
+        shard.commit(position);
+        shard.waitForFlusher();
     } catch(...) {
         return -1;
     }
     return 0;
 }
 
+// Holds the lock of a shard, and releases it when going out of scope, so an exception cannot leave the shard locked.
+class ShardLockGuard {
+  public:
+    explicit ShardLockGuard(Shard &_shard): shard(_shard), locked(false) {}
+
+    ~ShardLockGuard() {
+        unlock();
+    }
+
+    inline void readLock() {
+        pthread_rwlock_rdlock(&shard.rw_lock);
+        locked = true;
+    }
+
+    inline void writeLock() {
+        pthread_rwlock_wrlock(&shard.rw_lock);
+        locked = true;
+    }
+
+    inline void unlock() {
+        if (locked) {
+            pthread_rwlock_unlock(&shard.rw_lock);
+            locked = false;
+        }
+    }
+
+  private:
+    Shard &shard;
+    bool locked;
+};
+
+// Do a run of lookups of a batch on one shard. Same as lookup, but every lock is taken once for the whole
+// run: hits are answered under one read lock, misses are read from disk without any lock, and then they
+// are cached under one write lock, unless the shard was modified in between.
+static void batchLookups(Shard &shard, BatchOp *const *begin, BatchOp *const *end, std::vector<BatchOp *> &misses) {
+    ShardLockGuard guard(shard);
+    misses.clear();
+    guard.readLock();
+    for (BatchOp *const *it = begin; it != end; ++it) {
+        BatchOp *op = *it;
+        op->result = shard.lookupInMemory(op->key, op->value);
+        if (op->result > 0) {
+            misses.push_back(op);
+        }
+    }
+    unsigned long generation = shard.generation;
+    guard.unlock();
+    bool cacheMisses = false;
+    for (BatchOp *op : misses) {
+        string str;
+        op->cached = false;
+        op->result = shard.disk->read(op->key, str) ? -1 : 0;
+        if (!op->result) {
+            op->value = ValueBuffer(std::move(str));
+            cacheMisses = cacheMisses || shard.cacheable(op->key, op->value);
+        }
+    }
+    ShardCounters::bump(shard.counters.hits, (end - begin) - misses.size());
+    ShardCounters::bump(shard.counters.misses, misses.size());
+    ShardCounters::bump(shard.counters.diskReads, misses.size());
+    if (cacheMisses) {
+        guard.writeLock();
+        if (shard.generation == generation) {
+            for (BatchOp *op : misses) {
+                if (!op->result && shard.cacheable(op->key, op->value) && shard.cacheFind(op->key) == nullptr) {
+                    shard.cacheAdd(op->key, op->value, false);
+                }
+            }
+        }
+        guard.unlock();
+        shard.waitForFlusher();
+    }
+}
+
+// Do a run of inserts and removes of a batch on one shard, in order under one write lock. The log position
+// of every operation done is written to position, so it can be committed even if a later one fails.
+static void batchWrites(Shard &shard, BatchOp *const *begin, BatchOp *const *end, uint64_t &position) {
+    ShardLockGuard guard(shard);
+    guard.writeLock();
+    for (BatchOp *const *it = begin; it != end; ++it) {
+        BatchOp *op = *it;
+        position = op->type == BATCH_INSERT ? shard.insertLocked(op->key, op->value, 0) : shard.removeLocked(op->key);
+        op->result = 0;
+    }
+}
+
+void ThreadSafeKVStore::batch(std::vector<BatchOp> &ops) {
+    // Group the operations by shard with a counting sort, which keeps the order of the operations on a key.
+    size_t numShards = pImpl_->shards.size();
+    std::vector<unsigned int> shardOfOp(ops.size());
+    std::vector<size_t> groupStart(numShards + 1, 0);
+    for (size_t i = 0; i < ops.size(); ++i) {
+        ops[i].result = -1;
+        ops[i].cached = true;
+        shardOfOp[i] = pImpl_->shardIndexOf(ops[i].key);
+        ++groupStart[shardOfOp[i] + 1];
+    }
+    for (size_t s = 0; s < numShards; ++s) {
+        groupStart[s + 1] += groupStart[s];
+    }
+    std::vector<BatchOp *> grouped(ops.size());
+    std::vector<size_t> next(groupStart.begin(), groupStart.end() - 1);
+    for (size_t i = 0; i < ops.size(); ++i) {
+        grouped[next[shardOfOp[i]]++] = &ops[i];
+    }
+    std::vector<BatchOp *> misses;
+    for (size_t s = 0; s < numShards; ++s) {
+        if (groupStart[s] == groupStart[s + 1]) {
+            continue;
+        }
+        Shard &shard = *pImpl_->shards[s];
+        BatchOp *const *groupEnd = grouped.data() + groupStart[s + 1];
+        uint64_t position = 0; // The writes of the whole group are committed to the log at once.
+        bool modified = false;
+        try {
+            // The group is done in runs of lookups and runs of writes, in order, so that every operation sees
+            // those on its key before it, and lookups never read from disk under the write lock.
+            for (BatchOp *const *run = grouped.data() + groupStart[s]; run != groupEnd; ) {
+                bool lookups = (*run)->type == BATCH_LOOKUP;
+                BatchOp *const *runEnd = run;
+                while (runEnd != groupEnd && ((*runEnd)->type == BATCH_LOOKUP) == lookups) {
+                    ++runEnd;
+                }
+                if (lookups) {
+                    batchLookups(shard, run, runEnd, misses);
+                } else {
+                    modified = true;
+                    batchWrites(shard, run, runEnd, position);
+                }
+                run = runEnd;
+            }
+        } catch (const std::exception &e) {
+            // The operations not done yet are left failed. Those done are still committed.
+            fprintf(stderr, "Error on a batch of operations of shard %zu: %s. The rest of its operations failed.\n", s, e.what());
+        }
+        if (modified) {
+            shard.commit(position);
+            shard.waitForFlusher();
+        }
+    }
+}
+
+void ThreadSafeKVStore::scan(const string &start, const string &end, size_t limit,
+                             std::vector<std::pair<string, ValueBuffer>> &results, string &next) {
+    // Take the first keys of the range from every shard, holding the lock of one shard at a time.
+    // No shard can contribute more than limit keys.
+    size_t numShards = pImpl_->shards.size();
+    std::vector<std::vector<string>> shardKeys(numShards);
+    for (size_t s = 0; s < numShards; ++s) {
+        Shard &shard = *pImpl_->shards[s];
+        pthread_rwlock_rdlock(&shard.rw_lock);
+        for (auto it = shard.index.lower_bound(start);
+             it != shard.index.end() && shardKeys[s].size() < limit && (end.empty() || *it < end); ++it) {
+            shardKeys[s].push_back(*it);
+        }
+        pthread_rwlock_unlock(&shard.rw_lock);
+    }
+    // Merge the sorted keys of the shards, smallest first, until the limit.
+    typedef std::pair<const string *, size_t> HeapItem; // The next key of a shard, and the shard.
+    auto greater = [](const HeapItem &a, const HeapItem &b) { return *a.first > *b.first; };
+    std::priority_queue<HeapItem, std::vector<HeapItem>, decltype(greater)> heap(greater);
+    std::vector<size_t> position(numShards, 0);
+    for (size_t s = 0; s < numShards; ++s) {
+        if (!shardKeys[s].empty()) {
+            heap.push(HeapItem(&shardKeys[s][0], s));
+        }
+    }
+    std::vector<BatchOp> ops;
+    while (!heap.empty() && ops.size() < limit) {
+        size_t s = heap.top().second;
+        heap.pop();
+        BatchOp op;
+        op.type = BATCH_LOOKUP;
+        op.key = std::move(shardKeys[s][position[s]]);
+        ops.push_back(std::move(op));
+        if (++position[s] < shardKeys[s].size()) {
+            heap.push(HeapItem(&shardKeys[s][position[s]], s));
+        }
+    }
+    // The range may have more keys only if the limit was reached. The next scan starts right after the last key.
+    next.clear();
+    if (ops.size() == limit && limit) {
+        next = ops.back().key;
+        next += '\0';
+    }
+    // Keys removed since they were listed are skipped.
+    batch(ops);
+    for (BatchOp &op : ops) {
+        if (!op.result) {
+            results.push_back(std::make_pair(std::move(op.key), op.value));
+        }
+    }
+}
+
 } // namespace multicore
@@ -2,6 +2,14 @@
 #define _THREADSAFEKVSTORE_H_
 
 #include <string>
+#include <vector>
+#include <utility>
+#include <cstddef>
+
+#include "diskStore.hpp"
+#include "valueBuffer.hpp"
+#include "slabAllocator.hpp"
+#include "writeAheadLog.hpp"
 
 using std::string;
 
@@ -10,6 +18,66 @@ namespace multicore {
 // The class for inner storage. Content is hidden from user.
 class ThreadSafeKVStoreImpl;
 
+/**
+ * Statistics of the in memory cache and of the disk tier.
+ */
+struct KVStoreStats {
+    unsigned long cacheEntries; // Number of key-value pairs in the cache.
+    unsigned long residentBytes; // Bytes charged to the cache: the slab chunks of the entries, their hash table buckets and the key index.
+    unsigned long indexBytes; // Bytes of residentBytes taken by the ordered index of all the keys.
+    unsigned long cacheBytes; // Byte budget of the cache.
+    unsigned long pendingWrites; // Number of writes and deletes waiting to be written to disk.
+    unsigned long cacheHits; // Number of lookups answered from memory.
+    unsigned long cacheMisses; // Number of lookups that went to disk.
+    unsigned long evictions; // Number of key-value pairs evicted from the cache.
+    unsigned long diskReads; // Number of reads from the disk tier, including those answered by its Bloom filter.
+    unsigned long diskWrites; // Number of writes to the disk tier.
+    unsigned long diskDeletes; // Number of deletes from the disk tier.
+    unsigned long expirations; // Number of keys removed because their TTL ran out.
+    unsigned long filterBytes; // Size of the Bloom filters of the keys on disk.
+    unsigned long filterNegatives; // Reads from disk answered by the Bloom filters without touching the disk.
+    unsigned long filterFalsePositives; // Reads of keys not on disk which the Bloom filters did not rule out.
+    unsigned long filterRebuilds; // Number of times a Bloom filter was rebuilt from the keys on disk.
+    unsigned long logRecords; // Number of records appended to the write-ahead logs.
+    unsigned long logWrites; // Number of writes to the write-ahead logs, each of which commits a group of records.
+    unsigned long logSyncs; // Number of syncs of the write-ahead logs.
+    unsigned long logBytes; // Size of the current files of the write-ahead logs.
+    unsigned long checkpoints; // Number of checkpoints of the shards.
+    unsigned long warmedKeys; // Number of keys read into the cache from the hot set on start.
+    std::vector<SlabClassStats> slabClasses; // Usage of every slab class of the cache, summed over the shards.
+};
+
+/**
+ * Type of an operation of a batch.
+ */
+enum BatchOpType {
+    BATCH_LOOKUP,
+    BATCH_INSERT,
+    BATCH_REMOVE
+};
+
+/**
+ * One operation of a batch, with its result.
+ */
+struct BatchOp {
+    BatchOpType type;
+    string key;
+    ValueBuffer value; // The value to be inserted, or the value found by a lookup.
+    int result; // What the method of the same operation would return: 0, or -1.
+    bool cached; // For a lookup, whether it was answered from memory rather than from disk.
+};
+
+/**
+ * A lookup that missed the cache, whose value the caller reads from disk itself, e.g. asynchronously.
+ * Started by lookupStart, and finished by lookupFinish once the value is read.
+ */
+struct DiskLookup {
+    string key;
+    DiskLocation location; // Where to read the value from.
+    string buffer; // Where to read the value into. Sized to the length of the value.
+    unsigned long generation; // Of the shard of the key when the value was located.
+};
+
 /**
  * @author Chenyang Tang <ct1856@nyu.edu>
  *
@@ -17,19 +85,56 @@ class ThreadSafeKVStoreImpl;
  *
  * A thread-safe Key-Value storage class, using unordered_map as underlying storage.
  *
- * There are three methods: insert, lookup, and remove. lookup can run simultaneously on multiple
- * threads, while insert or remove will block any other thread from doing any reading or writing
- * while it is running.
+ * There are three methods: insert, lookup, and remove. The storage is split into a number of
+ * independent shards selected by the hash of the key, each with its own cache, lock and disk
+ * sub-directory. Within a shard, lookup can run simultaneously on multiple threads, while insert
+ * or remove will block any other thread from doing any reading or writing on that shard while it
+ * is running. Operations on keys in different shards never block each other.
+ *
+ * The in memory cache is limited by bytes: each key-value pair is stored with its key and value in one
+ * chunk of a slab allocator, and is charged the size of that chunk. A pair that is larger than the
+ * budget of its shard is never cached and goes straight to disk.
+ *
+ * Writes to disk are done in the background by flusher threads, outside of the locks of the shards.
+ * When a shard has more than dirtyLimit writes waiting for its flusher, inserts and deletes on that
+ * shard wait for the flusher to catch up.
+ *
+ * The file-per-key engine keeps a Bloom filter of the keys on disk of every shard, so lookups of keys
+ * that were never written return without touching the disk.
+ *
+ * A durable storage logs every insert and remove to a write-ahead log per shard before returning, and
+ * keeps what it has in the storage directory: the disk tiers load it, the logs are replayed on top, in
+ * parallel for all the shards, and the storage then carries on from there. Every shard is checkpointed
+ * from time to time, i.e. what it holds in memory is written to disk and synced, and its older log files
+ * are deleted, so the logs to replay stay short. The number of shards and the disk engine must be the
+ * same as when the storage was made.
+ *
+ * A durable storage also saves the keys in its cache, hottest first, every checkpointInterval seconds
+ * and when it is destroyed, as its hot set. On start, background threads read the keys of the hot set
+ * from disk into the cache, as far as it has room, while the storage is already in use.
  */
 class ThreadSafeKVStore {
   public:
     /**
-     * Constructor. Makes a new empty storage.
+     * Constructor. Makes a new empty storage, or opens the storage in storagePath if it is durable.
      *
-     * @param storagePath the path of storage directory.
-     * @param cacheSize the maximum size of the in memory cache.
+     * @param storagePath the path of storage directory. THIS DIRECTORY WILL BE WIPED CLEAN IF IT ALREADY EXISTS,
+     *                    unless the storage is durable.
+     * @param cacheBytes the maximum size of the in memory cache in bytes, 0 to disable the cache. It is split evenly among the shards.
+     * @param numShards the number of shards.
+     * @param engine the disk storage engine used by every shard for pairs that are not in the cache.
+     * @param numFlushers the number of flusher threads.
+     * @param dirtyLimit the max number of writes waiting to be flushed per shard.
+     * @param filterFpr the false positive rate of the Bloom filters, or 0 for no filters.
+     * @param filterMaxBytes the max total size of the Bloom filters, split evenly among the shards, or 0 for no max.
+     * @param walPolicy when the logs are synced, or WAL_OFF if the storage is not durable.
+     * @param walSyncMillis the milliseconds between two syncs of the logs, with WAL_SYNC_INTERVAL.
+     * @param checkpointInterval the max seconds between two checkpoints of a shard that logged anything.
      */
-    ThreadSafeKVStore(string storagePath, unsigned int cacheSize);
+    ThreadSafeKVStore(string storagePath, size_t cacheBytes, unsigned int numShards = 1, DiskEngine engine = FILE_PER_KEY,
+                      unsigned int numFlushers = 1, size_t dirtyLimit = 1024, double filterFpr = DEFAULT_FILTER_FPR,
+                      size_t filterMaxBytes = 0, WalSyncPolicy walPolicy = WAL_OFF, unsigned int walSyncMillis = 1000,
+                      unsigned int checkpointInterval = 60);
 
     /**
      * Destructor. Will write all memory cache back to disk before destroying them.
@@ -37,7 +142,7 @@ class ThreadSafeKVStore {
     ~ThreadSafeKVStore();
 
     /**
-     * Write all cache in memory to disk.
+     * Write all cache in memory, and all writes waiting for the flushers, to disk.
      *
      * This method is called automatically by destructor,
      * but can also be manually called at any time.
@@ -47,6 +152,31 @@ class ThreadSafeKVStore {
      */
     int cacheWriteBack();
 
+    /**
+     * Get statistics of the in memory cache and of the disk tier. Does not take any lock, so the numbers
+     * of different shards may be from slightly different moments.
+     *
+     * @param stats the argument to return the statistics.
+     */
+    void getStats(KVStoreStats &stats) const;
+
+    /**
+     * Whether the cache is warm, i.e. whether the keys of the hot set saved by the last run have all been
+     * read into the cache, or as many as fit. True from the start if there was no hot set.
+     *
+     * @return true if the cache is warm.
+     */
+    bool ready() const;
+
+    /**
+     * Save the keys of the cache as the hot set now, rather than at the next checkpoint interval, e.g. right
+     * before the program exits. Does nothing while the cache is still warming up.
+     *
+     * @return 0 on success;
+     *         -1 on failure, if the storage is not durable, or if the cache is still warming up.
+     */
+    int saveHotSet();
+
     /**
      * Insert a key-value pair if the key doesn't exist, or update the value if it does.
      *
@@ -57,6 +187,23 @@ class ThreadSafeKVStore {
      */
     int insert(const string &key, const string &value);
 
+    /**
+     * Insert a key-value pair if the key doesn't exist, or update the value if it does.
+     * The bytes are copied into the cache, or, if the value is too large to be cached, the storage keeps
+     * a reference to the buffer until it is written to disk.
+     *
+     * A key inserted with a TTL is gone for lookups as soon as the TTL runs out, and is removed from
+     * the cache and from disk by a background thread within about a second. Inserting the key again
+     * replaces its TTL, or clears it if the new ttl is 0.
+     *
+     * @param key the key to be inserted.
+     * @param value the value to be associated with the key.
+     * @param ttl the number of seconds after which the key expires, or 0 if it never does.
+     * @return 0 if successful
+     *         -1 if there is some fatal error
+     */
+    int insert(const string &key, const ValueBuffer &value, unsigned long ttl = 0);
+
     /**
      * Look up a key and write its associated value to the second argument if it exists.
      *
@@ -67,6 +214,46 @@ class ThreadSafeKVStore {
      */
     int lookup(const string &key, string &value);
 
+    /**
+     * Look up a key and return a reference to its associated value if it exists. The value is not copied,
+     * only its reference count is incremented, so this is cheap even for large values.
+     *
+     * @param key the key to be looked up.
+     * @param value the variable used to return the associated value.
+     * @param cached if not null, set to true if the lookup was answered from memory, or false if it went to disk.
+     * @return 0 if the key is present
+     *         -1 if not present
+     */
+    int lookup(const string &key, ValueBuffer &value, bool *cached = nullptr);
+
+    /**
+     * Look up a key like lookup does, except that a value that has to be read from disk is only located,
+     * so the caller can read it without blocking, and then finish the lookup with lookupFinish. Values of
+     * engines that cannot be located are read right away, as by lookup.
+     *
+     * @param key the key to be looked up.
+     * @param value the variable used to return the associated value, if the lookup is done.
+     * @param cached set to true if the lookup was answered from memory, or false if it went to disk.
+     * @param pending the argument to return the read to do, if the lookup is not done.
+     * @return 0 if the key is present
+     *         -1 if not present
+     *         1 if the caller has to read pending.location.length bytes at pending.location into pending.buffer,
+     *           and then call lookupFinish.
+     */
+    int lookupStart(const string &key, ValueBuffer &value, bool *cached, DiskLookup &pending);
+
+    /**
+     * Finish a lookup started by lookupStart once its value is read, and cache the value as lookup would.
+     * A read that failed or came up short is done again synchronously.
+     *
+     * @param pending the lookup. Its location and buffer are released.
+     * @param bytesRead the number of bytes read into pending.buffer, or a negative error number.
+     * @param value the variable used to return the associated value.
+     * @return 0 if the key is present
+     *         -1 if its value could not be read
+     */
+    int lookupFinish(DiskLookup &pending, long bytesRead, ValueBuffer &value);
+
     /**
      * Delete a key-value pair according to the key provided. If the key does not exist, nothing is done.
      *
@@ -77,6 +264,36 @@ class ThreadSafeKVStore {
      */
     int remove(const string &key);
 
+    /**
+     * Do a number of inserts, lookups and removes at once. The operations are grouped by shard, and the
+     * lock of every shard is taken once for every run of lookups or of writes on it, rather than once per
+     * operation. Lookups of a run that miss the cache read from disk together. Operations on the same key are
+     * done in the order they are given, but operations on different shards may be seen by other threads
+     * in any order, so a batch is not atomic. Inserts of a batch have no TTL.
+     *
+     * Lookups that miss the cache read from disk without holding the lock of their shard, even when
+     * the batch also modifies it. If an operation fails with an error, the error is printed, and the
+     * operations after it on its shard fail too.
+     *
+     * @param ops the operations. The result of every operation is written to it.
+     */
+    void batch(std::vector<BatchOp> &ops);
+
+    /**
+     * List the key-value pairs in a range of keys, in key order. Every shard keeps an ordered index of
+     * all its keys, cached or not. The scan takes the lock of one shard at a time, never all of them,
+     * so it is not a snapshot: a key inserted or removed during a scan may or may not be seen.
+     *
+     * @param start the first key of the range.
+     * @param end the end of the range, which is not included, or empty for no end.
+     * @param limit the max number of pairs.
+     * @param results the argument to return the pairs. Pairs are appended to it.
+     * @param next the argument to return the start of the rest of the range, if the limit was reached,
+     *             or an empty string if the scan has reached the end of the range.
+     */
+    void scan(const string &start, const string &end, size_t limit,
+              std::vector<std::pair<string, ValueBuffer>> &results, string &next);
+
   private:
     // The Inner storage. Hidden from the user.
     ThreadSafeKVStoreImpl *pImpl_;
@@ -1,6 +1,14 @@
 #pragma once
 
 #include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#define CACHE_LINE_SIZE 64
 
 namespace multicore {
 
@@ -106,4 +114,249 @@ class ThreadSafeQueue {
     pthread_cond_t cond_v;
 };
 
+/**
+ * @section DESCRIPTION
+ *
+ * An event that threads can wait for, implemented with a futex. A waiting thread retries its operation
+ * until it succeeds, and the thread making the operation possible signals the event afterwards.
+ *
+ * Signaling costs a fence unless a thread is waiting, and at most one wake-up is in flight at a time,
+ * so a stream of signals to a thread that has been woken up but has not run yet makes no system call.
+ */
+class alignas(CACHE_LINE_SIZE) FutexEvent {
+  public:
+    /**
+     * Constructor.
+     */
+    FutexEvent(): word(0), waiters(0), signaled(false) {}
+
+    /**
+     * Checks if a thread is waiting for the event.
+     *
+     * @return true if a thread is going to sleep or sleeping on the event.
+     */
+    inline bool hasWaiters() const {
+        return waiters.load(std::memory_order_relaxed) > 0;
+    }
+
+    /**
+     * Signal the event, waking up a waiting thread if there is one.
+     */
+    inline void wake() {
+        // The fence pairs with the increment of waiters in wait(): either the waiter sees the operation
+        // done before this call when it retries, or this sees the waiter and wakes it up.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiters.load(std::memory_order_relaxed) && !signaled.load(std::memory_order_relaxed) &&
+            !signaled.exchange(true)) {
+            word.fetch_add(1);
+            futex(FUTEX_WAKE_PRIVATE, 1);
+        }
+    }
+
+    /**
+     * Retry an operation until it succeeds, spinning briefly and then sleeping between attempts.
+     *
+     * @param op the operation, returning true on success.
+     */
+    template <typename Op>
+    void wait(Op op) {
+        for (int spin = 0; spin < 64; ++spin) {
+            if (op()) {
+                return;
+            }
+        }
+        while (true) {
+            int seq = word.load();
+            waiters.fetch_add(1);
+            if (op()) {
+                waiters.fetch_sub(1);
+                return;
+            }
+            futex(FUTEX_WAIT_PRIVATE, seq);
+            waiters.fetch_sub(1);
+            signaled.store(false);
+            if (op()) {
+                return;
+            }
+        }
+    }
+
+  private:
+    std::atomic<int> word; // Futex word, changed by every wake-up.
+    std::atomic<int> waiters; // Number of threads going to sleep or sleeping on the futex.
+    std::atomic<bool> signaled; // A thread has been woken up, but has not run yet.
+
+    inline long futex(int op, int val) {
+        return syscall(SYS_futex, reinterpret_cast<int *>(&word), op, val, nullptr, nullptr, 0);
+    }
+};
+
+/**
+ * @section DESCRIPTION
+ *
+ * A bounded lock-free multi-producer multi-consumer queue class template, with the same interface as
+ * ThreadSafeQueue. T is the type of element in the queue, and must be default constructible and copyable.
+ *
+ * The queue is a ring buffer of cells (Dmitry Vyukov's bounded MPMC queue). Every cell has a sequence
+ * number telling whether it is ready to be written or read in the current round, so enqueue and dequeue
+ * each take a single compare-and-swap on their position in the common case, and never allocate.
+ * The positions and the cells are on separate cache lines, so producers and consumers do not contend.
+ *
+ * dequeue on an empty queue, and enqueue on a full queue, spin briefly and then sleep on a futex.
+ * The futex is only woken up if a thread is actually sleeping on it, so a handoff between busy threads
+ * costs no system call.
+ */
+template <typename T>
+class LockFreeQueue {
+  public:
+    /**
+     * Constructor. Makes an empty queue.
+     *
+     * @param capacity the max number of elements in the queue. Rounded up to a power of 2.
+     */
+    LockFreeQueue(size_t capacity = 65536): enqueuePos(0), dequeuePos(0) {
+        size_t size = 2;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        mask = size - 1;
+        cells = new Cell[size];
+        for (size_t i = 0; i < size; ++i) {
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * Destructor.
+     */
+    ~LockFreeQueue() {
+        delete[] cells;
+    }
+
+    /**
+     * Checks if the queue is empty. The result may be outdated as soon as it is returned.
+     *
+     * @return true if queue is empty;
+     *         false if queue is not empty.
+     */
+    inline bool empty() const {
+        return size() == 0;
+    }
+
+    /**
+     * Number of elements in the queue. The result may be outdated as soon as it is returned.
+     *
+     * @return the number of elements.
+     */
+    inline size_t size() const {
+        size_t tail = enqueuePos.load(std::memory_order_relaxed);
+        size_t head = dequeuePos.load(std::memory_order_relaxed);
+        return tail > head ? tail - head : 0;
+    }
+
+    /**
+     * Enqueue an element if the queue is not full.
+     *
+     * @param elem the element to be enqueued.
+     * @return true if the element is enqueued;
+     *         false if the queue is full.
+     */
+    bool tryEnqueue(const T& elem) {
+        size_t pos = enqueuePos.load(std::memory_order_relaxed);
+        Cell *cell;
+        while (true) {
+            cell = &cells[pos & mask];
+            size_t seq = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+            if (diff == 0) { // cell is free in this round
+                if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) { // cell still holds an element of the previous round
+                return false;
+            } else {
+                pos = enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+        cell->data = elem;
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        notEmpty.wake();
+        return true;
+    }
+
+    /**
+     * Dequeue an element if the queue is not empty.
+     *
+     * @param elem the argument to return the dequeued element.
+     * @return true if an element is dequeued;
+     *         false if the queue is empty.
+     */
+    bool tryDequeue(T &elem) {
+        size_t pos = dequeuePos.load(std::memory_order_relaxed);
+        Cell *cell;
+        while (true) {
+            cell = &cells[pos & mask];
+            size_t seq = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t) seq - (intptr_t) (pos + 1);
+            if (diff == 0) { // cell holds an element of this round
+                if (dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) { // cell is not written yet
+                return false;
+            } else {
+                pos = dequeuePos.load(std::memory_order_relaxed);
+            }
+        }
+        elem = cell->data;
+        cell->data = T();
+        cell->sequence.store(pos + mask + 1, std::memory_order_release);
+        notFull.wake();
+        return true;
+    }
+
+    /**
+     * Enqueue an element. If the queue is full, wait until there is room and then resume.
+     *
+     * @param elem the element to be enqueued.
+     */
+    void enqueue(const T& elem) {
+        if (!tryEnqueue(elem)) {
+            notFull.wait([this, &elem]() { return tryEnqueue(elem); });
+            if (size() <= mask) {
+                notFull.wake(); // Pass the wake-up on to another waiting producer.
+            }
+        }
+    }
+
+    /**
+     * Dequeue an element. If the queue is empty, wait until there is an element available and then resume.
+     *
+     * @return the dequeued element.
+     */
+    T dequeue() {
+        T ret;
+        if (!tryDequeue(ret)) {
+            notEmpty.wait([this, &ret]() { return tryDequeue(ret); });
+            if (!empty()) {
+                notEmpty.wake(); // Pass the wake-up on to another waiting consumer.
+            }
+        }
+        return ret;
+    }
+
+  private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T data;
+    };
+
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> enqueuePos;
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> dequeuePos;
+    FutexEvent notEmpty; // Signaled by every enqueue.
+    FutexEvent notFull; // Signaled by every dequeue.
+    alignas(CACHE_LINE_SIZE) Cell *cells;
+    size_t mask;
+};
+
 } // namespace multicore
@@ -0,0 +1,60 @@
+#include "timerWheel.hpp"
+
+namespace multicore {
+
+TimerWheel::TimerWheel(uint64_t now): current(now), numEntries(0) {}
+
+void TimerWheel::add(const std::string &key, uint64_t tick) {
+    TimerEntry entry = {key, tick};
+    place(std::move(entry), current + 1);
+    ++numEntries;
+}
+
+void TimerWheel::place(TimerEntry &&entry, uint64_t earliest) {
+    // Keys already due go to the next slot of level 0 to be returned.
+    uint64_t tick = entry.tick > earliest ? entry.tick : earliest;
+    uint64_t delta = tick - current;
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 && delta >> (TIMER_WHEEL_SLOT_BITS * (level + 1))) {
+        ++level;
+    }
+    if (delta >> (TIMER_WHEEL_SLOT_BITS * (level + 1))) { // beyond the span of the wheel
+        tick = current + ((uint64_t) 1 << (TIMER_WHEEL_SLOT_BITS * TIMER_WHEEL_LEVELS)) - 1;
+    }
+    slots[level][(tick >> (TIMER_WHEEL_SLOT_BITS * level)) & (TIMER_WHEEL_SLOTS - 1)].push_back(std::move(entry));
+}
+
+void TimerWheel::advance(uint64_t now, std::vector<TimerEntry> &due) {
+    std::vector<TimerEntry> moving;
+    while (current < now) {
+        ++current;
+        // At the start of a slot of an upper level, move its keys down, starting from the top.
+        for (int level = TIMER_WHEEL_LEVELS - 1; level > 0; --level) {
+            unsigned int shift = TIMER_WHEEL_SLOT_BITS * level;
+            if (current & (((uint64_t) 1 << shift) - 1)) {
+                continue;
+            }
+            moving.swap(slots[level][(current >> shift) & (TIMER_WHEEL_SLOTS - 1)]);
+            for (TimerEntry &entry : moving) {
+                place(std::move(entry), current); // The slot of level 0 of the current tick is returned below.
+            }
+            moving.clear();
+        }
+        std::vector<TimerEntry> &slot = slots[0][current & (TIMER_WHEEL_SLOTS - 1)];
+        for (TimerEntry &entry : slot) {
+            if (entry.tick <= current) {
+                due.push_back(std::move(entry));
+                --numEntries;
+            } else { // not due yet, which the placement above never does, but is handled anyway
+                moving.push_back(std::move(entry));
+            }
+        }
+        slot.clear();
+        for (TimerEntry &entry : moving) {
+            place(std::move(entry), current + 1);
+        }
+        moving.clear();
+    }
+}
+
+} // namespace multicore
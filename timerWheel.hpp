@@ -0,0 +1,78 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+#define TIMER_WHEEL_SLOT_BITS 6 // Every level of the wheel has 2^6 slots.
+#define TIMER_WHEEL_SLOTS     (1 << TIMER_WHEEL_SLOT_BITS)
+#define TIMER_WHEEL_LEVELS    4 // With ticks of a second, the levels span a minute, an hour, 3 days and half a year.
+
+namespace multicore {
+
+/**
+ * A key due to expire at a tick.
+ */
+struct TimerEntry {
+    std::string key;
+    uint64_t tick;
+};
+
+/**
+ * @section DESCRIPTION
+ *
+ * A hierarchical hashed timer wheel, holding keys until the tick they are due at.
+ *
+ * Level 0 has a slot per tick for the next 2^6 ticks, and every level above has a slot per 2^6 slots of
+ * the level below, so adding a key is O(1) however far its tick is. When the wheel reaches the start of
+ * a slot of an upper level, the keys of that slot are moved down to the level below, so every key is
+ * moved at most once per level. Keys due later than the top level spans are kept in its last slot and
+ * put back when it is reached.
+ *
+ * The wheel never removes a key before it is due: a key that should no longer expire at its tick, e.g.
+ * because it was deleted or given another expiry, is simply returned at that tick and must be ignored
+ * by the caller. Not thread-safe.
+ */
+class TimerWheel {
+  public:
+    /**
+     * Constructor. Makes an empty wheel.
+     *
+     * @param now the current tick.
+     */
+    explicit TimerWheel(uint64_t now);
+
+    /**
+     * Add a key. A key due now or earlier is returned by the next advance.
+     *
+     * @param key the key.
+     * @param tick the tick the key is due at.
+     */
+    void add(const std::string &key, uint64_t tick);
+
+    /**
+     * Move the wheel forward to a tick and return every key due by then.
+     *
+     * @param now the current tick.
+     * @param due the vector to append the due keys to.
+     */
+    void advance(uint64_t now, std::vector<TimerEntry> &due);
+
+    /**
+     * @return the number of keys in the wheel.
+     */
+    inline size_t size() const {
+        return numEntries;
+    }
+
+  private:
+    // Put a key in its slot. earliest is the first tick whose slot of level 0 has not been returned yet.
+    void place(TimerEntry &&entry, uint64_t earliest);
+
+    std::vector<TimerEntry> slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    uint64_t current; // The last tick the wheel was advanced to.
+    size_t numEntries;
+};
+
+} // namespace multicore
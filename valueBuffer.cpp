@@ -0,0 +1,51 @@
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#include "valueBuffer.hpp"
+#include "slabAllocator.hpp"
+
+namespace multicore {
+
+// A block owning a string, so the bytes of a string can be taken over without copying them.
+struct StringBlock : ValueBlock {
+    std::string str;
+    explicit StringBlock(std::string &&_str): ValueBlock(VALUE_STRING), str(std::move(_str)) {}
+};
+
+void ValueBlock::release() {
+    switch (kind) {
+      case VALUE_HEAP:
+        this->~ValueBlock();
+        free(this);
+        break;
+      case VALUE_STRING:
+        delete static_cast<StringBlock *>(this);
+        break;
+      case VALUE_SLAB:
+        this->~ValueBlock();
+        SlabAllocator::release(this);
+        break;
+    }
+}
+
+ValueBuffer::ValueBuffer(std::string &&str) {
+    StringBlock *stringBlock = new StringBlock(std::move(str));
+    block = stringBlock;
+    bytes = stringBlock->str.data();
+    length = stringBlock->str.size();
+}
+
+ValueBuffer::ValueBuffer(const char *data, size_t _length): length(_length) {
+    // The bytes follow the header in the same block, so the value costs a single malloc.
+    void *mem = malloc(sizeof(ValueBlock) + length);
+    if (mem == nullptr) {
+        throw std::bad_alloc();
+    }
+    block = new (mem) ValueBlock(VALUE_HEAP);
+    char *copy = (char *) mem + sizeof(ValueBlock);
+    memcpy(copy, data, length);
+    bytes = copy;
+}
+
+} // namespace multicore
@@ -0,0 +1,161 @@
+#pragma once
+
+#include <string>
+#include <atomic>
+#include <cstddef>
+
+namespace multicore {
+
+/**
+ * How a block holding the bytes of values is freed.
+ */
+enum ValueBlockKind {
+    VALUE_HEAP, // One malloc'd block, freed with free.
+    VALUE_STRING, // A block owning a string.
+    VALUE_SLAB // A chunk of a SlabAllocator.
+};
+
+/**
+ * The header of a block of memory holding the bytes of one or more values, with the reference count
+ * shared by every ValueBuffer referring to it. Whoever makes a block holds its first reference.
+ */
+struct ValueBlock {
+    std::atomic<unsigned int> refs;
+    unsigned char kind; // A ValueBlockKind.
+
+    explicit ValueBlock(ValueBlockKind _kind): refs(1), kind(_kind) {}
+
+    inline void ref() {
+        refs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /**
+     * Drop a reference, freeing the block with the last one.
+     */
+    inline void unref() {
+        if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            release();
+        }
+    }
+
+  private:
+    void release();
+};
+
+/**
+ * @section DESCRIPTION
+ *
+ * An immutable, reference counted buffer holding a value of the key-value storage.
+ *
+ * Copying a ValueBuffer only increments a reference count, so a value can be shared by the cache,
+ * the writes pending for disk and the responses being sent, without copying its bytes. The bytes
+ * are freed when the last ValueBuffer referring to them is destroyed.
+ */
+class ValueBuffer {
+  public:
+    /**
+     * Constructor. Makes a null buffer, which holds no value at all.
+     */
+    ValueBuffer(): block(nullptr), bytes(nullptr), length(0) {}
+
+    /**
+     * Constructor. Takes over the bytes of a string without copying them.
+     *
+     * @param str the string.
+     */
+    explicit ValueBuffer(std::string &&str);
+
+    /**
+     * Constructor. Copies the bytes into a single new block.
+     *
+     * @param data the bytes.
+     * @param length the number of bytes.
+     */
+    ValueBuffer(const char *data, size_t length);
+
+    /**
+     * Constructor. Refers to bytes of an existing block, taking a reference to it.
+     *
+     * @param _block the block.
+     * @param data the bytes, which are inside the block.
+     * @param _length the number of bytes.
+     */
+    ValueBuffer(ValueBlock *_block, const char *data, size_t _length): block(_block), bytes(data), length(_length) {
+        block->ref();
+    }
+
+    ValueBuffer(const ValueBuffer &other): block(other.block), bytes(other.bytes), length(other.length) {
+        if (block != nullptr) {
+            block->ref();
+        }
+    }
+
+    ValueBuffer(ValueBuffer &&other): block(other.block), bytes(other.bytes), length(other.length) {
+        other.block = nullptr;
+        other.bytes = nullptr;
+        other.length = 0;
+    }
+
+    ~ValueBuffer() {
+        if (block != nullptr) {
+            block->unref();
+        }
+    }
+
+    ValueBuffer &operator=(const ValueBuffer &other) {
+        if (other.block != nullptr) {
+            other.block->ref();
+        }
+        if (block != nullptr) {
+            block->unref();
+        }
+        block = other.block;
+        bytes = other.bytes;
+        length = other.length;
+        return *this;
+    }
+
+    ValueBuffer &operator=(ValueBuffer &&other) {
+        if (this != &other) {
+            if (block != nullptr) {
+                block->unref();
+            }
+            block = other.block;
+            bytes = other.bytes;
+            length = other.length;
+            other.block = nullptr;
+            other.bytes = nullptr;
+            other.length = 0;
+        }
+        return *this;
+    }
+
+    inline const char *data() const {
+        return bytes;
+    }
+
+    inline size_t size() const {
+        return length;
+    }
+
+    /**
+     * @return true if the buffer holds a value (possibly an empty one).
+     */
+    inline explicit operator bool() const {
+        return block != nullptr;
+    }
+
+    /**
+     * @return a copy of the bytes as a string.
+     */
+    inline std::string str() const {
+        return std::string(bytes, length);
+    }
+
+  private:
+    ValueBlock *block;
+    const char *bytes;
+    size_t length;
+};
+
+} // namespace multicore
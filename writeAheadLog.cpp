@@ -0,0 +1,266 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "writeAheadLog.hpp"
+#include "fileSystemIO.hpp"
+
+namespace multicore {
+
+static inline uint32_t getU32(const char *buf) {
+    uint32_t val;
+    memcpy(&val, buf, sizeof(val));
+    return val;
+}
+
+static inline void putU32(char *buf, uint32_t val) {
+    memcpy(buf, &val, sizeof(val));
+}
+
+// Write exactly length bytes. Returns 0 on success.
+static int writeAll(int fd, const char *buf, size_t length) {
+    while (length) {
+        ssize_t n = ::write(fd, buf, length);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        buf += n;
+        length -= n;
+    }
+    return 0;
+}
+
+// Read a whole file. Returns 0 on success.
+static int readAll(const std::string &path, std::string &content) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st)) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    content.resize(st.st_size);
+    size_t done = 0;
+    while (done < content.size()) {
+        ssize_t n = read(fd, &content[done], content.size() - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    content.resize(done);
+    close(fd);
+    return 0;
+}
+
+// The sequence numbers of the log files of a shard, in order.
+static void listLogFiles(const std::string &dirPath, unsigned int shard, std::vector<uint64_t> &seqs) {
+    std::vector<std::string> names;
+    listFiles(dirPath, names);
+    for (const std::string &name : names) {
+        unsigned int fileShard;
+        unsigned long fileSeq;
+        int end = 0;
+        if (sscanf(name.c_str(), "%u-%lu.log%n", &fileShard, &fileSeq, &end) == 2 && end == (int) name.size() &&
+            fileShard == shard) {
+            seqs.push_back(fileSeq);
+        }
+    }
+    std::sort(seqs.begin(), seqs.end());
+}
+
+static std::string logPath(const std::string &dirPath, unsigned int shard, uint64_t seq) {
+    char name[48];
+    snprintf(name, sizeof(name), "/%u-%08lu.log", shard, (unsigned long) seq);
+    return dirPath + name;
+}
+
+WriteAheadLog::WriteAheadLog(const std::string &_dirPath, unsigned int _shard, uint64_t _seq, WalSyncPolicy _policy)
+    : records(0), writes(0), syncs(0), dirPath(_dirPath), shard(_shard), policy(_policy), seq(_seq), fd(-1), busy(false),
+      appended(0), written(0), synced(0), fileBytes(0) {
+    pthread_mutex_init(&lock, nullptr);
+    pthread_cond_init(&done, nullptr);
+    open();
+}
+
+WriteAheadLog::~WriteAheadLog() {
+    flush(true);
+    close(fd);
+    pthread_mutex_destroy(&lock);
+    pthread_cond_destroy(&done);
+}
+
+void WriteAheadLog::open() {
+    std::string path = logPath(dirPath, shard, seq);
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        fprintf(stderr, "Error on creating write-ahead log %s. Terminating.\n", path.c_str());
+        exit(-1);
+    }
+    // Make the new file itself durable, so it is found again after a crash.
+    int dirFd = ::open(dirPath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirFd >= 0) {
+        fsync(dirFd);
+        close(dirFd);
+    }
+    fileBytes.store(0, std::memory_order_relaxed);
+}
+
+unsigned long WriteAheadLog::replay(const std::string &dirPath, unsigned int shard,
+                                    const std::function<void(WalRecord &)> &callback, uint64_t &lastSeq) {
+    std::vector<uint64_t> seqs;
+    listLogFiles(dirPath, shard, seqs);
+    lastSeq = seqs.empty() ? 0 : seqs.back();
+    unsigned long replayed = 0;
+    std::string content;
+    WalRecord record;
+    for (uint64_t fileSeq : seqs) {
+        std::string path = logPath(dirPath, shard, fileSeq);
+        if (readAll(path, content)) {
+            fprintf(stderr, "Error on reading write-ahead log %s. Terminating.\n", path.c_str());
+            exit(-1);
+        }
+        size_t offset = 0;
+        while (offset + WAL_RECORD_HEADER_SIZE <= content.size()) {
+            const char *data = &content[offset];
+            uint32_t keyLength = getU32(data + 4);
+            uint32_t valueLength = getU32(data + 8);
+            uint64_t recordSize = WAL_RECORD_HEADER_SIZE + (uint64_t) keyLength + valueLength;
+            if (offset + recordSize > content.size() || data[12] > WAL_EXPIRY ||
+                getU32(data) != crc32(data + 4, recordSize - 4)) {
+                break;
+            }
+            record.type = (WalRecordType) data[12];
+            memcpy(&record.expiry, data + 16, sizeof(record.expiry));
+            record.key.assign(data + WAL_RECORD_HEADER_SIZE, keyLength);
+            record.value.assign(data + WAL_RECORD_HEADER_SIZE + keyLength, valueLength);
+            callback(record);
+            ++replayed;
+            offset += recordSize;
+        }
+        if (offset < content.size()) { // only expected at the end of the last file
+            fprintf(stderr, "Ignored the last %lu bytes of write-ahead log %s, which are not a complete record.\n",
+                    (unsigned long) (content.size() - offset), path.c_str());
+        }
+    }
+    return replayed;
+}
+
+uint64_t WriteAheadLog::append(WalRecordType type, const std::string &key, const char *value, size_t length, uint64_t expiry) {
+    char header[WAL_RECORD_HEADER_SIZE] = {0};
+    putU32(header + 4, key.size());
+    putU32(header + 8, length);
+    header[12] = type;
+    memcpy(header + 16, &expiry, sizeof(expiry));
+    uint32_t crc = crc32(header + 4, WAL_RECORD_HEADER_SIZE - 4);
+    crc = crc32(key.data(), key.size(), crc);
+    crc = crc32(value, length, crc);
+    putU32(header, crc);
+    size_t recordSize = WAL_RECORD_HEADER_SIZE + key.size() + length;
+    pthread_mutex_lock(&lock);
+    buffer.append(header, WAL_RECORD_HEADER_SIZE);
+    buffer.append(key);
+    buffer.append(value, length);
+    appended += recordSize;
+    uint64_t position = appended;
+    fileBytes.store(fileBytes.load(std::memory_order_relaxed) + recordSize, std::memory_order_relaxed);
+    pthread_mutex_unlock(&lock);
+    records.fetch_add(1, std::memory_order_relaxed);
+    return position;
+}
+
+void WriteAheadLog::commit(uint64_t position) {
+    bool sync = policy == WAL_SYNC_ALWAYS;
+    pthread_mutex_lock(&lock);
+    while ((sync ? synced : written) < position) {
+        if (busy) { // another thread is writing, and may take our record along
+            pthread_cond_wait(&done, &lock);
+        } else {
+            writeOut(sync);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void WriteAheadLog::flush(bool sync) {
+    pthread_mutex_lock(&lock);
+    while (busy) {
+        pthread_cond_wait(&done, &lock);
+    }
+    if (written < appended || (sync && synced < written)) {
+        writeOut(sync);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void WriteAheadLog::writeOut(bool sync) {
+    busy = true;
+    writing.swap(buffer);
+    uint64_t target = appended;
+    bool needSync = sync && synced < target;
+    pthread_mutex_unlock(&lock);
+    if (!writing.empty()) {
+        if (writeAll(fd, writing.data(), writing.size())) {
+            fprintf(stderr, "Error on writing the write-ahead log. Terminating.\n");
+            exit(-1);
+        }
+        writes.fetch_add(1, std::memory_order_relaxed);
+        writing.clear();
+    }
+    if (needSync) {
+        if (fdatasync(fd)) {
+            fprintf(stderr, "Error on syncing the write-ahead log. Terminating.\n");
+            exit(-1);
+        }
+        syncs.fetch_add(1, std::memory_order_relaxed);
+    }
+    pthread_mutex_lock(&lock);
+    written = target;
+    if (needSync) {
+        synced = target;
+    }
+    busy = false;
+    pthread_cond_broadcast(&done);
+}
+
+uint64_t WriteAheadLog::rotate() {
+    pthread_mutex_lock(&lock);
+    while (busy || written < appended || synced < written) {
+        if (busy) {
+            pthread_cond_wait(&done, &lock);
+        } else {
+            writeOut(true);
+        }
+    }
+    uint64_t oldSeq = seq++;
+    close(fd);
+    open();
+    pthread_mutex_unlock(&lock);
+    return oldSeq;
+}
+
+void WriteAheadLog::removeFiles(uint64_t lastSeq) {
+    std::vector<uint64_t> seqs;
+    listLogFiles(dirPath, shard, seqs);
+    for (uint64_t fileSeq : seqs) {
+        if (fileSeq <= lastSeq) {
+            deleteFile(logPath(dirPath, shard, fileSeq));
+        }
+    }
+}
+
+} // namespace multicore
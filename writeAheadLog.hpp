@@ -0,0 +1,164 @@
+#pragma once
+
+#include <pthread.h>
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <atomic>
+#include <functional>
+
+#define WAL_RECORD_HEADER_SIZE 24 // Bytes of the header of a record of the write-ahead log.
+
+namespace multicore {
+
+/**
+ * When the write-ahead log is made durable, or whether there is one at all.
+ */
+enum WalSyncPolicy {
+    WAL_OFF,           // No log. The storage is wiped on start.
+    WAL_SYNC_NONE,     // Writes are acknowledged once they are written to the log file. The system syncs it whenever it likes.
+    WAL_SYNC_INTERVAL, // Writes are acknowledged once they are written to the log file, which is synced periodically.
+    WAL_SYNC_ALWAYS    // Writes are acknowledged once the log file is synced.
+};
+
+/**
+ * Type of a record of the write-ahead log.
+ */
+enum WalRecordType {
+    WAL_PUT,    // A key was inserted, with its value and its expiry time, if any.
+    WAL_DELETE, // A key was deleted.
+    WAL_EXPIRY  // A key has an expiry time. Written at the start of a new log for every key with a TTL.
+};
+
+/**
+ * A record read back from the write-ahead log.
+ */
+struct WalRecord {
+    WalRecordType type;
+    std::string key;
+    std::string value;
+    uint64_t expiry; // Expiry time in milliseconds since the epoch, or 0 if the key never expires.
+};
+
+/**
+ * @section DESCRIPTION
+ *
+ * The write-ahead log of a shard. It is a sequence of files named "<shard>-<sequence number>.log" in a
+ * directory, and every file covers what happened since the previous one was started, so files older
+ * than the last checkpoint of the shard can be deleted.
+ *
+ * Writes are group committed: records are appended to a buffer in memory, and the first writer waiting
+ * for its record writes the whole buffer with a single write, and syncs the file if the policy says so,
+ * on behalf of every writer waiting meanwhile. The others only wait for it.
+ *
+ * Record format: [crc32 (4 bytes)][key length (4 bytes)][value length (4 bytes)][type (1 byte)][padding (3 bytes)][expiry (8 bytes)][key][value]
+ * The crc32 covers everything in the record after itself. A record cut short by a crash fails its
+ * check, and ends the replay of its file.
+ *
+ * Thread-safe.
+ */
+class WriteAheadLog {
+  public:
+    /**
+     * Constructor. Starts a new log file. Exits the program if it cannot be made.
+     *
+     * @param _dirPath path to the directory of the log files. Must already exist.
+     * @param _shard the shard of the log.
+     * @param _seq the sequence number of the new file. Must be larger than those of the files already there.
+     * @param _policy when the log is synced. Must not be WAL_OFF.
+     */
+    WriteAheadLog(const std::string &_dirPath, unsigned int _shard, uint64_t _seq, WalSyncPolicy _policy);
+
+    /**
+     * Destructor. Writes and syncs what is still buffered, and closes the file.
+     */
+    ~WriteAheadLog();
+
+    /**
+     * Replay the log files of a shard, oldest first.
+     *
+     * @param dirPath path to the directory of the log files.
+     * @param shard the shard.
+     * @param callback the function called on every record, in order.
+     * @param lastSeq the argument to return the largest sequence number of the files, or 0 if there is none.
+     * @return the number of records replayed.
+     */
+    static unsigned long replay(const std::string &dirPath, unsigned int shard,
+                                const std::function<void(WalRecord &)> &callback, uint64_t &lastSeq);
+
+    /**
+     * Append a record to the buffer. It is only written by a later commit or flush.
+     *
+     * @param type the type of the record.
+     * @param key the key.
+     * @param value the value, for a put.
+     * @param length the length of the value.
+     * @param expiry the expiry time in milliseconds since the epoch, or 0 for none.
+     * @return the position right after the record in the log, to be passed to commit.
+     */
+    uint64_t append(WalRecordType type, const std::string &key, const char *value, size_t length, uint64_t expiry);
+
+    /**
+     * Wait until the log is durable up to a position, as far as the policy goes: written to the file,
+     * or also synced with WAL_SYNC_ALWAYS. Writes it if no other thread is doing so.
+     *
+     * @param position a position returned by append.
+     */
+    void commit(uint64_t position);
+
+    /**
+     * Write everything buffered, and optionally sync the file.
+     *
+     * @param sync whether to sync the file too.
+     */
+    void flush(bool sync);
+
+    /**
+     * Write and sync everything buffered, and start a new file. Records appended from then on go to the new file.
+     *
+     * @return the sequence number of the old file.
+     */
+    uint64_t rotate();
+
+    /**
+     * Delete the files of the shard up to a sequence number.
+     *
+     * @param seq the sequence number of the last file to be deleted.
+     */
+    void removeFiles(uint64_t seq);
+
+    /**
+     * @return the number of bytes appended to the current file, including those still buffered.
+     */
+    inline uint64_t size() const {
+        return fileBytes.load(std::memory_order_relaxed);
+    }
+
+    std::atomic<unsigned long> records; // Number of records appended.
+    std::atomic<unsigned long> writes; // Number of writes to the file, each of which commits a group of records.
+    std::atomic<unsigned long> syncs; // Number of syncs of the file.
+
+  private:
+    // Open the file of the current sequence number.
+    void open();
+
+    // Write the buffer, and sync the file if sync. Needs lock, which is released during the IO.
+    void writeOut(bool sync);
+
+    const std::string dirPath;
+    const unsigned int shard;
+    const WalSyncPolicy policy;
+    uint64_t seq; // Sequence number of the current file.
+    int fd;
+    std::string buffer; // Records appended but not written yet.
+    std::string writing; // Records being written by the leader of a group. Kept to reuse its memory.
+    bool busy; // Whether a thread is writing.
+    uint64_t appended; // Position after the last record appended, over all the files of the log.
+    uint64_t written; // Position up to which the log is written.
+    uint64_t synced; // Position up to which the log is synced.
+    std::atomic<uint64_t> fileBytes;
+    pthread_mutex_t lock; // Protects the members above, except what the writing thread touches during its IO.
+    pthread_cond_t done; // Signaled when a write is done.
+};
+
+} // namespace multicore